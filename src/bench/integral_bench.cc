@@ -0,0 +1,520 @@
+#include <cxxopts.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+#include <image_integrator/image_integrator.hh>
+#include <image_integrator/integral_query.hh>
+#include <image_integrator/volume_query.hh>
+#include <image_integrator/window_integrator.hh>
+
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed_ms(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(
+            Clock::now() - start).count();
+}
+
+static const char* page_mode_name(PageMode mode) {
+    switch (mode) {
+    case PageMode::normal: return "normal";
+    case PageMode::transparent_huge: return "thp";
+    case PageMode::explicit_huge: return "hugetlb";
+    }
+    return "";
+}
+
+/// Create square noise image with given count of megapixels
+static std::string create_image(const std::string& dir, int megapixels) {
+    const int side = int(std::sqrt(megapixels * 1e6));
+    cv::Mat image(side, side, CV_8UC3);
+    std::mt19937 rng{42};
+    for (size_t i = 0; i < image.total() * image.elemSize(); i++) {
+        image.data[i] = rng() & 0xff;
+    }
+    const std::string path = 
+        dir + "/bench_" + std::to_string(megapixels) + "mp.tif";
+    cv::imwrite(path, image);
+    return path;
+}
+
+/// Compare page modes on images of different size, nothing is written
+static void bench_page_modes(
+        const std::vector<int>& sizes, 
+        const std::string& dir,
+        int thread_count,
+        int repeat
+) {
+    const PageMode modes[] = {
+        PageMode::normal, 
+        PageMode::transparent_huge, 
+        PageMode::explicit_huge
+    };
+    std::cout << "size_mp\tpages\tdecode_ms\ttotal_ms\tintegrate_ms" 
+        << std::endl;
+    for (int megapixels : sizes) {
+        const std::string path = create_image(dir, megapixels);
+
+        auto start = Clock::now();
+        for (int i = 0; i < repeat; i++) {
+            cv::imread(path, cv::IMREAD_COLOR);
+        }
+        const double decode_ms = elapsed_ms(start) / repeat;
+
+        for (PageMode mode : modes) {
+            ImageIntegrator ii;
+            ii.try_init(thread_count);
+            ii.set_output_format(ImageIntegrator::OutputFormat::none);
+            ii.set_page_mode(mode);
+            start = Clock::now();
+            for (int i = 0; i < repeat; i++) {
+                ii.process(path);
+                ii.wait();
+            }
+            const double total_ms = elapsed_ms(start) / repeat;
+            std::cout << megapixels << '\t' << page_mode_name(mode) << '\t' 
+                << decode_ms << '\t' << total_ms << '\t' 
+                << total_ms - decode_ms << std::endl;
+        }
+        std::remove(path.c_str());
+    }
+}
+
+/**
+ *  Compare throughput of small images processed by blocks, in batches with 
+ *  separate output files and in batches with container file
+ */
+static void bench_small_images(
+        int count, 
+        int side, 
+        const std::string& dir,
+        int thread_count,
+        int batch_size
+) {
+    std::mt19937 rng{42};
+    std::vector<std::string> paths;
+    //binary PPM is cheap to decode, so per-image overhead is measured
+    for (int i = 0; i < count; i++) {
+        paths.push_back(dir + "/bench_thumb_" + std::to_string(i) + ".ppm");
+        std::ofstream fout{paths.back(), std::ios::binary};
+        fout << "P6\n" << side << ' ' << side << "\n255\n";
+        for (int j = 0; j < side * side * 3; j++) {
+            fout.put(char(rng() & 0xff));
+        }
+    }
+    const std::string container_path = dir + "/bench_thumbs.integral.pack";
+
+    std::cout << "mode	images	total_ms	images_per_s	us_per_image" 
+        << std::endl;
+    const char* const modes[] = {"blocks", "batch", "container"};
+    for (const char* mode : modes) {
+        const std::string name = mode;
+        ImageIntegrator ii;
+        ii.try_init(thread_count);
+        ii.set_output_format(ImageIntegrator::OutputFormat::mapped);
+        if (name != "blocks") {
+            ii.set_batching(size_t(side) * side, batch_size);
+        }
+        if (name == "container") {
+            ii.try_open_container(container_path);
+        }
+        auto start = Clock::now();
+        for (const std::string& path : paths) {
+            ii.process(path);
+        }
+        ii.wait();
+        ii.close_container();
+        const double total_ms = elapsed_ms(start);
+        std::cout << name << '\t' << count << '\t' << total_ms << '\t' 
+            << count / total_ms * 1e3 << '\t' << total_ms * 1e3 / count 
+            << std::endl;
+    }
+
+    for (const std::string& path : paths) {
+        std::remove(path.c_str());
+        std::remove((path + ".integral.bin").c_str());
+    }
+    std::remove(container_path.c_str());
+}
+
+/**
+ *  Compare rate of box sums computed one by one and in batches over integral 
+ *  images of different size, boxes are like windows of detector
+ */
+static void bench_queries(
+        const std::vector<int>& sizes, 
+        int thread_count,
+        int query_count
+) {
+    std::cout << "size_mp\tmode\tqueries\ttotal_ms\tmqueries_per_s" << std::endl;
+    for (int megapixels : sizes) {
+        const int side = int(std::sqrt(megapixels * 1e6));
+        cv::Mat image(side, side, CV_8UC1);
+        std::mt19937 rng{42};
+        for (size_t i = 0; i < image.total(); i++) {
+            image.data[i] = rng() & 0xff;
+        }
+        ImageIntegrator ii;
+        ii.try_init(thread_count);
+        IntegralQuery query;
+        query.try_attach(ii.integrate(image).get());
+
+        std::vector<cv::Rect> rects(query_count);
+        for (cv::Rect& rect : rects) {
+            const int size = 16 + rng() % 48;
+            rect = cv::Rect(rng() % (side - size), rng() % (side - size), 
+                    size, size);
+        }
+        std::vector<double> sums(query_count);
+        const char* const modes[] = {"single", "batch"};
+        for (const char* mode : modes) {
+            const std::string name = mode;
+            auto start = Clock::now();
+            if (name == "single") {
+                for (int i = 0; i < query_count; i++) {
+                    sums[i] = query.sum(rects[i]);
+                }
+            } else {
+                query.sum_many(rects.data(), rects.size(), sums.data());
+            }
+            const double total_ms = elapsed_ms(start);
+            std::cout << megapixels << '\t' << name << '\t' << query_count 
+                << '\t' << total_ms << '\t' << query_count / total_ms / 1e3 
+                << std::endl;
+        }
+    }
+}
+
+/**
+ *  Compare latency of update() of small edits at different places of image 
+ *  with integration of whole image
+ */
+static void bench_updates(
+        const std::vector<int>& sizes, 
+        int thread_count,
+        int repeat_count
+) {
+    std::cout << "size_mp\tedit\tdirty\tms" << std::endl;
+    for (int megapixels : sizes) {
+        const int side = int(std::sqrt(megapixels * 1e6));
+        cv::Mat image(side, side, CV_8UC3);
+        std::mt19937 rng{42};
+        for (size_t i = 0; i < image.total() * 3; i++) {
+            image.data[i] = rng() & 0xff;
+        }
+        ImageIntegrator ii;
+        ii.try_init(thread_count);
+        cv::Mat integral = ii.integrate(image).get();
+        auto start = Clock::now();
+        for (int i = 0; i < repeat_count; i++) {
+            ii.integrate(image, ImageIntegrator::OutputSpec{integral}).get();
+        }
+        std::cout << megapixels << "\tfull\t" << side << '\t' 
+            << elapsed_ms(start) / repeat_count << std::endl;
+
+        struct Edit {
+            const char* name;
+            double place;
+            int size;
+        };
+        const Edit edits[] = {
+            {"top_left", 0.0, 64}, {"center", 0.5, 64}, 
+            {"bottom_right", 1.0, 64}, {"center", 0.5, 1024}
+        };
+        for (const Edit& edit : edits) {
+            const int offset = int((side - edit.size) * edit.place);
+            const cv::Rect dirty(offset, offset, edit.size, edit.size);
+            cv::Mat pixels(edit.size, edit.size, CV_8UC3);
+            start = Clock::now();
+            for (int i = 0; i < repeat_count; i++) {
+                for (size_t j = 0; j < pixels.total() * 3; j++) {
+                    pixels.data[j] = rng() & 0xff;
+                }
+                ii.update(image, integral, dirty, pixels).get();
+            }
+            std::cout << megapixels << '\t' << edit.name << '\t' 
+                << edit.size << '\t' << elapsed_ms(start) / repeat_count 
+                << std::endl;
+        }
+    }
+}
+
+/**
+ *  Compare time to first box sum of lazy integral image at different places 
+ *  of image with integration of whole image
+ */
+static void bench_lazy(const std::vector<int>& sizes, int thread_count) {
+    std::cout << "size_mp\tquery\tms\tblocks" << std::endl;
+    for (int megapixels : sizes) {
+        const int side = int(std::sqrt(megapixels * 1e6));
+        cv::Mat image(side, side, CV_8UC1);
+        std::mt19937 rng{42};
+        for (size_t i = 0; i < image.total(); i++) {
+            image.data[i] = rng() & 0xff;
+        }
+        ImageIntegrator ii;
+        ii.try_init(thread_count);
+        auto start = Clock::now();
+        ii.integrate(image).get();
+        std::cout << megapixels << "\tfull\t" << elapsed_ms(start) << std::endl;
+
+        const int box = 256;
+        const double places[] = {0.0, 0.25, 0.5, 1.0};
+        for (double place : places) {
+            start = Clock::now();
+            std::shared_ptr<ImageIntegrator::LazyIntegral> lazy = 
+                ii.integrate_lazy(image);
+            const int offset = int((side - box) * place);
+            lazy->sum(cv::Rect(offset, offset, box, box));
+            std::cout << megapixels << "\tat_" << place << '\t' 
+                << elapsed_ms(start) << '\t' 
+                << lazy->get_integrated_block_count() << std::endl;
+        }
+    }
+}
+
+/**
+ *  Measure time per frame of sums over sliding window of frames for 
+ *  different window sizes
+ */
+static void bench_window(
+        const std::vector<int>& sizes, 
+        int thread_count,
+        int frame_count
+) {
+    std::cout << "size_mp\twindow\tms_per_frame" << std::endl;
+    for (int megapixels : sizes) {
+        const int side = int(std::sqrt(megapixels * 1e6));
+        std::mt19937 rng{42};
+        std::vector<cv::Mat> frames(8);
+        for (cv::Mat& frame : frames) {
+            frame.create(side, side, CV_8UC1);
+            for (size_t i = 0; i < frame.total(); i++) {
+                frame.data[i] = rng() & 0xff;
+            }
+        }
+        ImageIntegrator ii;
+        ii.try_init(thread_count);
+        const int window_sizes[] = {1, 8, 64};
+        for (int window_size : window_sizes) {
+            WindowIntegrator window{ii, window_size};
+            //window is filled before timing
+            for (int i = 0; i < window_size; i++) {
+                window.try_push(frames[i % frames.size()]);
+            }
+            const auto start = Clock::now();
+            for (int i = 0; i < frame_count; i++) {
+                window.try_push(frames[i % frames.size()]);
+            }
+            std::cout << megapixels << '\t' << window_size << '\t' 
+                << elapsed_ms(start) / frame_count << std::endl;
+        }
+    }
+}
+
+/**
+ *  Measure in-memory integration of images of each supported depth with one 
+ *  and three channels
+ */
+static void bench_depths(
+        const std::vector<int>& sizes, 
+        int thread_count,
+        int repeat
+) {
+    const int depths[] = {CV_8U, CV_16U, CV_32F, CV_64F};
+    const char* const depth_names[] = {"8U", "16U", "32F", "64F"};
+    const int channel_counts[] = {1, 3};
+    std::cout << "size_mp\tdepth\tchannels\tms\tmvalues_per_s" << std::endl;
+    for (int megapixels : sizes) {
+        const int side = int(std::sqrt(megapixels * 1e6));
+        ImageIntegrator ii;
+        ii.try_init(thread_count);
+        for (int d = 0; d < 4; d++) {
+            for (int channel_count : channel_counts) {
+                cv::Mat image(side, side, 
+                        CV_MAKETYPE(depths[d], channel_count));
+                //small integers are exact in every depth
+                std::mt19937 rng{42};
+                const size_t value_count = image.total() * channel_count;
+                for (size_t i = 0; i < value_count; i++) {
+                    const int value = rng() & 0xff;
+                    switch (depths[d]) {
+                    case CV_8U: image.ptr<uint8_t>()[i] = value; break;
+                    case CV_16U: image.ptr<uint16_t>()[i] = value; break;
+                    case CV_32F: image.ptr<float>()[i] = value; break;
+                    case CV_64F: image.ptr<double>()[i] = value; break;
+                    }
+                }
+                ImageIntegrator::OutputSpec spec;
+                spec.destination = ii.integrate(image).get();
+                double best_ms = 0;
+                for (int r = 0; r < repeat; r++) {
+                    const auto start = Clock::now();
+                    ii.integrate(image, spec).get();
+                    const double ms = elapsed_ms(start);
+                    best_ms = r == 0 ? ms : std::min(best_ms, ms);
+                }
+                std::cout << megapixels << '\t' << depth_names[d] << '\t' 
+                    << channel_count << '\t' << best_ms << '\t' 
+                    << value_count / best_ms / 1e3 << std::endl;
+            }
+        }
+    }
+}
+
+/**
+ *  Measure integration of cubic volumes into table in memory and into 
+ *  mapped table file, then cuboid sums of table file. Table in memory is 
+ *  skipped if it doesn't fit in half of physical memory.
+ */
+static void bench_volumes(
+        const std::vector<int>& sides, 
+        const std::string& dir,
+        int thread_count,
+        int query_count
+) {
+    const double memory_size = 
+        double(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+    std::cout << "side\tmode\ttotal_ms\tmillions_per_s" << std::endl;
+    for (int side : sides) {
+        const int sizes[] = {side, side, side};
+        cv::Mat volume(3, sizes, CV_8UC1);
+        std::mt19937 rng{42};
+        for (size_t i = 0; i < volume.total(); i++) {
+            volume.data[i] = rng() & 0xff;
+        }
+        ImageIntegrator ii;
+        ii.try_init(thread_count);
+        const double voxels = double(volume.total());
+        const std::string path = 
+            dir + "/bench_" + std::to_string(side) + ".volume.bin";
+
+        if (voxels * sizeof(double) < memory_size / 2) {
+            auto start = Clock::now();
+            const bool is_done = !ii.integrate_volume(volume).get().empty();
+            const double total_ms = elapsed_ms(start);
+            std::cout << side << "\tmemory\t" << (is_done ? total_ms : -1) 
+                << '\t' << voxels / total_ms / 1e3 << std::endl;
+        }
+        auto start = Clock::now();
+        const bool is_done = ii.process_volume(volume, path).get();
+        const double total_ms = elapsed_ms(start);
+        std::cout << side << "\tfile\t" << (is_done ? total_ms : -1) << '\t' 
+            << voxels / total_ms / 1e3 << std::endl;
+        volume.release();
+
+        VolumeQuery query;
+        if (is_done && query.try_open(path)) {
+            start = Clock::now();
+            for (int i = 0; i < query_count; i++) {
+                const int size = 8 + rng() % 56;
+                query.sum(Cuboid(rng() % (side - size), 
+                            rng() % (side - size), rng() % (side - size), 
+                            size, size, size));
+            }
+            const double query_ms = elapsed_ms(start);
+            std::cout << side << "\tquery\t" << query_ms << '\t' 
+                << query_count / query_ms / 1e3 << std::endl;
+        }
+        std::remove(path.c_str());
+    }
+}
+
+int main(int argc, char** argv) 
+{
+    cxxopts::Options options("integral_bench", "benchmarks of integrator");
+
+    options.add_options()
+        ("h,help", "print help")
+        ("b,bench", "benchmark to run: pages, small, query, update, lazy, "
+            "window, volume or depth", 
+            cxxopts::value<std::string>()->default_value("pages"))
+        ("t,threads", "thread count", cxxopts::value<int>()->default_value("0"))
+        ("s,sizes", "image sizes in megapixels", 
+            cxxopts::value<std::vector<int>>()->default_value("10,30,100"))
+        ("r,repeat", "repeat count", cxxopts::value<int>()->default_value("3"))
+        ("d,dir", "directory for temporary images", 
+            cxxopts::value<std::string>()->default_value("."))
+        ("n,count", "count of small images", 
+            cxxopts::value<int>()->default_value("5000"))
+        ("thumb-size", "side of small images", 
+            cxxopts::value<int>()->default_value("64"))
+        ("batch-size", "count of small images in batch", 
+            cxxopts::value<int>()->default_value("64"))
+        ("queries", "count of box sums", 
+            cxxopts::value<int>()->default_value("10000000"))
+        ("volume-sides", "sides of cubic volumes", 
+            cxxopts::value<std::vector<int>>()->default_value("512,1024"))
+    ;
+
+    auto parse_result = options.parse(argc, argv);
+
+    if (parse_result.count("help"))
+    {
+      std::cout << options.help() << std::endl;
+      return 0;
+    }
+
+    const std::string bench = parse_result["bench"].as<std::string>();
+    if (bench == "pages") {
+        bench_page_modes(
+                parse_result["sizes"].as<std::vector<int>>(),
+                parse_result["dir"].as<std::string>(),
+                parse_result["threads"].as<int>(),
+                parse_result["repeat"].as<int>()
+        );
+    } else if (bench == "small") {
+        bench_small_images(
+                parse_result["count"].as<int>(),
+                parse_result["thumb-size"].as<int>(),
+                parse_result["dir"].as<std::string>(),
+                parse_result["threads"].as<int>(),
+                parse_result["batch-size"].as<int>()
+        );
+    } else if (bench == "query") {
+        bench_queries(
+                parse_result["sizes"].as<std::vector<int>>(),
+                parse_result["threads"].as<int>(),
+                parse_result["queries"].as<int>()
+        );
+    } else if (bench == "update") {
+        bench_updates(
+                parse_result["sizes"].as<std::vector<int>>(),
+                parse_result["threads"].as<int>(),
+                parse_result["repeat"].as<int>()
+        );
+    } else if (bench == "lazy") {
+        bench_lazy(
+                parse_result["sizes"].as<std::vector<int>>(),
+                parse_result["threads"].as<int>()
+        );
+    } else if (bench == "window") {
+        bench_window(
+                parse_result["sizes"].as<std::vector<int>>(),
+                parse_result["threads"].as<int>(),
+                parse_result["count"].as<int>()
+        );
+    } else if (bench == "depth") {
+        bench_depths(
+                parse_result["sizes"].as<std::vector<int>>(),
+                parse_result["threads"].as<int>(),
+                parse_result["repeat"].as<int>()
+        );
+    } else if (bench == "volume") {
+        bench_volumes(
+                parse_result["volume-sides"].as<std::vector<int>>(),
+                parse_result["dir"].as<std::string>(),
+                parse_result["threads"].as<int>(),
+                parse_result["queries"].as<int>()
+        );
+    } else {
+        std::cout << "unknown benchmark: " << bench << std::endl;
+    }
+    return 0;
+}
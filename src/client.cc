@@ -0,0 +1,171 @@
+#include <cxxopts.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <job_server/job_protocol.hh>
+
+/// Connect to server socket, returns -1 on error
+static int connect_to(const std::string& socket_path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), 
+                sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// Send requests to query server and print replies, returns exit code
+static int run_queries(int fd, const std::vector<QueryRequest>& requests) {
+    for (const QueryRequest& request : requests) {
+        if (!write_message(fd, encode_query(request))) {
+            std::cerr << "server closed connection" << std::endl;
+            return 1;
+        }
+    }
+    //replies of one connection come in order of requests
+    int failed = 0;
+    for (const QueryRequest& request : requests) {
+        std::string payload;
+        QueryReply reply;
+        if (!read_message(fd, payload) || 
+                !try_decode_query_reply(payload, reply)) {
+            std::cerr << "broken reply" << std::endl;
+            return 1;
+        }
+        if (request.kind == QueryRequest::Kind::stats) {
+            std::cout << reply.text;
+            continue;
+        }
+        std::cout << request.path << ": " << 
+            (reply.success ? "ok" : "failed");
+        for (double sum : reply.sums) {
+            std::cout << ' ' << sum;
+        }
+        std::cout << std::endl;
+        failed += reply.success ? 0 : 1;
+    }
+    close(fd);
+    return failed > 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) 
+{
+    cxxopts::Options options("integrate_client", 
+            "send images to integrate_image --serve or query integral images "
+            "of integrate_image --query-serve");
+
+    options.add_options()
+        ("h,help", "print help")
+        ("s,socket", "socket of server", cxxopts::value<std::string>())
+        ("i,image", "input image", cxxopts::value<std::vector<std::string>>())
+        ("blob", "send content of images instead of paths")
+        ("reply", "receive integral images in replies and print them")
+        ("rects", "query sums of rectangles x,y,w,h,... in images", 
+            cxxopts::value<std::vector<int>>())
+        ("channel", "channel of queried sums", 
+            cxxopts::value<int>()->default_value("0"))
+        ("pin", "keep integral images of images in cache of query server")
+        ("unpin", "allow eviction of integral images of images")
+        ("stats", "print statistics of query server")
+    ;
+
+    auto parse_result = options.parse(argc, argv);
+
+    if (parse_result.count("help") || !parse_result.count("socket"))
+    {
+      std::cout << options.help() << std::endl;
+      return 0;
+    }
+
+    const int fd = connect_to(parse_result["socket"].as<std::string>());
+    if (fd < 0) {
+        std::cerr << "can't connect to server" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> images;
+    if (parse_result.count("image")) {
+        images = parse_result["image"].as<std::vector<std::string>>();
+    }
+    if (parse_result.count("rects") || parse_result.count("pin") || 
+            parse_result.count("unpin") || parse_result.count("stats")) {
+        QueryRequest request;
+        if (parse_result.count("rects")) {
+            request.kind = QueryRequest::Kind::sums;
+            request.channel = parse_result["channel"].as<int>();
+            for (int value : parse_result["rects"].as<std::vector<int>>()) {
+                request.rects.push_back(value);
+            }
+        } else if (parse_result.count("pin")) {
+            request.kind = QueryRequest::Kind::pin;
+        } else if (parse_result.count("unpin")) {
+            request.kind = QueryRequest::Kind::unpin;
+        } else {
+            //only statistics are asked
+            images.clear();
+        }
+        std::vector<QueryRequest> requests;
+        for (size_t i = 0; i < images.size(); i++) {
+            request.id = i;
+            request.path = images[i];
+            requests.push_back(request);
+        }
+        if (parse_result.count("stats")) {
+            request.id = images.size();
+            request.kind = QueryRequest::Kind::stats;
+            requests.push_back(request);
+        }
+        return run_queries(fd, requests);
+    }
+    //requests are pipelined, replies come in order of completion
+    for (size_t i = 0; i < images.size(); i++) {
+        JobRequest request;
+        request.id = i;
+        request.path = images[i];
+        request.output = parse_result.count("reply") ? 
+            JobRequest::Output::reply : JobRequest::Output::files;
+        if (parse_result.count("blob")) {
+            std::ifstream fin{images[i], std::ios::binary};
+            request.source = JobRequest::Source::blob;
+            request.blob.assign(std::istreambuf_iterator<char>(fin), 
+                    std::istreambuf_iterator<char>());
+        }
+        if (!write_message(fd, encode_request(request))) {
+            std::cerr << "server closed connection" << std::endl;
+            return 1;
+        }
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        std::string payload;
+        JobReply reply;
+        if (!read_message(fd, payload) || !try_decode_reply(payload, reply) || 
+                reply.id >= images.size()) {
+            std::cerr << "broken reply" << std::endl;
+            return 1;
+        }
+        std::cout << images[reply.id] << ": " << 
+            (reply.success ? "ok" : "failed") << ", " << reply.total_ms << 
+            " ms" << std::endl;
+        std::cout << reply.result;
+        failed += reply.success ? 0 : 1;
+    }
+    close(fd);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+#include <cstdint>
+#include <cstdlib>
+
+#include <sys/mman.h>
+
+#include <image_integrator/buffer_pool.hh>
+#include <multithread_utils/log.hh>
+
+static const size_t huge_page_size = size_t(2) << 20;
+static const size_t alignment = 64;
+
+void* BufferPool::allocate(size_t capacity, PageMode mode) {
+    if (mode == PageMode::normal) {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, alignment, capacity) != 0) {
+            return nullptr;
+        }
+        return ptr;
+    }
+
+#ifdef MAP_HUGETLB
+    if (mode == PageMode::explicit_huge) {
+        void* ptr = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, 
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            return ptr;
+        }
+        logger("WARNING: no reserved huge pages, using transparent ones");
+    }
+#endif
+
+    //map more to cut 2 MiB aligned part, so whole block can be huge pages
+    const size_t mapped_size = capacity + huge_page_size;
+    void* mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return nullptr;
+    }
+    const uintptr_t start = reinterpret_cast<uintptr_t>(mapped);
+    const uintptr_t aligned = 
+        (start + huge_page_size - 1) / huge_page_size * huge_page_size;
+    if (aligned != start) {
+        munmap(mapped, aligned - start);
+    }
+    const size_t tail = start + mapped_size - (aligned + capacity);
+    if (tail > 0) {
+        munmap(reinterpret_cast<void*>(aligned + capacity), tail);
+    }
+    void* ptr = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, capacity, MADV_HUGEPAGE);
+#endif
+    return ptr;
+}
+
+void BufferPool::deallocate(void* ptr, size_t capacity, PageMode mode) {
+    if (mode == PageMode::normal) {
+        std::free(ptr);
+    } else {
+        munmap(ptr, capacity);
+    }
+}
+
+size_t BufferPool::size_class(size_t size) {
+    const size_t min_class = 4096;
+    if (size <= min_class) {
+        return min_class;
+    }
+    size_t power = 1;
+    while (power < size / 4) {
+        power <<= 1;
+    }
+    //step is quarter of the highest power of 2 not greater than size
+    const size_t step = power / 2;
+    return (size + step - 1) / step * step;
+}
+
+void* BufferPool::acquire(size_t size, PageMode mode, size_t& capacity) {
+    capacity = size_class(size);
+    if (mode != PageMode::normal) {
+        capacity = (capacity + huge_page_size - 1) / huge_page_size * 
+            huge_page_size;
+    }
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        auto it = blocks.find(BlockClass(capacity, mode));
+        if (it != blocks.end() && !it->second.empty()) {
+            void* ptr = it->second.back();
+            it->second.pop_back();
+            retained -= capacity;
+            hits++;
+            return ptr;
+        }
+        misses++;
+    }
+    return allocate(capacity, mode);
+}
+
+void BufferPool::release(void* ptr, PageMode mode, size_t capacity) {
+    if (ptr == nullptr) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        if (retained + capacity <= limit) {
+            blocks[BlockClass(capacity, mode)].push_back(ptr);
+            retained += capacity;
+            return;
+        }
+    }
+    deallocate(ptr, capacity, mode);
+}
+
+void BufferPool::clear() {
+    std::unique_lock<std::mutex> lock{mtx};
+    for (auto& size_blocks : blocks) {
+        for (void* ptr : size_blocks.second) {
+            deallocate(ptr, size_blocks.first.first, size_blocks.first.second);
+        }
+    }
+    blocks.clear();
+    retained = 0;
+}
+
+void BufferPool::set_limit(size_t limit) {
+    std::unique_lock<std::mutex> lock{mtx};
+    this->limit = limit;
+    trim();
+}
+
+void BufferPool::trim() {
+    for (auto& size_blocks : blocks) {
+        const size_t capacity = size_blocks.first.first;
+        while (retained > limit && !size_blocks.second.empty()) {
+            deallocate(size_blocks.second.back(), capacity, 
+                    size_blocks.first.second);
+            size_blocks.second.pop_back();
+            retained -= capacity;
+        }
+    }
+}
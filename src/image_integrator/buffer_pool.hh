@@ -0,0 +1,75 @@
+#ifndef BUFFER_POOL_HH
+#define BUFFER_POOL_HH
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// Kind of pages used for pooled memory
+enum class PageMode {
+    /// regular heap memory aligned to 64 bytes
+    normal,
+    /// 2 MiB aligned anonymous mapping advised to use transparent huge pages
+    transparent_huge,
+    /// mapping backed by reserved huge pages (MAP_HUGETLB), falls back to 
+    /// transparent huge pages if none are reserved
+    explicit_huge
+};
+
+/// Threadsafe pool of big memory blocks grouped by size classes
+/**
+ *  Released blocks are kept for reuse until retained size reaches the limit. 
+ *  Memory isn't initialized neither on allocation nor on reuse.
+ */
+class BufferPool {
+public:
+    BufferPool() = default;
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator= (const BufferPool&) = delete;
+    ~BufferPool() { clear(); }
+
+    /**
+     *  Get block of at least size bytes
+     *  \param[in] size Required size
+     *  \param[in] mode Kind of pages
+     *  \param[out] capacity Real size of block, it must be passed to release
+     *  \return pointer to block aligned at least to 64 bytes or nullptr if 
+     *  allocation failed
+     */
+    void* acquire(size_t size, PageMode mode, size_t& capacity);
+    /// Return block to pool or free it if pool is full
+    void release(void* ptr, PageMode mode, size_t capacity);
+    /// Free all retained blocks
+    void clear();
+
+    /// set max size of retained blocks, 0 disables pooling (default)
+    void set_limit(size_t limit);
+    size_t get_limit() const { return limit; }
+    size_t get_retained() const { return retained; }
+    /// count of acquire calls served by retained block
+    size_t get_hits() const { return hits; }
+    /// count of acquire calls which allocated new block
+    size_t get_misses() const { return misses; }
+
+    /// Size of blocks used for given size, it exceeds size by less than 1/4
+    static size_t size_class(size_t size);
+
+private:
+    typedef std::pair<size_t, PageMode> BlockClass;
+
+    static void* allocate(size_t capacity, PageMode mode);
+    static void deallocate(void* ptr, size_t capacity, PageMode mode);
+    void trim();
+
+    std::mutex mtx;
+    /// retained blocks by size class and page mode
+    std::map<BlockClass, std::vector<void*>> blocks;
+    size_t limit = 0;
+    size_t retained = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+#endif
@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <image_integrator/engine_tuner.hh>
+#include <multithread_utils/log.hh>
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+/// Parse size of cache from sysfs, like "32K" or "16M"
+size_t parse_cache_size(const std::string& str) {
+    size_t pos = 0;
+    size_t size = std::stoul(str, &pos);
+    if (pos < str.size()) {
+        switch (str[pos]) {
+        case 'K': size <<= 10; break;
+        case 'M': size <<= 20; break;
+        case 'G': size <<= 30; break;
+        }
+    }
+    return size;
+}
+
+/// Read sizes of data and unified caches of first CPU from sysfs
+void read_sysfs_caches(CacheInfo& info) {
+    for (int index = 0; index < 8; index++) {
+        const std::string dir = 
+            "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index);
+        std::ifstream level_file{dir + "/level"};
+        std::ifstream type_file{dir + "/type"};
+        std::ifstream size_file{dir + "/size"};
+        int level = 0;
+        std::string type;
+        std::string size;
+        if (!(level_file >> level) || !(type_file >> type) || 
+                !(size_file >> size)) {
+            break;
+        }
+        if (type == "Instruction") {
+            continue;
+        }
+        switch (level) {
+        case 1: info.l1d = parse_cache_size(size); break;
+        case 2: info.l2 = parse_cache_size(size); break;
+        case 3: info.l3 = parse_cache_size(size); break;
+        }
+    }
+}
+
+/**
+ *  Integrate image block by block in one thread the same way as wavefront 
+ *  does, channels are interleaved
+ */
+void integrate_blocks(
+        const std::vector<uint8_t>& data, 
+        std::vector<double>& res, 
+        int width, 
+        int height, 
+        int channels, 
+        int block_width, 
+        int block_height
+) {
+    const size_t stride = size_t(width) * channels;
+    for (int c = 0; c < channels; c++) {
+        for (int y0 = 0; y0 < height; y0 += block_height) {
+            for (int x0 = 0; x0 < width; x0 += block_width) {
+                const int y1 = std::min(height, y0 + block_height);
+                const int x1 = std::min(width, x0 + block_width);
+                for (int y = y0; y < y1; y++) {
+                    double* row = &res[y * stride + c];
+                    const double* upper = y > 0 ? row - stride : nullptr;
+                    //sum of row left of block
+                    double acc = 0.0;
+                    if (x0 > 0) {
+                        acc = row[(x0 - 1) * channels];
+                        if (upper != nullptr) {
+                            acc -= upper[(x0 - 1) * channels];
+                        }
+                    }
+                    const uint8_t* values = &data[y * stride + c];
+                    for (int x = x0; x < x1; x++) {
+                        acc += values[x * channels];
+                        row[x * channels] = 
+                            (upper != nullptr ? upper[x * channels] : 0.0) + acc;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Best of several runs of integrate_blocks, nanoseconds
+double time_blocks(
+        int width, 
+        int height, 
+        int channels, 
+        int block_width, 
+        int block_height, 
+        int repeat
+) {
+    std::vector<uint8_t> data(size_t(width) * height * channels);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = uint8_t(i * 131);
+    }
+    std::vector<double> res(data.size());
+    double best = std::numeric_limits<double>::max();
+    for (int run = 0; run < 3; run++) {
+        const auto start = Clock::now();
+        for (int i = 0; i < repeat; i++) {
+            integrate_blocks(data, res, width, height, channels, 
+                    block_width, block_height);
+        }
+        const double ns = std::chrono::duration<double, std::nano>(
+                Clock::now() - start).count() / repeat;
+        best = std::min(best, ns);
+    }
+    return best;
+}
+
+class TaskEmpty : public ThreadPool::Task {
+public:
+    TaskEmpty(ThreadPool* task_pool) 
+    : Task(task_pool) 
+    {}
+
+    void execute() override {}
+};
+
+}
+
+CacheInfo CacheInfo::detect() {
+    CacheInfo info;
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+    info.l1d = std::max(sysconf(_SC_LEVEL1_DCACHE_SIZE), 0L);
+    info.l2 = std::max(sysconf(_SC_LEVEL2_CACHE_SIZE), 0L);
+    info.l3 = std::max(sysconf(_SC_LEVEL3_CACHE_SIZE), 0L);
+#endif
+    if (info.l2 == 0) {
+        read_sysfs_caches(info);
+    }
+    return info;
+}
+
+void EngineTuner::calibrate(ThreadPool& pool) {
+    const int channels = 3;
+    //small image is in cache, extra rows of narrow blocks give row cost
+    const int small_side = 64;
+    const int repeat = 200;
+    const double wide_ns = time_blocks(small_side, small_side, channels, 
+            small_side, small_side, repeat);
+    const int narrow_width = 8;
+    const double narrow_ns = time_blocks(small_side, small_side, channels, 
+            narrow_width, small_side, repeat);
+    const double rows = double(small_side) * channels;
+    const double extra_rows = rows * (small_side / narrow_width - 1);
+    const double values = double(small_side) * small_side * channels;
+    calibration.row_ns = std::max((narrow_ns - wide_ns) / extra_rows, 0.0);
+    calibration.value_ns = 
+        std::max((wide_ns - rows * calibration.row_ns) / values, 0.01);
+
+    //big image with whole rows as blocks is read from memory
+    const int big_side = 1536;
+    const double big_ns = time_blocks(big_side, big_side, channels, 
+            big_side, big_side, 1);
+    const double big_values = double(big_side) * big_side * channels;
+    calibration.memory_value_ns = std::max(
+            (big_ns - double(big_side) * channels * calibration.row_ns) / 
+            big_values, 
+            calibration.value_ns);
+
+    //task cost is paid by all threads together
+    const int task_count = 20000;
+    pool.wait();
+    const auto start = Clock::now();
+    for (int i = 0; i < task_count; i++) {
+        pool.push(new TaskEmpty{&pool});
+    }
+    pool.wait();
+    const double tasks_ns = std::chrono::duration<double, std::nano>(
+            Clock::now() - start).count();
+    calibration.task_ns = 
+        tasks_ns * std::max(pool.get_thread_count(), 1) / task_count;
+    calibrated = true;
+}
+
+bool EngineTuner::try_load(const std::string& path) {
+    std::ifstream fin{path};
+    if (!fin) {
+        return false;
+    }
+    Calibration loaded;
+    int found = 0;
+    std::string key;
+    double value;
+    while (fin >> key >> value) {
+        if (key == "value_ns") {
+            loaded.value_ns = value;
+        } else if (key == "memory_value_ns") {
+            loaded.memory_value_ns = value;
+        } else if (key == "row_ns") {
+            loaded.row_ns = value;
+        } else if (key == "task_ns") {
+            loaded.task_ns = value;
+        } else {
+            continue;
+        }
+        found++;
+    }
+    if (found != 4) {
+        logger("ERROR: calibration file(" + path + ") is incomplete");
+        return false;
+    }
+    calibration = loaded;
+    calibrated = true;
+    return true;
+}
+
+bool EngineTuner::try_save(const std::string& path) const {
+    const size_t slash = path.rfind('/');
+    if (slash != std::string::npos && slash > 0) {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+    std::ofstream fout{path};
+    fout << "value_ns " << calibration.value_ns << std::endl
+        << "memory_value_ns " << calibration.memory_value_ns << std::endl
+        << "row_ns " << calibration.row_ns << std::endl
+        << "task_ns " << calibration.task_ns << std::endl;
+    if (!fout) {
+        logger("ERROR: can't save calibration to " + path);
+        return false;
+    }
+    return true;
+}
+
+double EngineTuner::value_cost(size_t working_set) const {
+    const size_t l2 = cache.l2 > 0 ? cache.l2 : size_t(256) << 10;
+    return working_set <= l2 / 2 ? 
+        calibration.value_ns : calibration.memory_value_ns;
+}
+
+double EngineTuner::predict(
+        const Choice& choice, 
+        int width, 
+        int height, 
+        int channels, 
+        int thread_count, 
+        size_t value_size
+) const {
+    const Calibration& cost = calibration;
+    //input value and integral double per value
+    const size_t total_size = value_size + sizeof(double);
+    const double values = double(width) * height * channels;
+    if (choice.engine == Engine::serial) {
+        return cost.task_ns + double(height) * channels * cost.row_ns + 
+            values * value_cost(values * total_size);
+    }
+
+    const int bw = choice.block_width;
+    const int bh = choice.block_height;
+    const double count_x = std::ceil(double(width) / bw);
+    const double count_y = std::ceil(double(height) / bh);
+    //block touches values of all channels in its rows
+    const double value_ns = value_cost(size_t(bw) * bh * channels * total_size);
+    //each block and each block row (writing) is a task
+    const double work = channels * (
+            (count_x * count_y + count_y) * cost.task_ns + 
+            count_x * height * cost.row_ns + 
+            double(width) * height * value_ns
+    );
+    const double block_ns = cost.task_ns + bh * cost.row_ns + 
+        double(bw) * bh * value_ns;
+    //reading task and setup of block states precede first blocks
+    const double setup_ns = (2 + channels) * cost.task_ns;
+    const double chain = setup_ns + (count_x + count_y - 1) * block_ns;
+    return std::max(work / std::max(thread_count, 1), chain);
+}
+
+EngineTuner::Choice EngineTuner::choose(
+        int width, 
+        int height, 
+        int channels, 
+        int thread_count, 
+        size_t value_size
+) const {
+    Choice best;
+    if (width <= 0 || height <= 0 || channels <= 0) {
+        return best;
+    }
+    best.engine = Engine::serial;
+    double best_ns = 
+        predict(best, width, height, channels, thread_count, value_size);
+
+    static const int widths[] = {16, 32, 64, 128, 256, 512, 1024};
+    static const int heights[] = {8, 16, 32, 64, 128, 256};
+    for (int bw : widths) {
+        for (int bh : heights) {
+            //smaller block already covers whole image
+            if (bw / 2 >= width || bh / 2 >= height) {
+                continue;
+            }
+            Choice choice;
+            choice.block_width = bw;
+            choice.block_height = bh;
+            const double ns = predict(choice, width, height, channels, 
+                    thread_count, value_size);
+            if (ns < best_ns) {
+                best_ns = ns;
+                best = choice;
+            }
+        }
+    }
+    return best;
+}
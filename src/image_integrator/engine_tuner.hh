@@ -0,0 +1,112 @@
+#ifndef ENGINE_TUNER_HH
+#define ENGINE_TUNER_HH
+
+#include <cstddef>
+#include <string>
+
+#include <multithread_utils/thread_pool.hh>
+
+/// Way of computing integral image
+enum class Engine {
+    /// chosen for each image by EngineTuner
+    automatic,
+    /// one task integrates whole image row by row
+    serial,
+    /// blocks are integrated in parallel along anti-diagonals
+    wavefront
+};
+
+/// Data cache sizes of current CPU in bytes, 0 if size is unknown
+struct CacheInfo {
+    size_t l1d = 0;
+    size_t l2 = 0;
+    size_t l3 = 0;
+
+    /// read cache sizes from sysconf or sysfs
+    static CacheInfo detect();
+};
+
+/// Chooses engine and block shape for image with calibrated cost model
+/**
+ *  Time of block is modelled as cost of scheduling its task, cost of each of 
+ *  its rows and cost of each value. Value is cheaper when block together 
+ *  with its input fits into half of L2 cache. Wavefront time is the longest 
+ *  of total work divided by threads and chain of blocks along anti-diagonals 
+ *  which can't be parallelized, the chain starts after setup of image. 
+ *  Serial engine has neither setup nor scheduling cost of blocks.
+ */
+class EngineTuner {
+public:
+    /// Costs measured by calibrate(), all times are in nanoseconds
+    struct Calibration {
+        /// value which is in cache
+        double value_ns = 1.0;
+        /// value which is read from memory
+        double memory_value_ns = 2.0;
+        /// row of block
+        double row_ns = 10.0;
+        /// scheduling and execution of empty task
+        double task_ns = 2000.0;
+    };
+
+    /// Engine and block shape chosen for image
+    struct Choice {
+        Engine engine = Engine::wavefront;
+        int block_width = 64;
+        int block_height = 64;
+    };
+
+    EngineTuner()
+    : cache(CacheInfo::detect())
+    {}
+
+    /**
+     *  Measure costs with micro-benchmarks, it takes a fraction of second
+     *  \param[in] pool Pool whose scheduling cost is measured, it must be 
+     *  idle
+     */
+    void calibrate(ThreadPool& pool);
+    /// Load calibration saved by try_save
+    bool try_load(const std::string& path);
+    /// Save calibration, parent directory is created if it doesn't exist
+    bool try_save(const std::string& path) const;
+    /**
+     *  Choose fastest engine and block shape for image
+     *  \param[in] thread_count Count of threads integrating blocks
+     *  \param[in] value_size Bytes of one value of decoded image
+     */
+    Choice choose(
+            int width, 
+            int height, 
+            int channels, 
+            int thread_count, 
+            size_t value_size = 1
+    ) const;
+    /// Predicted time of processing image with given choice, nanoseconds
+    double predict(
+            const Choice& choice, 
+            int width, 
+            int height, 
+            int channels, 
+            int thread_count, 
+            size_t value_size = 1
+    ) const;
+
+    const Calibration& get_calibration() const { return calibration; }
+    void set_calibration(const Calibration& calibration) { 
+        this->calibration = calibration; 
+    }
+    const CacheInfo& get_cache_info() const { return cache; }
+    void set_cache_info(const CacheInfo& cache) { this->cache = cache; }
+    bool is_calibrated() const { return calibrated; }
+
+private:
+    /// cost of one value of working set of given size
+    double value_cost(size_t working_set) const;
+
+    Calibration calibration;
+    CacheInfo cache;
+    bool calibrated = false;
+};
+
+#endif
@@ -0,0 +1,203 @@
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <streambuf>
+#include <vector>
+
+#include <image_integrator/image_header.hh>
+
+namespace {
+
+/// Read-only buffer of encoded image in memory which supports seeking
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const uint8_t* data, size_t size) {
+        char* begin = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+    pos_type seekoff(
+            off_type off, 
+            std::ios_base::seekdir dir, 
+            std::ios_base::openmode
+    ) override {
+        char* base = dir == std::ios_base::beg ? eback() : 
+            dir == std::ios_base::cur ? gptr() : egptr();
+        if (off < eback() - base || off > egptr() - base) {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), base + off, egptr());
+        return pos_type(gptr() - eback());
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+
+uint32_t be16(const uint8_t* p) { return p[0] << 8 | p[1]; }
+uint32_t be32(const uint8_t* p) { return be16(p) << 16 | be16(p + 2); }
+uint32_t le16(const uint8_t* p) { return p[0] | p[1] << 8; }
+uint32_t le32(const uint8_t* p) { return le16(p) | le16(p + 2) << 16; }
+
+bool read_png(const std::vector<uint8_t>& buf, ImageHeader& header) {
+    static const uint8_t signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    if (buf.size() < 26 || std::memcmp(buf.data(), signature, 8) != 0) {
+        return false;
+    }
+    //IHDR is always first chunk
+    header.width = be32(&buf[16]);
+    header.height = be32(&buf[20]);
+    switch (buf[25]) {
+    case 0: header.channels = 1; break;
+    case 2: header.channels = 3; break;
+    case 3: header.channels = 3; break;
+    case 4: header.channels = 2; break;
+    case 6: header.channels = 4; break;
+    default: return false;
+    }
+    return true;
+}
+
+bool read_jpeg(std::istream& fin, const std::vector<uint8_t>& buf, 
+        ImageHeader& header) {
+    if (buf.size() < 4 || buf[0] != 0xff || buf[1] != 0xd8) {
+        return false;
+    }
+    //walk segments until start of frame
+    uint64_t pos = 2;
+    uint8_t segment[8];
+    while (fin.seekg(pos) && fin.read(reinterpret_cast<char*>(segment), 4)) {
+        if (segment[0] != 0xff) {
+            return false;
+        }
+        const int marker = segment[1];
+        const uint32_t length = be16(segment + 2);
+        const bool is_frame = marker >= 0xc0 && marker <= 0xcf && 
+            marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+        if (is_frame) {
+            if (!fin.read(reinterpret_cast<char*>(segment), 6)) {
+                return false;
+            }
+            header.height = be16(segment + 1);
+            header.width = be16(segment + 3);
+            header.channels = segment[5];
+            return true;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+bool read_bmp(const std::vector<uint8_t>& buf, ImageHeader& header) {
+    if (buf.size() < 30 || buf[0] != 'B' || buf[1] != 'M') {
+        return false;
+    }
+    header.width = int32_t(le32(&buf[18]));
+    header.height = int32_t(le32(&buf[22]));
+    if (header.height < 0) {
+        header.height = -header.height;
+    }
+    header.channels = le16(&buf[28]) == 32 ? 4 : 3;
+    return true;
+}
+
+bool read_pnm(const std::vector<uint8_t>& buf, ImageHeader& header) {
+    if (buf.size() < 2 || buf[0] != 'P' || (buf[1] != '5' && buf[1] != '6')) {
+        return false;
+    }
+    header.channels = buf[1] == '5' ? 1 : 3;
+    int values[2];
+    size_t pos = 2;
+    for (int i = 0; i < 2; i++) {
+        while (pos < buf.size() && (isspace(buf[pos]) || buf[pos] == '#')) {
+            if (buf[pos] == '#') {
+                while (pos < buf.size() && buf[pos] != '\n') {
+                    pos++;
+                }
+            }
+            pos++;
+        }
+        values[i] = 0;
+        while (pos < buf.size() && isdigit(buf[pos])) {
+            values[i] = values[i] * 10 + (buf[pos] - '0');
+            pos++;
+        }
+    }
+    header.width = values[0];
+    header.height = values[1];
+    return true;
+}
+
+bool read_tiff(std::istream& fin, const std::vector<uint8_t>& buf, 
+        ImageHeader& header) {
+    if (buf.size() < 8) {
+        return false;
+    }
+    const bool little_endian = buf[0] == 'I' && buf[1] == 'I';
+    if (!little_endian && (buf[0] != 'M' || buf[1] != 'M')) {
+        return false;
+    }
+    auto get16 = [&] (const uint8_t* p) { 
+        return little_endian ? le16(p) : be16(p); 
+    };
+    auto get32 = [&] (const uint8_t* p) { 
+        return little_endian ? le32(p) : be32(p); 
+    };
+    if (get16(&buf[2]) != 42) {
+        return false;
+    }
+
+    uint8_t count_buf[2];
+    fin.clear();
+    fin.seekg(get32(&buf[4]));
+    if (!fin.read(reinterpret_cast<char*>(count_buf), 2)) {
+        return false;
+    }
+    std::vector<uint8_t> entries(get16(count_buf) * 12);
+    if (!fin.read(reinterpret_cast<char*>(entries.data()), entries.size())) {
+        return false;
+    }
+    header.channels = 1;
+    for (size_t i = 0; i < entries.size(); i += 12) {
+        const uint8_t* entry = &entries[i];
+        //SHORT values are stored in first bytes of value field
+        const uint32_t value = get16(entry + 2) == 3 ? 
+            get16(entry + 8) : get32(entry + 8);
+        switch (get16(entry)) {
+        case 256: header.width = value; break;
+        case 257: header.height = value; break;
+        case 277: header.channels = value; break;
+        }
+    }
+    return true;
+}
+
+}
+
+bool ImageHeader::try_read(const std::string& path) {
+    std::ifstream fin{path, std::ios::binary};
+    return try_read(fin);
+}
+
+bool ImageHeader::try_read(const uint8_t* data, size_t size) {
+    MemoryStreamBuf buf{data, size};
+    std::istream fin{&buf};
+    return try_read(fin);
+}
+
+bool ImageHeader::try_read(std::istream& fin) {
+    std::vector<uint8_t> buf(512);
+    fin.read(reinterpret_cast<char*>(buf.data()), buf.size());
+    buf.resize(fin.gcount());
+    fin.clear();
+
+    const bool readed = read_png(buf, *this) || read_jpeg(fin, buf, *this) || 
+        read_bmp(buf, *this) || read_pnm(buf, *this) || 
+        read_tiff(fin, buf, *this);
+    return readed && width > 0 && height > 0 && channels > 0;
+}
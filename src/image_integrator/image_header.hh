@@ -0,0 +1,27 @@
+#ifndef IMAGE_HEADER_HH
+#define IMAGE_HEADER_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <string>
+
+/// Size of image read from file header without decoding pixels
+struct ImageHeader {
+    int width = 0;
+    int height = 0;
+    /// channels stored in file
+    int channels = 0;
+
+    /**
+     *  Try to read header of PNG, JPEG, BMP, binary PNM or TIFF file
+     *  \param[in] path Path to image
+     */
+    bool try_read(const std::string& path);
+    /// Try to read header of image encoded in memory
+    bool try_read(const uint8_t* data, size_t size);
+    /// Try to read header from the beginning of stream
+    bool try_read(std::istream& fin);
+};
+
+#endif
@@ -1,20 +1,574 @@
 #include <cassert>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <limits>
 #include <memory>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <image_integrator/image_header.hh>
 #include <image_integrator/image_integrator.hh>
+#include <image_integrator/integral_container.hh>
+#include <image_integrator/strip_reader.hh>
 #include <multithread_utils/log.hh>
 
+/// Ask kernel to back 2 MiB aligned part of memory with huge pages
+static void advise_huge_pages(void* data, size_t size, PageMode mode) {
+#ifdef MADV_HUGEPAGE
+    const uintptr_t huge_page_size = uintptr_t(2) << 20;
+    const uintptr_t start = reinterpret_cast<uintptr_t>(data);
+    const uintptr_t begin = 
+        (start + huge_page_size - 1) / huge_page_size * huge_page_size;
+    const uintptr_t end = (start + size) / huge_page_size * huge_page_size;
+    if (mode != PageMode::normal && begin < end) {
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+/**
+ *  Append one row of one channel in text format
+ *  \param[in] row Pointer to value of first pixel in row
+ *  \param[in] stride Distance between values of neighbour pixels
+ */
+static void append_row_text(
+        std::stringstream& ss, 
+        const double* row, 
+        int width, 
+        int stride
+) {
+    for (int x = 0; x < width; x++) {
+        ss << std::fixed << row[x * stride] << ' ';
+    }
+    ss << std::endl;
+}
+
+/// Read whole file into data, returns false if it can't be read
+static bool try_read_file(const std::string& path, std::vector<uint8_t>& data) {
+    std::ifstream fin{path, std::ios::binary | std::ios::ate};
+    const std::streamoff size = fin.tellg();
+    if (!fin || size <= 0) {
+        return false;
+    }
+    data.resize(size);
+    fin.seekg(0);
+    return bool(fin.read(reinterpret_cast<char*>(data.data()), size));
+}
+
+/// options of output and decoding which make part of key of result cache
+static std::string get_cache_options(
+        ImageIntegrator::OutputFormat format, 
+        bool unchanged_input
+) {
+    const std::string options = 
+        format == ImageIntegrator::OutputFormat::mapped ? "bin" : "txt";
+    return unchanged_input ? options + "-unchanged" : options;
+}
+
+/// flags of cv::imread() and cv::imdecode()
+static int get_read_flags(bool unchanged_input) {
+    return unchanged_input ? cv::IMREAD_UNCHANGED : cv::IMREAD_COLOR;
+}
+
+/**
+ *  Integrate rows of image whose values are of type T one by one
+ *  \param[in] data First row of image, rows are step bytes apart
+ *  \param[in] upper Integral row above first row, zeros for top of image
+ *  \param[out] res Integral rows, packed
+ */
+template <typename T>
+static void integrate_rows(
+        const uint8_t* data,
+        size_t step,
+        const double* upper,
+        double* res,
+        int row_count,
+        int width,
+        int channel_count
+) {
+    typedef typename PixelTraits<T>::Sum Sum;
+    const int row_size = width * channel_count;
+    for (int y = 0; y < row_count; y++) {
+        const T* row_data = reinterpret_cast<const T*>(data + y * step);
+        double* row = res + size_t(y) * row_size;
+        for (int c = 0; c < channel_count; c++) {
+            //accumulator for current row sum
+            Sum acc = 0;
+            for (int x = c; x < row_size; x += channel_count) {
+                acc += row_data[x];
+                row[x] = upper[x] + double(acc);
+            }
+        }
+        upper = row;
+    }
+}
+
+/// integrate_rows() of whole image of supported depth
+static void integrate_image(
+        const cv::Mat& image, 
+        const double* zero_row, 
+        double* res
+) {
+    const int height = image.size[0];
+    const int width = image.size[1];
+    const int channel_count = image.channels();
+    switch (image.depth()) {
+    case CV_8U:
+        integrate_rows<uint8_t>(image.data, image.step[0], zero_row, res, 
+                height, width, channel_count);
+        break;
+    case CV_16U:
+        integrate_rows<uint16_t>(image.data, image.step[0], zero_row, res, 
+                height, width, channel_count);
+        break;
+    case CV_32F:
+        integrate_rows<float>(image.data, image.step[0], zero_row, res, 
+                height, width, channel_count);
+        break;
+    case CV_64F:
+        integrate_rows<double>(image.data, image.step[0], zero_row, res, 
+                height, width, channel_count);
+        break;
+    }
+}
+
 void ImageIntegrator::process(std::string image_path) 
 {
     if (!is_inited) {
         logger("ERROR: ImageIntegrator isn't inited");
         return;
     }
-    std::shared_ptr<ImageData> image_data_ptr = std::make_shared<ImageData>(block_size);
-    task_pool.push(new TaskRead{&task_pool, image_path, image_data_ptr});
+    //header is needed only to choose the way of processing
+    ImageHeader header;
+    const bool has_header = strip_height == 0 && 
+        (batch_max_pixels > 0 || engine == Engine::automatic) && 
+        header.try_read(image_path);
+    if (has_header && batch_max_pixels > 0 && 
+            size_t(header.width) * header.height <= batch_max_pixels) {
+        if (!batch) {
+            batch.reset(new TaskBatch{
+                &task_pool, 
+                output_format, 
+                split_channels, 
+                &writer, 
+                container.file >= 0 ? &container : nullptr
+            });
+            if (container.file < 0) {
+                batch->result_cache = 
+                    get_result_cache(output_format, split_channels);
+            }
+            batch->unchanged_input = unchanged_input;
+        }
+        batch->bytes += size_t(header.width) * header.height * 
+            get_decoded_channels(header) * 
+            (get_decoded_value_size() + sizeof(double));
+        batch->paths.push_back(image_path);
+        if (int(batch->paths.size()) >= batch_size) {
+            flush_batch();
+        }
+        return;
+    }
+    //header is read only if memory is limited
+    const size_t bytes = 
+        memory_budget.get_limit() > 0 ? estimate_memory(image_path) : 0;
+    if (strip_height > 0) {
+        TaskStream* task = new TaskStream{
+            &task_pool, 
+            image_path, 
+            strip_height, 
+            output_format, 
+            direct_output,
+            unchanged_input,
+            &writer,
+            &failed_streams
+        };
+        memory_budget.submit(bytes, 
+                [this, task] (std::shared_ptr<MemoryBudget::Reservation> r) {
+            task->reservation = std::move(r);
+            task_pool.push(task);
+        });
+        return;
+    }
+
+    EngineTuner::Choice choice;
+    choice.engine = engine;
+    choice.block_width = block_width;
+    choice.block_height = block_height;
+    if (engine == Engine::automatic) {
+        choice = has_header ? 
+            tuner.choose(header.width, header.height, 
+                    get_decoded_channels(header), 
+                    task_pool.get_thread_count(), 
+                    get_decoded_value_size()) : 
+            EngineTuner::Choice();
+    }
+    if (choice.engine == Engine::serial) {
+        TaskBatch* task = new TaskBatch{
+            &task_pool, 
+            output_format, 
+            split_channels, 
+            &writer, 
+            nullptr
+        };
+        task->paths.push_back(image_path);
+        task->bytes = bytes;
+        task->result_cache = get_result_cache(output_format, split_channels);
+        task->unchanged_input = unchanged_input;
+        submit_batch(task);
+        return;
+    }
+
+    std::shared_ptr<ImageData> image_data_ptr = 
+        std::make_shared<ImageData>(*this);
+    image_data_ptr->block_width = choice.block_width;
+    image_data_ptr->block_height = choice.block_height;
+    submit_read(new TaskRead{
+        &get_decode_pool(), 
+        &task_pool, 
+        image_path, 
+        image_data_ptr
+    }, bytes);
+}
+
+void ImageIntegrator::process(std::string image_path, OutputSink sink) {
+    if (!is_inited) {
+        logger("ERROR: ImageIntegrator isn't inited");
+        if (sink.close) {
+            sink.close(false);
+        }
+        return;
+    }
+    ImageHeader header;
+    const bool has_header = header.try_read(image_path);
+    size_t bytes = 0;
+    if (memory_budget.get_limit() > 0) {
+        bytes = has_header ? 
+            estimate_memory(header) : memory_budget.get_limit();
+    }
+
+    std::shared_ptr<ImageData> image_data_ptr = 
+        std::make_shared<ImageData>(*this);
+    set_engine_blocks(*image_data_ptr, has_header ? header.width : 0, 
+            header.height, get_decoded_channels(header), 
+            get_decoded_value_size());
+    set_sink(*image_data_ptr, std::move(sink));
+    submit_read(new TaskRead{
+        &get_decode_pool(), 
+        &task_pool, 
+        image_path, 
+        image_data_ptr
+    }, bytes);
+}
+
+void ImageIntegrator::set_sink(ImageData& image_data, OutputSink sink) {
+    //chunks of callback are in the order of combined text file
+    if (sink.write) {
+        image_data.output_format = OutputFormat::text;
+        image_data.split_channels = false;
+        image_data.result_cache = nullptr;
+    }
+    image_data.sink = std::move(sink);
+}
+
+void ImageIntegrator::set_engine_blocks(
+        ImageData& image_data, 
+        int width, 
+        int height, 
+        int channels, 
+        size_t value_size
+) {
+    Engine chosen = engine;
+    if (engine == Engine::automatic) {
+        if (width <= 0 || height <= 0) {
+            return;
+        }
+        const EngineTuner::Choice choice = tuner.choose(width, height, 
+                channels, task_pool.get_thread_count(), value_size);
+        chosen = choice.engine;
+        image_data.block_width = choice.block_width;
+        image_data.block_height = choice.block_height;
+    }
+    //one block per channel stands for serial engine
+    image_data.is_serial = chosen == Engine::serial;
+}
+
+void ImageIntegrator::submit_read(TaskRead* task, size_t bytes) {
+    memory_budget.submit(bytes, 
+            [task] (std::shared_ptr<MemoryBudget::Reservation> r) {
+        task->image_data->reservation = std::move(r);
+        task->task_pool->push(task);
+    });
+}
+
+void ImageIntegrator::process_encoded(
+        const uint8_t* data, 
+        size_t size, 
+        OutputSink sink
+) {
+    process_encoded(std::vector<uint8_t>(data, data + size), std::move(sink));
+}
+
+void ImageIntegrator::process_encoded(
+        std::vector<uint8_t> data, 
+        OutputSink sink
+) {
+    if (!is_inited) {
+        logger("ERROR: ImageIntegrator isn't inited");
+        if (sink.close) {
+            sink.close(false);
+        }
+        return;
+    }
+    ImageHeader header;
+    const bool has_header = header.try_read(data.data(), data.size());
+    size_t bytes = 0;
+    if (memory_budget.get_limit() > 0) {
+        bytes = has_header ? 
+            estimate_memory(header) : memory_budget.get_limit();
+    }
+
+    std::shared_ptr<ImageData> image_data_ptr = 
+        std::make_shared<ImageData>(*this);
+    set_engine_blocks(*image_data_ptr, has_header ? header.width : 0, 
+            header.height, get_decoded_channels(header), 
+            get_decoded_value_size());
+    image_data_ptr->path = sink.path;
+    image_data_ptr->encoded = std::move(data);
+    set_sink(*image_data_ptr, std::move(sink));
+    submit_read(new TaskRead{
+        &get_decode_pool(), 
+        &task_pool, 
+        std::string(), 
+        image_data_ptr
+    }, bytes);
+}
+
+std::future<cv::Mat> ImageIntegrator::integrate(
+        const cv::Mat& image, 
+        OutputSpec spec
+) {
+    std::shared_ptr<std::promise<cv::Mat>> promise = 
+        std::make_shared<std::promise<cv::Mat>>();
+    std::future<cv::Mat> future = promise->get_future();
+    if (!is_inited) {
+        logger("ERROR: ImageIntegrator isn't inited");
+        promise->set_value(cv::Mat());
+        return future;
+    }
+
+    std::shared_ptr<ImageData> image_data_ptr = 
+        create_in_memory_data(image, spec.destination, promise);
+    set_engine_blocks(*image_data_ptr, image.cols, image.rows, 
+            image.channels(), image.elemSize1());
+    const size_t bytes = memory_budget.get_limit() > 0 && 
+        spec.destination.empty() ? image.total() * image.channels() * 
+        sizeof(double) : 0;
+
+    submit_read(new TaskRead{
+        &task_pool, 
+        &task_pool, 
+        std::string(), 
+        image_data_ptr
+    }, bytes);
+    return future;
+}
+
+std::future<cv::Mat> ImageIntegrator::update(
+        const cv::Mat& image, 
+        const cv::Mat& integral, 
+        const cv::Rect& dirty_rect, 
+        const cv::Mat& new_pixels
+) {
+    std::shared_ptr<std::promise<cv::Mat>> promise = 
+        std::make_shared<std::promise<cv::Mat>>();
+    std::future<cv::Mat> future = promise->get_future();
+    if (!is_inited) {
+        logger("ERROR: ImageIntegrator isn't inited");
+        promise->set_value(cv::Mat());
+        return future;
+    }
+    //nothing changes, so empty pixels of any type are fine
+    if (dirty_rect.width <= 0 || dirty_rect.height <= 0) {
+        promise->set_value(integral);
+        return future;
+    }
+    const cv::Rect bounds(0, 0, image.cols, image.rows);
+    if (integral.empty() || new_pixels.type() != image.type() || 
+            new_pixels.cols != dirty_rect.width || 
+            new_pixels.rows != dirty_rect.height || 
+            !((dirty_rect & bounds) == dirty_rect)) {
+        logger("ERROR: update doesn't match image");
+        promise->set_value(cv::Mat());
+        return future;
+    }
+
+    std::shared_ptr<ImageData> image_data_ptr = 
+        create_in_memory_data(image, integral, promise);
+    image_data_ptr->dirty_rect = dirty_rect;
+    image_data_ptr->new_pixels = new_pixels;
+    image_data_ptr->first_block_x = dirty_rect.x / block_width;
+    image_data_ptr->first_block_y = dirty_rect.y / block_height;
+    //delta costs integration of differences of dirty_rect (two pixels are 
+    //read per value) and one more pass over values which change, 
+    //integration again costs pass over blocks of them
+    const double changed = double(image.cols - dirty_rect.x) * 
+        (image.rows - dirty_rect.y);
+    const double blocks = 
+        double(image.cols - image_data_ptr->first_block_x * block_width) * 
+        (image.rows - image_data_ptr->first_block_y * block_height);
+    image_data_ptr->use_delta = 
+        update_delta_cost * changed + 2.0 * dirty_rect.area() < blocks;
+
+    submit_read(new TaskRead{
+        &task_pool, 
+        &task_pool, 
+        std::string(), 
+        image_data_ptr
+    }, 0);
+    return future;
+}
+
+std::future<cv::Mat> ImageIntegrator::accumulate(
+        const cv::Mat& image, 
+        const cv::Mat& subtrahend, 
+        const cv::Mat& accumulator, 
+        OutputSpec spec
+) {
+    std::shared_ptr<std::promise<cv::Mat>> promise = 
+        std::make_shared<std::promise<cv::Mat>>();
+    std::future<cv::Mat> future = promise->get_future();
+    if (!is_inited) {
+        logger("ERROR: ImageIntegrator isn't inited");
+        promise->set_value(cv::Mat());
+        return future;
+    }
+    const bool is_subtrahend_valid = subtrahend.empty() || 
+        (subtrahend.type() == image.type() && 
+         subtrahend.rows == image.rows && subtrahend.cols == image.cols);
+    if (!is_subtrahend_valid || 
+            accumulator.type() != CV_MAKETYPE(CV_64F, image.channels()) || 
+            accumulator.rows != image.rows || accumulator.cols != image.cols) {
+        logger("ERROR: accumulator or subtrahend doesn't match image");
+        promise->set_value(cv::Mat());
+        return future;
+    }
+
+    std::shared_ptr<ImageData> image_data_ptr = 
+        create_in_memory_data(image, spec.destination, promise);
+    image_data_ptr->subtrahend = subtrahend;
+    image_data_ptr->accumulator = accumulator;
+    const size_t bytes = memory_budget.get_limit() > 0 && 
+        spec.destination.empty() ? image.total() * image.channels() * 
+        sizeof(double) : 0;
+
+    submit_read(new TaskRead{
+        &task_pool, 
+        &task_pool, 
+        std::string(), 
+        image_data_ptr
+    }, bytes);
+    return future;
+}
+
+std::future<cv::Mat> ImageIntegrator::integrate_volume(
+        const cv::Mat& volume, 
+        OutputSpec spec
+) {
+    std::shared_ptr<VolumeData> volume_data = std::make_shared<VolumeData>();
+    volume_data->promise = std::make_shared<std::promise<cv::Mat>>();
+    std::future<cv::Mat> future = volume_data->promise->get_future();
+    if (!is_inited) {
+        logger("ERROR: ImageIntegrator isn't inited");
+        return future;
+    }
+    volume_data->volume = volume;
+    volume_data->result = spec.destination;
+    submit_volume(volume_data);
+    return future;
+}
+
+std::future<bool> ImageIntegrator::process_volume(
+        const cv::Mat& volume, 
+        const std::string& output_path
+) {
+    std::shared_ptr<VolumeData> volume_data = std::make_shared<VolumeData>();
+    volume_data->file_promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = volume_data->file_promise->get_future();
+    if (!is_inited) {
+        logger("ERROR: ImageIntegrator isn't inited");
+        return future;
+    }
+    volume_data->volume = volume;
+    volume_data->output_path = output_path;
+    submit_volume(volume_data);
+    return future;
+}
+
+std::shared_ptr<ImageIntegrator::LazyIntegral> ImageIntegrator::integrate_lazy(
+        const cv::Mat& image
+) {
+    if (!is_inited) {
+        logger("ERROR: ImageIntegrator isn't inited");
+        return nullptr;
+    }
+    std::shared_ptr<ImageData> image_data_ptr = 
+        create_in_memory_data(image, cv::Mat(), nullptr);
+    if (!image_data_ptr->try_init_image()) {
+        return nullptr;
+    }
+    //pages of integral image are touched only by integrated blocks
+    image_data_ptr->result = cv::Mat(image.rows, image.cols, 
+            CV_MAKETYPE(CV_64F, image_data_ptr->channel_count), 
+            image_data_ptr->res.data(), 
+            image_data_ptr->row_stride * sizeof(double));
+    return std::shared_ptr<LazyIntegral>(new LazyIntegral{image_data_ptr});
+}
+
+std::shared_ptr<ImageIntegrator::ImageData> 
+ImageIntegrator::create_in_memory_data(
+        const cv::Mat& image, 
+        const cv::Mat& destination,
+        std::shared_ptr<std::promise<cv::Mat>> promise
+) {
+    std::shared_ptr<ImageData> image_data_ptr = 
+        std::make_shared<ImageData>(*this);
+    //memory of image and result belongs to caller
+    image_data_ptr->image = image;
+    image_data_ptr->owns_image = false;
+    image_data_ptr->early_release = false;
+    image_data_ptr->result = destination;
+    image_data_ptr->promise = promise;
+    image_data_ptr->output_format = OutputFormat::none;
+    image_data_ptr->decode_slots = nullptr;
+    image_data_ptr->result_cache = nullptr;
+    return image_data_ptr;
+}
+
+size_t ImageIntegrator::estimate_memory(const std::string& image_path) const {
+    ImageHeader header;
+    if (!header.try_read(image_path)) {
+        //unknown image runs alone
+        return memory_budget.get_limit();
+    }
+    return estimate_memory(header);
+}
+
+size_t ImageIntegrator::estimate_memory(const ImageHeader& header) const {
+    //strips are decoded to 8 bits
+    if (strip_height > 0) {
+        const size_t row_values = 
+            size_t(header.width) * get_decoded_channels(header);
+        return size_t(strip_height) * row_values * (1 + 2 * sizeof(double));
+    }
+    const size_t row_values = 
+        size_t(header.width) * get_decoded_channels(header);
+    const size_t input_bytes = 
+        row_values * header.height * get_decoded_value_size();
+    const size_t res_bytes = output_format == OutputFormat::mapped ? 
+        0 : row_values * header.height * sizeof(double);
+    return input_bytes + res_bytes;
 }
 
 bool ImageIntegrator::try_init(int thread_count) {
@@ -27,27 +581,178 @@ bool ImageIntegrator::try_init(int thread_count) {
         return false;
     }
 
+    if (!writer.is_inited() && 
+            !writer.try_init(AsyncWriter::Backend::thread, default_write_budget)) {
+        return false;
+    }
+
+    start_time = std::chrono::steady_clock::now();
     is_inited = true;
     return true;
 }
 
+bool ImageIntegrator::try_init_writer(
+        AsyncWriter::Backend backend, 
+        size_t max_inflight_bytes
+) {
+    if (is_inited) {
+        wait_tasks();
+    }
+    writer.wait();
+    return writer.try_init(backend, max_inflight_bytes);
+}
+
+bool ImageIntegrator::try_init_decoder(
+        int thread_count, 
+        int max_decoded_images
+) {
+    if (thread_count < 0 || max_decoded_images < 0) {
+        logger("ERROR: incorrect decoder settings");
+        return false;
+    }
+    if (is_inited) {
+        wait_tasks();
+    }
+    decode_pool.stop();
+    decode_threads = thread_count;
+    if (thread_count > 0) {
+        decode_pool.init(thread_count);
+    }
+    //decoding threads can't wait for integration threads which decode
+    if (thread_count > 0 && max_decoded_images > 0) {
+        decode_slots.reset(new Semaphore{max_decoded_images});
+    } else {
+        decode_slots.reset();
+    }
+    return true;
+}
+
+void ImageIntegrator::set_batching(size_t max_pixels, int batch_size) {
+    flush_batch();
+    batch_max_pixels = max_pixels;
+    this->batch_size = std::max(batch_size, 1);
+}
+
+void ImageIntegrator::flush_batch() {
+    if (batch) {
+        submit_batch(batch.release());
+    }
+}
+
+void ImageIntegrator::submit_batch(TaskBatch* task) {
+    memory_budget.submit(task->bytes, 
+            [this, task] (std::shared_ptr<MemoryBudget::Reservation> r) {
+        task->reservation = std::move(r);
+        task_pool.push(task);
+    });
+}
+
+void ImageIntegrator::submit_volume(std::shared_ptr<VolumeData> volume_data) {
+    volume_data->block_width = block_width;
+    volume_data->block_height = block_height;
+    volume_data->block_depth = block_depth;
+    if (!volume_data->try_init()) {
+        return;
+    }
+    task_pool.push(new TaskVolume{&task_pool, volume_data, 0, 0, 0});
+}
+
+bool ImageIntegrator::try_calibrate(const std::string& path) {
+    if (!is_inited) {
+        logger("ERROR: ImageIntegrator isn't inited");
+        return false;
+    }
+    if (tuner.try_load(path)) {
+        return true;
+    }
+    wait_tasks();
+    tuner.calibrate(task_pool);
+    return tuner.try_save(path);
+}
+
+bool ImageIntegrator::try_open_result_cache(
+        const std::string& dir, 
+        size_t capacity
+) {
+    //running jobs keep using cache, so they are finished first
+    wait_tasks();
+    writer.wait();
+    return result_cache.try_open(dir, capacity);
+}
+
+bool ImageIntegrator::try_open_container(const std::string& path) {
+    close_container();
+    container.file = writer.open(path);
+    container.offset = 0;
+    return container.file >= 0;
+}
+
+void ImageIntegrator::close_container() {
+    if (container.file < 0) {
+        return;
+    }
+    if (is_inited) {
+        wait_tasks();
+    }
+    writer.close(container.file);
+    writer.wait();
+    container.file = -1;
+}
+
+void ImageIntegrator::wait_tasks() {
+    flush_batch();
+    //integration task can start queued image in decode pool and vice versa, 
+    //writer frees image after its last file and can start queued one too
+    do {
+        decode_pool.wait();
+        task_pool.wait();
+        writer.wait();
+    } while (!decode_pool.is_idle() || !task_pool.is_idle());
+}
+
 void ImageIntegrator::stop() {
     if (is_inited) {
+        wait_tasks();
+        close_container();
+        decode_pool.stop();
         task_pool.stop();
+        writer.stop();
     }
     is_inited = false;
 }
 
 void ImageIntegrator::wait() {
     if (is_inited) {
-        task_pool.wait();
+        wait_tasks();
+        writer.wait();
     }
 }
 
 ImageIntegrator::~ImageIntegrator() {
     if (is_inited) {
-        task_pool.wait();
+        wait_tasks();
     }
+    close_container();
+    writer.wait();
+}
+
+ImageIntegrator::PipelineStats ImageIntegrator::get_pipeline_stats() {
+    PipelineStats stats;
+    if (!is_inited) {
+        return stats;
+    }
+    stats.wall_time = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time).count();
+    if (decode_threads > 0) {
+        stats.decode_busy_time = decode_pool.get_busy_time();
+        stats.decode_threads = decode_pool.get_thread_count();
+    }
+    stats.integrate_busy_time = task_pool.get_busy_time();
+    stats.integrate_threads = task_pool.get_thread_count();
+    stats.write_busy_time = writer.get_busy_time();
+    stats.write_stall_time = writer.get_stall_time();
+    stats.failed_streams = failed_streams;
+    return stats;
 }
 
 std::string ImageIntegrator::ImageData::block_row_to_string(
@@ -57,54 +762,150 @@ std::string ImageIntegrator::ImageData::block_row_to_string(
     std::stringstream ss;
     ss.precision(1);
 
-    const int y_start = y_block_num * block_size;
-    const int y_end = std::min(image.size[0], (y_block_num + 1) * block_size);
+    const int y_start = y_block_num * block_height;
+    const int y_end = std::min(image.size[0], (y_block_num + 1) * block_height);
 
     if (image.data != nullptr) {
         for (int y = y_start; y < y_end; y++) {
-            for (int x = 0; x < image.size[1]; x++) {
-                ss << std::fixed << get_res(x, y, channel) << ' ';
-            }
-            ss << std::endl;
+            append_row_text(ss, res.data() + get_id(0, y, channel), 
+                    image.size[1], channel_count);
         }
     }
     return std::move(ss.str());
 }
     
+ImageIntegrator::ImageData::~ImageData() {
+    release_decode_slot();
+    if (promise) {
+        promise->set_value(cv::Mat());
+    }
+    if (sink.close) {
+        sink.close(is_restored || (channel_count > 0 && 
+                integrated_channel_count == channel_count && !output_failed));
+    }
+}
+
+bool ImageIntegrator::ImageData::try_restore_output() {
+    if (encoded.empty() && !try_read_file(path, encoded)) {
+        logger("ERROR: image(" + path + ") wasn't found");
+        return true;
+    }
+    cache_key = ResultCache::make_key(encoded.data(), encoded.size(), 
+            get_cache_options(output_format, unchanged_input));
+    is_restored = result_cache->try_restore(cache_key, get_output_path());
+    return is_restored;
+}
+
+std::string ImageIntegrator::ImageData::get_output_path() const {
+    return path + 
+        (output_format == OutputFormat::mapped ? ".integral.bin" : ".integral");
+}
+
+bool ImageIntegrator::ImageData::try_init_encoded() {
+    image = cv::imdecode(encoded, get_read_flags(unchanged_input));
+    std::vector<uint8_t>().swap(encoded);
+    if (image.data == nullptr) {
+        logger("ERROR: image(" + path + ") can't be decoded");
+        return false;
+    }
+    return try_init_image();
+}
+
 bool ImageIntegrator::ImageData::try_init(std::string path) {
     this->path = path;
-    image = cv::imread(path, cv::IMREAD_COLOR);
+    image = cv::imread(path, get_read_flags(unchanged_input));
 
     if (image.data == nullptr) {
         logger("ERROR: image(" + path + ") wasn't found");
         return false;
     }
+    return try_init_image();
+}
 
+bool ImageIntegrator::ImageData::try_init_image() {
     const int default_image_dim_count = 2;
 
-    if (image.size.dims() != default_image_dim_count) {
+    if (image.data == nullptr || image.size.dims() != default_image_dim_count) {
         logger("ERROR: image wasn't found in " + path);
         return false;
     }
+    if (!is_supported_depth(image.depth())) {
+        logger("ERROR: only 8U, 16U, 32F and 64F images are supported");
+        return false;
+    }
 
-    block_count_x = round(image.size[1] / double(block_size) + 0.5);
-    block_count_y = round(image.size[0] / double(block_size) + 0.5);
+    if (is_serial) {
+        block_width = std::max(image.size[1], 1);
+        block_height = std::max(image.size[0], 1);
+    }
+    block_count_x = round(image.size[1] / double(block_width) + 0.5);
+    block_count_y = round(image.size[0] / double(block_height) + 0.5);
     channel_count = image.channels();
 
-    res.resize(image.size[0] * image.size[1] * channel_count);
+    //memory rows start at 64 bytes boundary, file rows are packed
+    row_stride = size_t(image.size[1]) * channel_count;
+    if (promise) {
+        //result matrix is written directly
+        const int type = CV_MAKETYPE(CV_64F, channel_count);
+        if (result.empty()) {
+            result.create(image.size[0], image.size[1], type);
+        }
+        if (result.type() != type || result.size[0] != image.size[0] || 
+                result.size[1] != image.size[1]) {
+            logger("ERROR: destination doesn't match image");
+            return false;
+        }
+        row_stride = result.step[0] / sizeof(double);
+        res.wrap(reinterpret_cast<double*>(result.data), 
+                row_stride * image.size[0]);
+    } else if (output_format == OutputFormat::mapped) {
+        IntegralFileHeader header;
+        header.width = image.size[1];
+        header.height = image.size[0];
+        header.channels = channel_count;
+        header.row_stride = row_stride;
+        if (!res.try_map_file(path + ".integral.bin", header)) {
+            return false;
+        }
+    } else {
+        const size_t row_alignment = 64 / sizeof(double);
+        row_stride = (row_stride + row_alignment - 1) / row_alignment * 
+            row_alignment;
+        if (!res.try_alloc(row_stride * image.size[0], pool, page_mode)) {
+            return false;
+        }
+    }
+    if (owns_image) {
+        advise_huge_pages(image.data, image.step[0] * image.size[0], 
+                page_mode);
+    }
+
     block_row_str.resize(block_count_y * channel_count);
+    if (early_release) {
+        integrated_channels.assign(block_count_y, 0);
+        consumed_channels.assign(block_count_y, 0);
+        input_released.assign(block_count_y, false);
+        res_released.assign(block_count_y, false);
+    }
+    streams.reset(new OutputStream[split_channels ? channel_count : 1]);
+    if (split_channels) {
+        for (int c = 0; c < channel_count; c++) {
+            streams[c].next_row = get_block_row_id(0, c);
+        }
+    }
     block_states.resize(channel_count * block_count_x * block_count_y, 0);
     
-    //change state for blocks near borders
-    for (int i = 0; i < block_count_x; i++) {
+    //change state for blocks near borders, blocks of update() start at
+    //first block
+    for (int i = first_block_x; i < block_count_x; i++) {
         for (int j = 0; j < channel_count; j++) {
-            get_block_state(i, 0, j)++;
+            get_block_state(i, first_block_y, j)++;
         }
     }
 
-    for (int i = 0; i < block_count_y; i++) {
+    for (int i = first_block_y; i < block_count_y; i++) {
         for (int j = 0; j < channel_count; j++) {
-            get_block_state(0, i, j)++;
+            get_block_state(first_block_x, i, j)++;
         }
     }
 
@@ -116,81 +917,400 @@ void ImageIntegrator::ImageData::process_block(
         int block_y, 
         int channel
 ) {
-    const int x_start = block_x * block_size;
-    const int y_start = block_y * block_size;
-    const int x_end = std::min(image.size[1], (block_x + 1) * block_size);
-    const int y_end = std::min(image.size[0], (block_y + 1) * block_size);
+    switch (image.depth()) {
+    case CV_8U:
+        process_pixel_block<uint8_t>(block_x, block_y, channel);
+        break;
+    case CV_16U:
+        process_pixel_block<uint16_t>(block_x, block_y, channel);
+        break;
+    case CV_32F:
+        process_pixel_block<float>(block_x, block_y, channel);
+        break;
+    case CV_64F:
+        process_pixel_block<double>(block_x, block_y, channel);
+        break;
+    }
+}
+
+template <typename T>
+void ImageIntegrator::ImageData::process_pixel_block(
+        int block_x, 
+        int block_y, 
+        int channel
+) {
+    typedef typename PixelTraits<T>::Sum Sum;
+    const int x_start = block_x * block_width;
+    const int y_start = block_y * block_height;
+    const int x_end = std::min(image.size[1], (block_x + 1) * block_width);
+    const int y_end = std::min(image.size[0], (block_y + 1) * block_height);
 
     for (int y = y_start; y != y_end; y++) {
-        //accumulator for current row sum
-        double acc = 0.0;
-        //if column block isn't first we need to correct value
-        if (block_x != 0 && y != 0) {
-            acc = -get_res(x_start - 1, y - 1, channel);
+        const T* data = image.ptr<T>(y) + channel;
+        const double* upper = y != 0 ? &get_res(0, y - 1, channel) : nullptr;
+        double* row = &get_res(0, y, channel);
+        //accumulator for current row sum starts with sum of left blocks
+        Sum acc = 0;
+        if (block_x != 0) {
+            const int i = (x_start - 1) * channel_count;
+            acc = Sum(upper != nullptr ? row[i] - upper[i] : row[i]);
+        }
+        if (upper == nullptr) {
+            for (int x = x_start; x != x_end; x++) {
+                const int i = x * channel_count;
+                acc += data[i];
+                row[i] = double(acc);
+            }
+            continue;
         }
         for (int x = x_start; x != x_end; x++) {
-            double value = 0;
+            const int i = x * channel_count;
+            acc += data[i];
+            //integral image value from upper pixel and sum of current row
+            row[i] = upper[i] + double(acc);
+        }
+    }
+}
+
+void ImageIntegrator::ImageData::process_difference_block(
+        int block_x, 
+        int block_y, 
+        int channel
+) {
+    switch (image.depth()) {
+    case CV_8U:
+        process_pixel_difference_block<uint8_t>(block_x, block_y, channel);
+        break;
+    case CV_16U:
+        process_pixel_difference_block<uint16_t>(block_x, block_y, channel);
+        break;
+    case CV_32F:
+        process_pixel_difference_block<float>(block_x, block_y, channel);
+        break;
+    case CV_64F:
+        process_pixel_difference_block<double>(block_x, block_y, channel);
+        break;
+    }
+}
+
+template <typename T>
+void ImageIntegrator::ImageData::process_pixel_difference_block(
+        int block_x, 
+        int block_y, 
+        int channel
+) {
+    typedef typename PixelTraits<T>::Sum Sum;
+    const int x_start = block_x * block_width;
+    const int y_start = block_y * block_height;
+    const int x_end = std::min(image.size[1], (block_x + 1) * block_width);
+    const int y_end = std::min(image.size[0], (block_y + 1) * block_height);
+
+    for (int y = y_start; y != y_end; y++) {
+        //accumulator for current row sum starts with sum of left blocks
+        Sum acc = 0;
+        if (block_x != 0) {
+            double left = get_res(x_start - 1, y, channel);
             if (y != 0) {
-                //integral image value from upper pixel
-                value += get_res(x, y - 1, channel); 
+                left -= get_res(x_start - 1, y - 1, channel);
             }
+            acc = Sum(left);
+        }
+        const T* data = image.ptr<T>(y) + channel;
+        const T* old_data = 
+            subtrahend.empty() ? nullptr : subtrahend.ptr<T>(y) + channel;
+        const double* upper = y != 0 ? &get_res(0, y - 1, channel) : nullptr;
+        double* row = &get_res(0, y, channel);
+        double* sums = accumulator.ptr<double>(y) + channel;
+        for (int x = x_start; x != x_end; x++) {
+            const int i = x * channel_count;
+            acc += old_data != nullptr ? Sum(data[i]) - Sum(old_data[i]) : 
+                Sum(data[i]);
+            const double value = 
+                upper != nullptr ? upper[i] + double(acc) : double(acc);
+            row[i] = value;
+            sums[i] += value;
+        }
+    }
+}
+
+void ImageIntegrator::ImageData::correct_block(
+        int block_x, 
+        int block_y, 
+        int channel
+) {
+    //values above or left of dirty_rect don't change
+    const int x_start = std::max(block_x * block_width, dirty_rect.x);
+    const int y_start = std::max(block_y * block_height, dirty_rect.y);
+    const int x_end = std::min(image.size[1], (block_x + 1) * block_width);
+    const int y_end = std::min(image.size[0], (block_y + 1) * block_height);
+    //right of dirty_rect value changes by delta of its last column
+    const int x_dirty_end = 
+        std::min(x_end, dirty_rect.x + dirty_rect.width);
 
-            acc += (int)get_data(x, y, channel);
-            //if column block isn't first we need to correct value
-            if (x == x_start && block_x != 0) {
-                acc += get_res(x_start - 1, y, channel);
+    for (int y = y_start; y < y_end; y++) {
+        const double* delta_row = delta.ptr<double>(
+                std::min(y - dirty_rect.y, dirty_rect.height - 1)) + channel;
+        double* row = &get_res(0, y, channel);
+        int x = x_start;
+        for (; x < x_dirty_end; x++) {
+            row[x * channel_count] += 
+                delta_row[(x - dirty_rect.x) * channel_count];
+        }
+        const double last = delta_row[(dirty_rect.width - 1) * channel_count];
+        for (; x < x_end; x++) {
+            row[x * channel_count] += last;
+        }
+    }
+}
+
+void ImageIntegrator::ImageData::apply_update() {
+    if (use_delta) {
+        switch (image.depth()) {
+        case CV_8U: compute_delta<uint8_t>(); break;
+        case CV_16U: compute_delta<uint16_t>(); break;
+        case CV_32F: compute_delta<float>(); break;
+        case CV_64F: compute_delta<double>(); break;
+        }
+    }
+    const size_t row_bytes = dirty_rect.width * image.elemSize();
+    for (int y = 0; y < dirty_rect.height; y++) {
+        std::memcpy(image.ptr(dirty_rect.y + y) + dirty_rect.x * 
+                image.elemSize(), new_pixels.ptr(y), row_bytes);
+    }
+}
+
+template <typename T>
+void ImageIntegrator::ImageData::compute_delta() {
+    typedef typename PixelTraits<T>::Sum Sum;
+    const int row_size = dirty_rect.width * channel_count;
+    delta.create(dirty_rect.height, dirty_rect.width, 
+            CV_MAKETYPE(CV_64F, channel_count));
+    for (int y = 0; y < dirty_rect.height; y++) {
+        const T* old_row = 
+            image.ptr<T>(dirty_rect.y + y) + dirty_rect.x * channel_count;
+        const T* new_row = new_pixels.ptr<T>(y);
+        double* row = delta.ptr<double>(y);
+        const double* upper = y > 0 ? delta.ptr<double>(y - 1) : nullptr;
+        for (int c = 0; c < channel_count; c++) {
+            //accumulator for current row sum
+            Sum acc = 0;
+            for (int x = c; x < row_size; x += channel_count) {
+                acc += Sum(new_row[x]) - Sum(old_row[x]);
+                row[x] = (upper != nullptr ? upper[x] : 0.0) + double(acc);
             }
-            //value only of sum of current row
-            value += acc;
-            get_res(x, y, channel) = value;
         }
     }
 }
 
-void ImageIntegrator::TaskWrite::execute() {
-    image_data->get_block_row_str(row_block_num, channel) = 
-        std::move(image_data->block_row_to_string(row_block_num, channel));
+void ImageIntegrator::ImageData::write_ready_rows(int stream_id) {
+    OutputStream& stream = streams[stream_id];
+    //only one thread writes, others just ask it to look again
+    if (stream.write_requests.fetch_add(1) != 0) {
+        return;
+    }
 
+    //stream contains one channel or all of them in a row
+    const int end_row = split_channels ? 
+        get_block_row_id(0, stream_id + 1) : block_count_y * channel_count;
+    do {
+        while (stream.next_row < end_row) {
+            const int channel = stream.next_row / block_count_y;
+            const int y = stream.next_row % block_count_y;
+            {
+                std::unique_lock<std::mutex> lock{mtx};
+                if (get_block_state(block_count_x - 1, y, channel) != 3) {
+                    break;
+                }
+            }
+
+            std::string& row_str = get_block_row_str(y, channel);
+            if (sink.write) {
+                sink.write(std::move(row_str));
+                if (y == block_count_y - 1) {
+                    sink.write("\n");
+                }
+                stream.next_row++;
+                continue;
+            }
+
+            if (stream.file < 0) {
+                std::string filename = path;
+                if (split_channels) {
+                    filename += ".c" + std::to_string(stream_id);
+                }
+                const auto filetype = ".integral";
+                stream.file = writer->open(filename + filetype, direct_output);
+                if (stream.file < 0) {
+                    output_failed = true;
+                    stream.next_row = end_row;
+                    break;
+                }
+            }
+            //buffer is moved to writer and freed as soon as it is written
+            const size_t row_size = row_str.size();
+            writer->write(stream.file, stream.offset, std::move(row_str));
+            stream.offset += row_size;
+            //each channel ends with empty line
+            if (y == block_count_y - 1) {
+                writer->write(stream.file, stream.offset, "\n");
+                stream.offset++;
+            }
+            stream.next_row++;
+
+            if (stream.next_row == end_row) {
+                //image is kept until its file is closed, so sink learns 
+                //about failed writes; output is cached only when all of it 
+                //is written
+                std::shared_ptr<ImageData> self = shared_from_this();
+                const std::string output_path = get_output_path();
+                writer->close(stream.file, [self, output_path] (bool success) {
+                    if (!success) {
+                        logger("ERROR: can't write " + output_path);
+                        self->output_failed = true;
+                    } else if (!self->cache_key.empty()) {
+                        self->result_cache->store(self->cache_key, 
+                                output_path);
+                    }
+                });
+                stream.file = -1;
+            }
+        }
+    } while (stream.write_requests.fetch_sub(1) > 1);
+}
+
+void ImageIntegrator::ImageData::on_row_integrated(int y_block_num) {
+    if (early_release) {
+        {
+            std::unique_lock<std::mutex> lock{mtx};
+            integrated_channels[y_block_num]++;
+        }
+        release_rows(y_block_num);
+    }
+}
+
+void ImageIntegrator::ImageData::on_row_consumed(int y_block_num) {
+    if (early_release) {
+        {
+            std::unique_lock<std::mutex> lock{mtx};
+            consumed_channels[y_block_num]++;
+        }
+        release_rows(y_block_num);
+    }
+}
+
+void ImageIntegrator::ImageData::on_channel_integrated() {
+    bool is_last = false;
     {
-        std::unique_lock<std::mutex> lock{image_data->mtx};
-        int last_blocks_states = 0;
+        std::unique_lock<std::mutex> lock{mtx};
+        is_last = ++integrated_channel_count == channel_count;
+    }
+    if (is_last) {
+        release_decode_slot();
+        if (promise) {
+            promise->set_value(accumulator.empty() ? result : accumulator);
+            promise.reset();
+        }
+    }
+}
 
-        image_data->get_block_state(
-                image_data->block_count_x - 1, 
-                row_block_num, 
-                channel
-        )++;
+void ImageIntegrator::ImageData::release_decode_slot() {
+    if (holds_decode_slot) {
+        holds_decode_slot = false;
+        decode_slots->release();
+    }
+}
 
-        for (int y = 0; y < image_data->block_count_y; y++) {
-            for (int c = 0; c < image_data->channel_count; c++) {
-                last_blocks_states += image_data->get_block_state(
-                        image_data->block_count_x - 1, 
-                        y, 
-                        c
-                );
+void ImageIntegrator::ImageData::release_rows(int y_block_num) {
+    bool release_input = false;
+    //block row above waits for this one, its last row is read by it
+    int release_res[2] = {-1, -1};
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        auto integrated = [&] (int y) { 
+            return y >= block_count_y || 
+                integrated_channels[y] == channel_count; 
+        };
+        if (integrated(y_block_num) && !input_released[y_block_num]) {
+            input_released[y_block_num] = true;
+            release_input = owns_image;
+        }
+        for (int i = 0; i < 2; i++) {
+            const int y = y_block_num - i;
+            if (y >= 0 && !res_released[y] && integrated(y + 1) && 
+                    consumed_channels[y] == channel_count) {
+                res_released[y] = true;
+                release_res[i] = y;
             }
         }
+    }
 
+    if (release_input) {
+        const int y_start = y_block_num * block_height;
+        const int y_end = std::min(image.size[0], y_start + block_height);
+        IntegralBuffer::discard_pages(
+                image.data + get_data_id(0, y_start, 0), 
+                (y_end - y_start) * image.step[0]
+        );
+    }
+    for (int y : release_res) {
+        if (y >= 0) {
+            const int y_start = y * block_height;
+            const int y_end = std::min(image.size[0], y_start + block_height);
+            res.discard(get_id(0, y_start, 0), (y_end - y_start) * row_stride);
+        }
+    }
+}
+
+void ImageIntegrator::TaskWrite::execute() {
+    if (image_data->output_format == OutputFormat::none) {
+        image_data->on_row_consumed(row_block_num);
+        return;
+    }
+    //mapped file already contains values, it is ready with last block row
+    if (image_data->output_format == OutputFormat::mapped) {
+        image_data->on_row_consumed(row_block_num);
+        std::unique_lock<std::mutex> lock{image_data->mtx};
+        const int finished = ++image_data->finished_block_rows;
         lock.unlock();
-        
-        //write to file if all blocks are ready for writing
-        if (last_blocks_states == 
-                image_data->block_count_y * 3 * image_data->channel_count) {
-            const auto filetype = ".integral";
-            std::ofstream fout{image_data->path + filetype};
-            for (int c = 0; c < image_data->channel_count; c++) {
-                for (int i = 0; i < image_data->block_count_y; i++) {
-                    fout << image_data->get_block_row_str(i, c);
-                }
-                fout << std::endl;
+        if (finished == 
+                image_data->block_count_y * image_data->channel_count) {
+            //file is on disk before it is cached or reported as done, 
+            //failed write back is reported by sink
+            if (!image_data->res.sync(true)) {
+                logger("ERROR: can't write " + 
+                        image_data->get_output_path());
+                image_data->output_failed = true;
+            } else if (!image_data->cache_key.empty()) {
+                image_data->result_cache->store(image_data->cache_key, 
+                        image_data->get_output_path());
             }
-            fout.close();
         }
+        return;
     }
+
+    image_data->get_block_row_str(row_block_num, channel) = 
+        std::move(image_data->block_row_to_string(row_block_num, channel));
+    image_data->on_row_consumed(row_block_num);
+    {
+        std::unique_lock<std::mutex> lock{image_data->mtx};
+        image_data->get_block_state(
+                image_data->block_count_x - 1, 
+                row_block_num, 
+                channel
+        )++;
+    }
+    image_data->write_ready_rows(image_data->split_channels ? channel : 0);
 }
 
 void ImageIntegrator::TaskProcess::execute() {
-    image_data->process_block(x_block_start, y_block_start, channel);
+    if (image_data->use_delta) {
+        image_data->correct_block(x_block_start, y_block_start, channel);
+    } else if (!image_data->accumulator.empty()) {
+        image_data->process_difference_block(x_block_start, y_block_start, 
+                channel);
+    } else {
+        image_data->process_block(x_block_start, y_block_start, channel);
+    }
 
     auto handle_next_block = [&](int x_block_new, int y_block_new) { 
         if (y_block_new < image_data->block_count_y && 
@@ -221,6 +1341,10 @@ void ImageIntegrator::TaskProcess::execute() {
     
     //create TaskWrite for last block in row block
     if (x_block_start == image_data->block_count_x - 1) {
+        image_data->on_row_integrated(y_block_start);
+        if (y_block_start == image_data->block_count_y - 1) {
+            image_data->on_channel_integrated();
+        }
         std::unique_lock<std::mutex> lock {image_data->mtx};
             task_pool->push(new TaskWrite{
                 task_pool,
@@ -232,17 +1356,555 @@ void ImageIntegrator::TaskProcess::execute() {
 }
 
 void ImageIntegrator::TaskRead::execute() {
-    if (!image_data->try_init(path)) {
+    //wait until one of decoded images is integrated
+    if (image_data->decode_slots != nullptr) {
+        image_data->decode_slots->acquire();
+        image_data->holds_decode_slot = true;
+    }
+    //cached output is restored without decoding
+    if (image_data->result_cache != nullptr && 
+            (!path.empty() || !image_data->encoded.empty())) {
+        if (!path.empty()) {
+            image_data->path = path;
+        }
+        if (image_data->try_restore_output()) {
+            return;
+        }
+    }
+    //image of in-memory job is already set
+    bool is_inited = false;
+    if (!image_data->encoded.empty()) {
+        is_inited = image_data->try_init_encoded();
+    } else if (!path.empty()) {
+        is_inited = image_data->try_init(path);
+    } else {
+        is_inited = image_data->try_init_image();
+    }
+    if (!is_inited) {
         return;
     }
+    if (!image_data->new_pixels.empty()) {
+        image_data->apply_update();
+    }
 
     for( int i = 0; i < image_data->channel_count; i++) {
-        task_pool->push(new TaskProcess{
-            task_pool,
+        process_pool->push(new TaskProcess{
+            process_pool,
             image_data,
-            0,
-            0,
+            image_data->first_block_x,
+            image_data->first_block_y,
             i
         });
     }
 }
+
+void ImageIntegrator::TaskStream::execute() {
+    std::unique_ptr<StripReader> reader = 
+        StripReader::create(path, unchanged_input);
+    if (!reader) {
+        logger("ERROR: image(" + path + ") wasn't found");
+        failed_streams->fetch_add(1);
+        return;
+    }
+    const int width = reader->get_width();
+    const int height = reader->get_height();
+    const int channel_count = reader->get_channels();
+    const size_t row_size = size_t(width) * channel_count;
+
+    //text is stored channel by channel, so each channel has its own file
+    const bool is_text = output_format == OutputFormat::text;
+    const bool is_none = output_format == OutputFormat::none;
+    std::vector<std::string> filenames(is_text ? channel_count : 
+            is_none ? 0 : 1);
+    std::vector<int> files(filenames.size(), -1);
+    std::vector<uint64_t> offsets(files.size(), 0);
+    //incomplete output is removed, so it can't be taken for result; image 
+    //is counted once even if several of its files fail
+    std::atomic<uint64_t>* failed_streams = this->failed_streams;
+    auto close_files = [&] (size_t count, bool is_complete) {
+        auto is_counted = std::make_shared<std::atomic<bool>>(!is_complete);
+        if (!is_complete) {
+            failed_streams->fetch_add(1);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (!is_complete) {
+                writer->mark_failed(files[i]);
+            }
+            const std::string filename = filenames[i];
+            writer->close(files[i], 
+                    [filename, is_counted, failed_streams] (bool success) {
+                if (success) {
+                    return;
+                }
+                logger("ERROR: " + filename + 
+                        " is incomplete, it is removed");
+                unlink(filename.c_str());
+                if (!is_counted->exchange(true)) {
+                    failed_streams->fetch_add(1);
+                }
+            });
+        }
+    };
+    for (size_t i = 0; i < files.size(); i++) {
+        filenames[i] = is_text ? 
+            path + ".c" + std::to_string(i) + ".integral" : 
+            path + ".integral.bin";
+        files[i] = writer->open(filenames[i], direct_output);
+        if (files[i] < 0) {
+            close_files(i, false);
+            return;
+        }
+    }
+    if (output_format == OutputFormat::mapped) {
+        IntegralFileHeader header;
+        header.width = width;
+        header.height = height;
+        header.channels = channel_count;
+        header.row_stride = row_size;
+        writer->write(files[0], 0, std::string(
+                reinterpret_cast<const char*>(&header), 
+                sizeof(header)
+        ));
+        offsets[0] = sizeof(header);
+    }
+
+    std::vector<uint8_t> strip(row_size * strip_height);
+    std::vector<double> res(row_size * strip_height);
+    //integral image row above current strip
+    std::vector<double> carry(row_size, 0.0);
+
+    bool is_complete = true;
+    for (int y_start = 0; y_start < height; y_start += strip_height) {
+        const int strip_rows = std::min(strip_height, height - y_start);
+        const int row_count = reader->read_rows(strip.data(), strip_rows);
+        if (row_count != strip_rows) {
+            logger("ERROR: can't read image(" + path + ")");
+            is_complete = false;
+            break;
+        }
+
+        integrate_rows<uint8_t>(strip.data(), row_size, carry.data(), 
+                res.data(), row_count, width, channel_count);
+        std::copy(
+                res.begin() + (row_count - 1) * row_size, 
+                res.begin() + row_count * row_size, 
+                carry.begin()
+        );
+
+        if (is_text) {
+            for (int c = 0; c < channel_count; c++) {
+                std::stringstream ss;
+                ss.precision(1);
+                for (int y = 0; y < row_count; y++) {
+                    append_row_text(ss, &res[y * row_size + c], width, 
+                            channel_count);
+                }
+                std::string str = ss.str();
+                const size_t size = str.size();
+                writer->write(files[c], offsets[c], std::move(str));
+                offsets[c] += size;
+            }
+        } else if (!is_none) {
+            std::string str(
+                    reinterpret_cast<const char*>(res.data()), 
+                    row_count * row_size * sizeof(double)
+            );
+            const size_t size = str.size();
+            writer->write(files[0], offsets[0], std::move(str));
+            offsets[0] += size;
+        }
+    }
+
+    for (size_t i = 0; i < files.size() && is_complete; i++) {
+        if (is_text) {
+            writer->write(files[i], offsets[i], "\n");
+        }
+    }
+    close_files(files.size(), is_complete);
+}
+
+void ImageIntegrator::TaskBatch::execute() {
+    std::vector<double> res;
+    std::vector<double> zero_row;
+    //records of whole batch are written by one request
+    std::string records;
+    for (const std::string& path : paths) {
+        cv::Mat image;
+        std::string cache_key;
+        if (result_cache != nullptr) {
+            //cached output is restored without decoding
+            std::vector<uint8_t> encoded;
+            if (try_read_file(path, encoded)) {
+                cache_key = ResultCache::make_key(encoded.data(), 
+                        encoded.size(), 
+                        get_cache_options(output_format, unchanged_input));
+                const std::string output_path = path + 
+                    (output_format == OutputFormat::mapped ? 
+                     ".integral.bin" : ".integral");
+                if (result_cache->try_restore(cache_key, output_path)) {
+                    continue;
+                }
+                image = cv::imdecode(encoded, get_read_flags(unchanged_input));
+            }
+        } else {
+            image = cv::imread(path, get_read_flags(unchanged_input));
+        }
+        if (image.data == nullptr) {
+            logger("ERROR: image(" + path + ") wasn't found");
+            continue;
+        }
+        if (!is_supported_depth(image.depth())) {
+            logger("ERROR: depth of image(" + path + ") isn't supported");
+            continue;
+        }
+        const int width = image.size[1];
+        const int height = image.size[0];
+        const int channel_count = image.channels();
+        const size_t row_size = size_t(width) * channel_count;
+        res.resize(row_size * height);
+        zero_row.assign(row_size, 0.0);
+        integrate_image(image, zero_row.data(), res.data());
+
+        if (container != nullptr) {
+            append_integral_record(records, path, width, height, 
+                    channel_count, res.data());
+        } else {
+            write_files(path, res, width, height, channel_count, cache_key);
+        }
+    }
+    if (!records.empty()) {
+        const uint64_t offset = container->offset.fetch_add(records.size());
+        writer->write(container->file, offset, std::move(records));
+    }
+}
+
+void ImageIntegrator::TaskBatch::write_files(
+        const std::string& path, 
+        const std::vector<double>& res, 
+        int width, 
+        int height, 
+        int channel_count,
+        const std::string& cache_key
+) {
+    if (output_format == OutputFormat::none) {
+        return;
+    }
+    //output is cached only when all of it is written
+    std::function<void(bool)> on_closed;
+    if (!cache_key.empty()) {
+        ResultCache* cache = result_cache;
+        const std::string output_path = path + 
+            (output_format == OutputFormat::mapped ? 
+             ".integral.bin" : ".integral");
+        on_closed = [cache, cache_key, output_path] (bool success) {
+            if (success) {
+                cache->store(cache_key, output_path);
+            }
+        };
+    }
+    const size_t row_size = size_t(width) * channel_count;
+    if (output_format == OutputFormat::mapped) {
+        //file is small, so it is written as a whole instead of mapping
+        IntegralFileHeader header;
+        header.width = width;
+        header.height = height;
+        header.channels = channel_count;
+        header.row_stride = row_size;
+        std::string str(reinterpret_cast<const char*>(&header), sizeof(header));
+        str.append(
+                reinterpret_cast<const char*>(res.data()), 
+                res.size() * sizeof(double)
+        );
+        const int file = writer->open(path + ".integral.bin");
+        if (file >= 0) {
+            writer->write(file, 0, std::move(str));
+            writer->close(file, std::move(on_closed));
+        }
+        return;
+    }
+
+    const int stream_count = split_channels ? channel_count : 1;
+    for (int s = 0; s < stream_count; s++) {
+        std::stringstream ss;
+        ss.precision(1);
+        const int c_begin = split_channels ? s : 0;
+        const int c_end = split_channels ? s + 1 : channel_count;
+        for (int c = c_begin; c < c_end; c++) {
+            for (int y = 0; y < height; y++) {
+                append_row_text(ss, &res[y * row_size + c], width, 
+                        channel_count);
+            }
+            ss << '\n';
+        }
+        std::string filename = path;
+        if (split_channels) {
+            filename += ".c" + std::to_string(s);
+        }
+        const int file = writer->open(filename + ".integral");
+        if (file >= 0) {
+            writer->write(file, 0, ss.str());
+            //cached output is never split, so it is the only file
+            writer->close(file, on_closed);
+        }
+    }
+}
+
+ImageIntegrator::LazyIntegral::LazyIntegral(
+        std::shared_ptr<ImageData> image_data
+)
+: image_data(image_data),
+integrated_counts(new std::atomic<int>[image_data->block_count_y])
+{
+    query.try_attach(image_data->result);
+    for (int y = 0; y < image_data->block_count_y; y++) {
+        integrated_counts[y].store(0);
+    }
+}
+
+size_t ImageIntegrator::LazyIntegral::get_integrated_block_count() const {
+    size_t count = 0;
+    for (int y = 0; y < image_data->block_count_y; y++) {
+        count += integrated_counts[y].load();
+    }
+    return count;
+}
+
+void ImageIntegrator::LazyIntegral::materialize(const cv::Rect& rect) {
+    const cv::Rect clipped = 
+        rect & cv::Rect(0, 0, query.get_width(), query.get_height());
+    if (clipped.width <= 0 || clipped.height <= 0) {
+        return;
+    }
+    //sum takes corners up to bottom right pixel of rectangle
+    materialize_block(
+            (clipped.x + clipped.width - 1) / image_data->block_width, 
+            (clipped.y + clipped.height - 1) / image_data->block_height
+    );
+}
+
+void ImageIntegrator::LazyIntegral::materialize_block(
+        int block_x, 
+        int block_y
+) {
+    //rows above have at least as many integrated blocks
+    if (integrated_counts[block_y].load(std::memory_order_acquire) > 
+            block_x) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock{mtx};
+    for (int y = 0; y <= block_y; y++) {
+        const int count = integrated_counts[y].load(std::memory_order_relaxed);
+        for (int x = count; x <= block_x; x++) {
+            for (int c = 0; c < image_data->channel_count; c++) {
+                image_data->process_block(x, y, c);
+            }
+        }
+        if (count <= block_x) {
+            integrated_counts[y].store(block_x + 1, std::memory_order_release);
+        }
+    }
+}
+
+double ImageIntegrator::LazyIntegral::sum(const cv::Rect& rect, int channel) {
+    materialize(rect);
+    return query.sum(rect, channel);
+}
+
+double ImageIntegrator::LazyIntegral::mean(const cv::Rect& rect, int channel) {
+    materialize(rect);
+    return query.mean(rect, channel);
+}
+
+void ImageIntegrator::LazyIntegral::sum_many(
+        const cv::Rect* rects,
+        size_t count,
+        double* sums,
+        int channel
+) {
+    for (size_t i = 0; i < count; i++) {
+        materialize(rects[i]);
+    }
+    query.sum_many(rects, count, sums, channel);
+}
+
+ImageIntegrator::VolumeData::~VolumeData() {
+    if (promise) {
+        promise->set_value(cv::Mat());
+    }
+    if (file_promise) {
+        file_promise->set_value(false);
+    }
+}
+
+bool ImageIntegrator::VolumeData::try_init() {
+    const int volume_dim_count = 3;
+    if (volume.data == nullptr || volume.dims != volume_dim_count) {
+        logger("ERROR: volume must be 3D matrix");
+        return false;
+    }
+    if (!is_supported_depth(volume.depth())) {
+        logger("ERROR: only 8U, 16U, 32F and 64F volumes are supported");
+        return false;
+    }
+    if (block_width <= 0 || block_height <= 0 || block_depth <= 0) {
+        logger("ERROR: incorrect block of volume");
+        return false;
+    }
+    depth = volume.size[0];
+    height = volume.size[1];
+    width = volume.size[2];
+    channel_count = volume.channels();
+    const int type = CV_MAKETYPE(CV_64F, channel_count);
+
+    if (!output_path.empty()) {
+        VolumeFileHeader header;
+        header.width = width;
+        header.height = height;
+        header.depth = depth;
+        header.channels = channel_count;
+        header.row_stride = size_t(width) * channel_count;
+        header.slice_stride = header.row_stride * height;
+        if (!res.try_map_file(output_path, header)) {
+            return false;
+        }
+        const int sizes[] = {depth, height, width};
+        result = cv::Mat(volume_dim_count, sizes, type, res.data());
+    } else if (result.empty()) {
+        const int sizes[] = {depth, height, width};
+        result.create(volume_dim_count, sizes, type);
+    }
+    if (result.dims != volume_dim_count || result.type() != type || 
+            result.size[0] != depth || result.size[1] != height || 
+            result.size[2] != width) {
+        logger("ERROR: destination doesn't match volume");
+        return false;
+    }
+    row_stride = result.step[1] / sizeof(double);
+    slice_stride = result.step[0] / sizeof(double);
+
+    block_count_x = (width + block_width - 1) / block_width;
+    block_count_y = (height + block_height - 1) / block_height;
+    block_count_z = (depth + block_depth - 1) / block_depth;
+    zeros.assign(size_t(width) * channel_count, 0.0);
+    //blocks on faces of volume have fewer previous blocks
+    block_states.resize(block_count_x * block_count_y * block_count_z);
+    for (int z = 0; z < block_count_z; z++) {
+        for (int y = 0; y < block_count_y; y++) {
+            for (int x = 0; x < block_count_x; x++) {
+                block_states[get_block_id(x, y, z)] = 
+                    (x == 0) + (y == 0) + (z == 0);
+            }
+        }
+    }
+    remaining_blocks = int(block_states.size());
+    return true;
+}
+
+void ImageIntegrator::VolumeData::process_block(
+        int block_x, 
+        int block_y, 
+        int block_z
+) {
+    switch (volume.depth()) {
+    case CV_8U:
+        process_voxel_block<uint8_t>(block_x, block_y, block_z);
+        break;
+    case CV_16U:
+        process_voxel_block<uint16_t>(block_x, block_y, block_z);
+        break;
+    case CV_32F:
+        process_voxel_block<float>(block_x, block_y, block_z);
+        break;
+    case CV_64F:
+        process_voxel_block<double>(block_x, block_y, block_z);
+        break;
+    }
+}
+
+template <typename T>
+void ImageIntegrator::VolumeData::process_voxel_block(
+        int block_x, 
+        int block_y, 
+        int block_z
+) {
+    typedef typename PixelTraits<T>::Sum Sum;
+    const int x_start = block_x * block_width;
+    const int x_end = std::min(width, x_start + block_width);
+    const int y_start = block_y * block_height;
+    const int y_end = std::min(height, y_start + block_height);
+    const int z_start = block_z * block_depth;
+    const int z_end = std::min(depth, z_start + block_depth);
+    double* values = reinterpret_cast<double*>(result.data);
+
+    for (int z = z_start; z < z_end; z++) {
+        for (int y = y_start; y < y_end; y++) {
+            double* row = values + z * slice_stride + y * row_stride;
+            //values before volume are zeros
+            const double* back = z > 0 ? row - slice_stride : zeros.data();
+            const double* up = y > 0 ? row - row_stride : zeros.data();
+            const double* up_back = z > 0 && y > 0 ? 
+                row - slice_stride - row_stride : zeros.data();
+            const T* data = reinterpret_cast<const T*>(volume.data + 
+                    z * volume.step[0] + y * volume.step[1]);
+            for (int c = 0; c < channel_count; c++) {
+                //value is sum of slices before it and 2D integral of its 
+                //slice, row sum starts with sum of row left of block
+                Sum acc = 0;
+                if (x_start > 0) {
+                    const size_t i = size_t(x_start - 1) * channel_count + c;
+                    acc = Sum(row[i] - back[i] - up[i] + up_back[i]);
+                }
+                for (int x = x_start; x < x_end; x++) {
+                    const size_t i = size_t(x) * channel_count + c;
+                    acc += data[i];
+                    row[i] = double(acc) + back[i] + up[i] - up_back[i];
+                }
+            }
+        }
+    }
+}
+
+void ImageIntegrator::VolumeData::on_integrated() {
+    if (file_promise) {
+        //table is complete only when it is written back without error
+        file_promise->set_value(res.sync(true));
+        file_promise.reset();
+    }
+    if (promise) {
+        promise->set_value(result);
+        promise.reset();
+    }
+}
+
+void ImageIntegrator::TaskVolume::execute() {
+    volume_data->process_block(block_x, block_y, block_z);
+
+    auto handle_next_block = [&] (int x, int y, int z) {
+        if (x >= volume_data->block_count_x || 
+                y >= volume_data->block_count_y || 
+                z >= volume_data->block_count_z) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock{volume_data->mtx};
+        const int state = 
+            ++volume_data->block_states[volume_data->get_block_id(x, y, z)];
+        lock.unlock();
+        //block waits for three previous blocks
+        if (state == 3) {
+            task_pool->push(new TaskVolume{
+                task_pool, 
+                volume_data, 
+                x, 
+                y, 
+                z
+            });
+        }
+    };
+    handle_next_block(block_x + 1, block_y, block_z);
+    handle_next_block(block_x, block_y + 1, block_z);
+    handle_next_block(block_x, block_y, block_z + 1);
+
+    if (--volume_data->remaining_blocks == 0) {
+        volume_data->on_integrated();
+    }
+}
@@ -1,13 +1,29 @@
 #ifndef IMAGE_INTEGRATOR_HH
 #define IMAGE_INTEGRATOR_HH
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/highgui.hpp>
 
+#include <image_integrator/engine_tuner.hh>
+#include <image_integrator/image_header.hh>
+#include <image_integrator/integral_buffer.hh>
+#include <image_integrator/integral_query.hh>
+#include <image_integrator/memory_budget.hh>
+#include <image_integrator/pixel_traits.hh>
+#include <image_integrator/result_cache.hh>
+#include <io_utils/async_writer.hh>
+#include <multithread_utils/semaphore.hh>
 #include <multithread_utils/thread_pool.hh>
 
 /// Class for creating integral images
@@ -17,6 +33,71 @@
 class ImageIntegrator {
 public:
 
+    /// Format of created integral image file
+    enum class OutputFormat {
+        /// text file *original_name*.integral, see process()
+        text,
+        /**
+         *  binary file *original_name*.integral.bin (see IntegralFileHeader) 
+         *  mapped into memory, integral image is computed right in it
+         */
+        mapped,
+        /// integral image is only computed, useful for benchmarks
+        none
+    };
+
+    /// Time spent by stages of pipeline, all times are in seconds
+    struct PipelineStats {
+        /// time since try_init
+        double wall_time = 0;
+        /// time of decoding, 0 if images are decoded by integration threads
+        double decode_busy_time = 0;
+        int decode_threads = 0;
+        /// time of integration and formatting of output
+        double integrate_busy_time = 0;
+        int integrate_threads = 0;
+        /// time when writer had requests in flight
+        double write_busy_time = 0;
+        /// time integration threads waited for writer
+        double write_stall_time = 0;
+        /**
+         *  images processed by strips whose output wasn't completely 
+         *  written, other images report failure to their sink
+         */
+        uint64_t failed_streams = 0;
+    };
+
+    /// Destination of integral image computed by integrate()
+    struct OutputSpec {
+        /**
+         *  Matrix of image size and CV_64FC(channels) type, it may wrap 
+         *  memory of caller. If it is empty, new matrix is allocated.
+         */
+        cv::Mat destination;
+    };
+
+    /// Receiver of output of image given by process_encoded()
+    struct OutputSink {
+        /**
+         *  Base of output file names, like image path in process(). It is 
+         *  also used in error messages.
+         */
+        std::string path;
+        /**
+         *  If it is set, text output is passed to it chunk by chunk in file 
+         *  order instead of writing files, channels aren't split. It is 
+         *  called from worker threads, but never concurrently for one image.
+         */
+        std::function<void(std::string chunk)> write;
+        /**
+         *  Called once when image is done and its output files are written 
+         *  and closed, with false if it failed.
+         */
+        std::function<void(bool success)> close;
+    };
+
+    class LazyIntegral;
+
     ImageIntegrator() = default;
     ImageIntegrator(ImageIntegrator&) = delete;
     ImageIntegrator& operator= (const ImageIntegrator& ) = delete;
@@ -28,48 +109,424 @@ public:
      *  0.0 1.0
      *  2.0 6.0
      *  6.0 15.0
-     *  each channels divided by empty line
+     *  each channels divided by empty line. If channels are split, channel c 
+     *  is saved to *original_name*.c*c*.integral in the same format.
      *
      *  \param[in] image_path Path to image
      */
     void process(std::string image_path);
+    /**
+     *  Create an integral image like process(image_path) does and report 
+     *  to sink when it is done. Image is always processed by blocks, output 
+     *  files are named after image, so sink.path is ignored.
+     */
+    void process(std::string image_path, OutputSink sink);
+    /**
+     *  Create an integral image of encoded image (PNG, JPEG, ...) in memory 
+     *  the same way as process() does for file. Data is copied, so it may be 
+     *  freed right after call.
+     *  \param[in] data Encoded image
+     *  \param[in] size Size of encoded image
+     *  \param[in] sink Receiver of output
+     */
+    void process_encoded(const uint8_t* data, size_t size, OutputSink sink);
+    /// Create an integral image of encoded image, data is moved into job
+    void process_encoded(std::vector<uint8_t> data, OutputSink sink);
+    /**
+     *  Create an integral image of image which is already in memory. 
+     *  Image isn't copied, so it mustn't be changed until result is ready. 
+     *  Nothing is written to files.
+     *  \param[in] image 8U, 16U, 32F or 64F image with any count of channels
+     *  \param[in] spec Destination of result
+     *  \return Future of CV_64FC(channels) matrix of image size, matrix is 
+     *  empty on error
+     */
+    std::future<cv::Mat> integrate(
+            const cv::Mat& image, 
+            OutputSpec spec = OutputSpec()
+    );
+    /**
+     *  Replace pixels of dirty_rect in image and bring its integral image 
+     *  computed by integrate() up to date. Only values below and right of 
+     *  top left corner of dirty_rect change, so only blocks containing them 
+     *  are visited. Small dirty_rect is applied as integral image of pixel 
+     *  differences added to them, big one is integrated again by blocks. 
+     *  Previous integrate() or update() of image must be finished, new 
+     *  pixels mustn't be changed until result is ready.
+     *  \param[in] image Image given to integrate(), it is changed
+     *  \param[in] integral Integral image of image, it is changed in place
+     *  \param[in] dirty_rect Changed rectangle, it must be inside image. 
+     *  Empty one gives integral back at once, new_pixels aren't checked then.
+     *  \param[in] new_pixels Pixels of dirty_rect of image type
+     *  \return Future of integral, matrix is empty on error
+     */
+    std::future<cv::Mat> update(
+            const cv::Mat& image, 
+            const cv::Mat& integral, 
+            const cv::Rect& dirty_rect, 
+            const cv::Mat& new_pixels
+    );
+    /**
+     *  Integrate difference of two images and add it to accumulator. 
+     *  Blocks are integrated by the same wavefront as integrate(), each 
+     *  value is added to accumulator right after it is computed. Images 
+     *  and accumulator mustn't be changed until result is ready.
+     *  \param[in] image Image with any count of channels
+     *  \param[in] subtrahend Image of the same size and type, empty matrix 
+     *  is zero image
+     *  \param[in] accumulator CV_64FC(channels) matrix of image size
+     *  \param[in] spec Destination of integral image of difference
+     *  \return Future of accumulator, matrix is empty on error
+     */
+    std::future<cv::Mat> accumulate(
+            const cv::Mat& image, 
+            const cv::Mat& subtrahend, 
+            const cv::Mat& accumulator, 
+            OutputSpec spec = OutputSpec()
+    );
+    /**
+     *  Create summed-volume table of volume in memory, its value is 
+     *  sum of voxels of cuboid from origin to voxel. Volume is split into 
+     *  blocks of block shape and block depth, block is integrated when 
+     *  blocks before it along x, y and z are integrated, like wavefront 
+     *  engine does in 2D. Volume mustn't be changed until result is ready.
+     *  \param[in] volume 3D 8U, 16U, 32F or 64F matrix of depth x height x 
+     *  width voxels with any count of channels
+     *  \param[in] spec Destination, 3D CV_64FC(channels) matrix of volume 
+     *  size, it is allocated if empty
+     *  \return Future of table, matrix is empty on error
+     */
+    std::future<cv::Mat> integrate_volume(
+            const cv::Mat& volume, 
+            OutputSpec spec = OutputSpec()
+    );
+    /**
+     *  Create summed-volume table of volume like integrate_volume() 
+     *  right in binary file (see VolumeFileHeader) mapped into memory
+     *  \param[in] volume 3D matrix of depth x height x width voxels
+     *  \param[in] output_path Path to table file
+     *  \return Future which is true when table is complete and written to 
+     *  disk
+     */
+    std::future<bool> process_volume(
+            const cv::Mat& volume, 
+            const std::string& output_path
+    );
+    ///set depth of blocks of volumes, default is 16
+    void set_block_depth(int block_depth) { this->block_depth = block_depth; }
+    ///get depth of blocks of volumes
+    int get_block_depth() { return block_depth; }
+    /**
+     *  Create integral image of image in memory whose blocks are 
+     *  integrated only when queries need them, see LazyIntegral. Image isn't 
+     *  copied, so it mustn't be changed while result is used. Result 
+     *  mustn't outlive integrator.
+     *  \param[in] image Image with any count of channels
+     *  \return Lazy integral image, nullptr on error
+     */
+    std::shared_ptr<LazyIntegral> integrate_lazy(const cv::Mat& image);
     /** 
      *  Try to initialize with the given number of threads. If the number of 
      *  threads is specified incorrectly, then it will return false
      *  \param[in] thread_count Count of threads for thread pool
      */
     bool try_init(int thread_count);
+    /**
+     *  Set up writer of output files. Integrator uses writer thread with 
+     *  256 MiB limit of bytes in flight if it isn't called. Waits for all 
+     *  queued writes before switching.
+     *  \param[in] backend Preferred writer backend
+     *  \param[in] max_inflight_bytes Limit of queued and unfinished bytes
+     */
+    bool try_init_writer(AsyncWriter::Backend backend, size_t max_inflight_bytes);
+    /**
+     *  Set up decoding stage. By default images are decoded by the same 
+     *  threads as they are integrated. Separate decoding threads overlap 
+     *  decoding of next images with integration of current ones. Waits for 
+     *  all queued images before switching.
+     *  \param[in] thread_count Count of decoding threads, 0 means decoding 
+     *  by integration threads
+     *  \param[in] max_decoded_images Limit of images which are decoded but 
+     *  not integrated yet, decoding threads wait while it is reached. 0 means 
+     *  no limit, it is used only with separate decoding threads.
+     */
+    bool try_init_decoder(int thread_count, int max_decoded_images);
     /// Wait all tasks to finish and stop integrator
     void stop();
     /// Wait all tasks to finish 
     void wait();
     ///set block size for parallel processing, default is 64
-    void set_block_size(int block_size) { this->block_size = block_size; }
-    ///get block size for parallel processing, default is 64
-    int get_block_size() { return block_size; }
+    void set_block_size(int block_size) { 
+        set_block_shape(block_size, block_size); 
+    }
+    ///get block width for parallel processing, default is 64
+    int get_block_size() { return block_width; }
+    ///set width and height of blocks for parallel processing
+    void set_block_shape(int block_width, int block_height) { 
+        this->block_width = block_width; 
+        this->block_height = block_height; 
+    }
+    int get_block_width() { return block_width; }
+    int get_block_height() { return block_height; }
+    /**
+     *  set engine, default is Engine::wavefront with block shape given by 
+     *  set_block_shape. Engine::automatic chooses engine and block shape for 
+     *  each image by its header, see EngineTuner. Images of process() with 
+     *  sink, process_encoded() and integrate() are integrated by one block 
+     *  per channel by serial engine.
+     */
+    void set_engine(Engine engine) { this->engine = engine; }
+    ///get engine
+    Engine get_engine() { return engine; }
+    /**
+     *  Load calibration of automatic engine from file. If file doesn't exist 
+     *  or is damaged, costs are measured and saved to it. Without calibration 
+     *  default costs are used. Waits for all queued images.
+     *  \param[in] path Path to calibration file
+     */
+    bool try_calibrate(const std::string& path);
+    ///get tuner of automatic engine
+    EngineTuner& get_tuner() { return tuner; }
+    ///set format of output files, default is OutputFormat::text
+    void set_output_format(OutputFormat output_format) { 
+        this->output_format = output_format; 
+    }
+    ///get format of output files, default is OutputFormat::text
+    OutputFormat get_output_format() { return output_format; }
+    /**
+     *  write text files with O_DIRECT, bypassing page cache, default is false.
+     *  Useful for big batches whose results aren't read on the same host.
+     */
+    void set_direct_output(bool direct_output) { 
+        this->direct_output = direct_output; 
+    }
+    ///check if text files are written with O_DIRECT, default is false
+    bool get_direct_output() { return direct_output; }
+    /**
+     *  write each channel of text output to its own file, default is false. 
+     *  Files of different channels are written independently.
+     */
+    void set_split_channels(bool split_channels) { 
+        this->split_channels = split_channels; 
+    }
+    ///check if channels are written to separate files, default is false
+    bool get_split_channels() { return split_channels; }
+    /**
+     *  Decode image files with their own depth (8U, 16U, 32F or 64F) and 
+     *  channel count instead of converting them to 3-channel 8-bit, default 
+     *  is false. Grayscale scans are integrated in one channel and 16-bit 
+     *  values aren't cut to 8 bits. Text output keeps one decimal digit, so 
+     *  float sums are exact only in mapped output. Strips of 
+     *  set_strip_height() keep channels, but images which aren't 8-bit are 
+     *  rejected in that mode.
+     */
+    void set_unchanged_input(bool unchanged_input) { 
+        this->unchanged_input = unchanged_input; 
+    }
+    ///check if images are decoded without conversion, default is false
+    bool get_unchanged_input() { return unchanged_input; }
+    /**
+     *  Process images by strips of given height, 0 disables it (default). 
+     *  Only current strip and one integral row are kept in memory, so 
+     *  images larger than RAM can be processed. Text output is always split 
+     *  by channels in this mode, binary output is written without mapping.
+     */
+    void set_strip_height(int strip_height) { 
+        this->strip_height = strip_height; 
+    }
+    ///get height of strips, 0 if images are processed as a whole
+    int get_strip_height() { return strip_height; }
+    /**
+     *  Keep memory of finished images for reuse up to given size in bytes, 
+     *  0 disables it (default). Reused memory isn't zeroed, it saves page 
+     *  faults in batches of same sized images.
+     */
+    void set_pool_limit(size_t limit) { buffer_pool.set_limit(limit); }
+    ///get max size of memory retained for reuse
+    size_t get_pool_limit() { return buffer_pool.get_limit(); }
+    /**
+     *  set kind of pages for integral images, default is PageMode::normal. 
+     *  Huge pages reduce TLB misses when blocks are walked down a column. 
+     *  Decoded input is advised to use transparent huge pages too.
+     */
+    void set_page_mode(PageMode page_mode) { this->page_mode = page_mode; }
+    ///get kind of pages for integral images
+    PageMode get_page_mode() { return page_mode; }
+    /**
+     *  Give memory of input and integral image back to kernel block row by 
+     *  block row as soon as it isn't needed, default is false. It lowers peak 
+     *  memory of big images, but pooled memory has to be faulted in again.
+     */
+    void set_early_release(bool early_release) { 
+        this->early_release = early_release; 
+    }
+    ///check if memory is released block row by block row
+    bool get_early_release() { return early_release; }
+    /**
+     *  Limit estimated memory of images processed at the same time, 0 means 
+     *  no limit (default). Memory is estimated from image header before 
+     *  decoding, images which don't fit wait in queue.
+     */
+    void set_max_memory(size_t max_memory) { 
+        memory_budget.set_limit(max_memory); 
+    }
+    ///get limit of memory of images processed at the same time
+    size_t get_max_memory() { return memory_budget.get_limit(); }
+    ///get statistics of admission queue
+    MemoryBudget::Stats get_admission_stats() { 
+        return memory_budget.get_stats(); 
+    }
+    ///get busy time of decoding, integration and writing
+    PipelineStats get_pipeline_stats();
+    /**
+     *  Pack images of up to max_pixels pixels into batches of batch_size 
+     *  images. Each batch is decoded, integrated and written by one task 
+     *  without splitting images into blocks, it saves scheduling cost of 
+     *  thumbnails. max_pixels 0 disables batching (default). Size of image 
+     *  is taken from its header, images with unknown header aren't batched.
+     */
+    void set_batching(size_t max_pixels, int batch_size);
+    ///get max count of pixels of batched image, 0 if batching is disabled
+    size_t get_batch_max_pixels() { return batch_max_pixels; }
+    /**
+     *  Append results of batched images to one container file (see 
+     *  IntegralRecordHeader) instead of separate files. Previously opened 
+     *  container is closed.
+     *  \param[in] path Path to container file, it is truncated
+     */
+    bool try_open_container(const std::string& path);
+    /// Wait for all tasks and close container file
+    void close_container();
+    /**
+     *  Skip integration of images whose identical file was already processed 
+     *  with the same output format. Results are kept in cache directory 
+     *  (see ResultCache), outputs of repeated images become their hard 
+     *  links. File of image is hashed before decoding, so hit costs no 
+     *  decoding. Text output split by channels, strips, containers, 
+     *  OutputFormat::none and output to sink callback bypass cache.
+     *  \param[in] dir Cache directory, it is created if absent
+     *  \param[in] capacity Limit of size of cached results in bytes
+     */
+    bool try_open_result_cache(const std::string& dir, size_t capacity);
+    ///get counters of result cache
+    ResultCache::Stats get_result_cache_stats() { 
+        return result_cache.get_stats(); 
+    }
 
 private:
 
+    /// State of text output file which is written in order
+    struct OutputStream {
+        /// number of calls of write_ready_rows which aren't handled yet
+        std::atomic<int> write_requests{0};
+        /// next row string to write, see get_block_row_id
+        int next_row = 0;
+        /// descriptor of file, -1 until first row is written
+        int file = -1;
+        /// size of already written part of file
+        uint64_t offset = 0;
+    };
+
     /// Structure for storing all the information necessary for processing 
-    struct ImageData {
+    struct ImageData : std::enable_shared_from_this<ImageData> {
         ImageData() = default;
         ImageData(ImageData&) = default;
         ImageData& operator= (const ImageData&) = default;
-        ImageData(int block_size)
-        :block_size(block_size)
+        /// take current settings of integrator
+        ImageData(ImageIntegrator& integrator)
+        :block_width(integrator.block_width),
+        block_height(integrator.block_height),
+        output_format(integrator.output_format),
+        direct_output(integrator.direct_output),
+        split_channels(integrator.split_channels),
+        unchanged_input(integrator.unchanged_input),
+        writer(&integrator.writer),
+        pool(&integrator.buffer_pool),
+        page_mode(integrator.page_mode),
+        decode_slots(integrator.decode_slots.get()),
+        result_cache(integrator.get_result_cache(
+                    integrator.output_format, integrator.split_channels)),
+        early_release(integrator.early_release)
         {}
         ImageData(std::string path) { try_init(path); }
+        ~ImageData();
         
         /// try to read image and create all processing structs if succesed
         bool try_init(std::string path);
+        /// create all processing structs for image which is already set
+        bool try_init_image();
+        /// decode image from encoded and create all processing structs
+        bool try_init_encoded();
+        /**
+         *  Restore output from result cache by content of encoded image, 
+         *  file of image is read into encoded if it is empty
+         *  \return true if job is finished: output is restored or image 
+         *  file can't be read
+         */
+        bool try_restore_output();
+        /// path of output file of result cache
+        std::string get_output_path() const;
         /// process block of image
         void process_block(
                 int block_x, 
                 int block_y, 
                 int channel
         );
+        /// process_block() of image whose values are of type T
+        template <typename T>
+        void process_pixel_block(int block_x, int block_y, int channel);
+        /**
+         *  process block of difference of image and subtrahend and add it 
+         *  to accumulator
+         */
+        void process_difference_block(
+                int block_x, 
+                int block_y, 
+                int channel
+        );
+        /// process_difference_block() of images whose values are of type T
+        template <typename T>
+        void process_pixel_difference_block(
+                int block_x, 
+                int block_y, 
+                int channel
+        );
+        /// add delta to values of block which depend on dirty_rect
+        void correct_block(
+                int block_x, 
+                int block_y, 
+                int channel
+        );
+        /**
+         *  Compute delta if it is used and copy new_pixels into image, 
+         *  image and result must be checked already
+         */
+        void apply_update();
+        /// integral image of new_pixels minus pixels of dirty_rect into delta
+        template <typename T>
+        void compute_delta();
         /// create string of all blocks in row for writing it to file
         std::string block_row_to_string(int y_block_num, int channel) const;
+        /**
+         *  Pass to writer all row strings of output stream which are ready and 
+         *  follow already written ones in file order (channel by channel, top 
+         *  to bottom)
+         *  \param[in] stream_id Channel if channels are split, otherwise 0
+         */
+        void write_ready_rows(int stream_id);
+        /// last block of block row is integrated in channel
+        void on_row_integrated(int y_block_num);
+        /// block row of channel is formatted or isn't needed for writing
+        void on_row_consumed(int y_block_num);
+        /// last block of channel is integrated
+        void on_channel_integrated();
+        /// let next image be decoded, does nothing if slot isn't held
+        void release_decode_slot();
+        /**
+         *  Discard input of integrated block rows and integral image of 
+         *  block rows which are consumed and aren't needed by block row below
+         */
+        void release_rows(int y_block_num);
         
         int get_block_id(int x, int y, int channel) const {
             return (y * block_count_x + x) * channel_count + channel;
@@ -83,9 +540,13 @@ private:
             return block_states[get_block_id(x, y, channel)];
         }
     
-        int get_id(int x, int y, int channel) const {
-            return y * image.size[1] * channel_count + 
-                x * channel_count + channel;
+        size_t get_id(int x, int y, int channel) const {
+            return y * row_stride + x * channel_count + channel;
+        }
+
+        size_t get_data_id(int x, int y, int channel) const {
+            return y * image.step[0] + 
+                (x * channel_count + channel) * image.elemSize1();
         }
     
         double& get_res(int x, int y, int channel) {
@@ -96,14 +557,6 @@ private:
             return res[get_id(x, y, channel)];
         }
     
-        uchar& get_data(int x, int y, int channel) {
-            return image.data[get_id(x, y, channel)];
-        }
-
-        uchar get_data(int x, int y, int channel) const {
-            return image.data[get_id(x, y, channel)];
-        }
-    
         int get_block_row_id(int y, int channel) const {
             return channel * block_count_y + y;
         }
@@ -116,14 +569,47 @@ private:
             return block_row_str[get_block_row_id(y, channel)];
         }
     
+        /// memory of job, it is returned to budget after all other members
+        std::shared_ptr<MemoryBudget::Reservation> reservation;
         /// readed from OpenCV image
         cv::Mat image;
         /// path of image
         std::string path;
         /// data for integral image
-        std::vector<double> res;
+        IntegralBuffer res;
+        /// distance between rows of res in values
+        size_t row_stride = 0;
         /// size of block
-        int block_size = 64;
+        int block_width = 64;
+        int block_height = 64;
+        /// serial engine, block is set to whole image when it is decoded
+        bool is_serial = false;
+        /// format of output file
+        OutputFormat output_format = OutputFormat::text;
+        /// write text output file with O_DIRECT
+        bool direct_output = false;
+        /// write each channel to its own file
+        bool split_channels = false;
+        /// image file is decoded without conversion to 8-bit BGR
+        bool unchanged_input = false;
+        /// writer of text output file
+        AsyncWriter* writer = nullptr;
+        /// pool for integral image memory
+        BufferPool* pool = nullptr;
+        /// kind of pages for integral image memory
+        PageMode page_mode = PageMode::normal;
+        /// limit of decoded images, nullptr if there is no limit
+        Semaphore* decode_slots = nullptr;
+        /// image holds one of decode_slots
+        bool holds_decode_slot = false;
+        /// cache of output, nullptr if output isn't cached
+        ResultCache* result_cache = nullptr;
+        /// key of output in result_cache, empty until image is hashed
+        std::string cache_key;
+        /// output is restored from result_cache
+        bool is_restored = false;
+        /// count of channels which are fully integrated
+        int integrated_channel_count = 0;
         /// states of all blocks
         /**
          *  Data is splitted in several blocks with different states:
@@ -140,17 +626,60 @@ private:
         std::mutex mtx;
         /// strings for writing to file
         std::vector<std::string> block_row_str;
+        /// count of finished block rows summed over channels
+        int finished_block_rows = 0;
+        /// discard memory of block rows as soon as they aren't needed
+        bool early_release = false;
+        /// image is decoded by integrator, so its memory can be discarded
+        bool owns_image = true;
+        /// count of channels where block row is integrated
+        std::vector<int8_t> integrated_channels;
+        /// count of channels where block row is consumed by writer
+        std::vector<int8_t> consumed_channels;
+        /// block rows whose input and integral image is discarded
+        std::vector<bool> input_released;
+        std::vector<bool> res_released;
+        /// integral image in memory, see integrate()
+        cv::Mat result;
+        /// receives result when all channels are integrated
+        std::shared_ptr<std::promise<cv::Mat>> promise;
+        /// changed rectangle of update()
+        cv::Rect dirty_rect;
+        /// pixels of dirty_rect of update(), they are copied into image
+        cv::Mat new_pixels;
+        /**
+         *  correct blocks by integral image of differences of new and old 
+         *  pixels of dirty_rect instead of integrating them again
+         */
+        bool use_delta = false;
+        /// integral image of differences, see use_delta
+        cv::Mat delta;
+        /// image subtracted from image by accumulate(), empty for zero image
+        cv::Mat subtrahend;
+        /// integral images are added to it if it isn't empty, see accumulate()
+        cv::Mat accumulator;
+        /// block where integration starts, blocks above and left are ready
+        int first_block_x = 0;
+        int first_block_y = 0;
+        /// encoded image of process_encoded(), freed after decoding
+        std::vector<uint8_t> encoded;
+        /// receiver of output of process_encoded()
+        OutputSink sink;
+        /// output file wasn't opened or written, set by writer thread too
+        std::atomic<bool> output_failed{false};
+        /// text output files, one for all channels or one per channel
+        std::unique_ptr<OutputStream[]> streams;
         /// count of block in x axis
         int block_count_x;
         /// count of block in y axis
         int block_count_y;
         /// count of image channels
-        int channel_count;
+        int channel_count = 0;
     };
     
     /**
-     *  Task for creating string of integrated image's block and writing it to 
-     *  file, when all row block strings is ready
+     *  Task for creating string of integrated image's block row and writing 
+     *  it to file as soon as all previous row strings are written
      */
     class TaskWrite : public ThreadPool::Task {
     public:
@@ -205,15 +734,17 @@ private:
     
     /**
      *  Read image and creates all neccassary data structs. Create TaskProcess 
-     *  for all channels with block (0,0)
+     *  for all channels with block (0,0) in integration pool
      */
     class TaskRead : public ThreadPool::Task {
     public:
         TaskRead(
                 ThreadPool* task_pool, 
+                ThreadPool* process_pool, 
                 std::string path, 
                 std::shared_ptr<ImageData> image_data) 
         : Task(task_pool),
+        process_pool(process_pool),
         path(path),
         image_data(image_data)
         {}
@@ -222,13 +753,336 @@ private:
     
         void execute() override;
     
+        ThreadPool* process_pool;
         std::string path;
         std::shared_ptr<ImageData> image_data;
     };
 
+    /// Volume which is integrated by 3D blocks
+    struct VolumeData {
+        VolumeData() = default;
+        VolumeData(const VolumeData&) = delete;
+        VolumeData& operator= (const VolumeData&) = delete;
+        ~VolumeData();
+
+        /**
+         *  check volume and create table in result, in file of output_path 
+         *  if it is set or in allocated matrix
+         */
+        bool try_init();
+        /// integrate all channels of block
+        void process_block(int block_x, int block_y, int block_z);
+        /// process_block() of volume whose values are of type T
+        template <typename T>
+        void process_voxel_block(int block_x, int block_y, int block_z);
+        /// last block is integrated
+        void on_integrated();
+
+        int get_block_id(int x, int y, int z) const {
+            return (z * block_count_y + y) * block_count_x + x;
+        }
+
+        cv::Mat volume;
+        /// table in memory, it wraps res if table is written to file
+        cv::Mat result;
+        IntegralBuffer res;
+        /// path of table file, empty if table is only in memory
+        std::string output_path;
+        int width = 0;
+        int height = 0;
+        int depth = 0;
+        int channel_count = 0;
+        /// distances between rows and slices of res in values
+        size_t row_stride = 0;
+        size_t slice_stride = 0;
+        int block_width = 64;
+        int block_height = 64;
+        int block_depth = 16;
+        int block_count_x = 0;
+        int block_count_y = 0;
+        int block_count_z = 0;
+        /// count of integrated blocks before block along x, y and z
+        std::vector<int8_t> block_states;
+        std::mutex mtx;
+        /// blocks which aren't integrated yet
+        std::atomic<int> remaining_blocks{0};
+        /// row of zeros standing for values before volume
+        std::vector<double> zeros;
+        /// receives table of integrate_volume()
+        std::shared_ptr<std::promise<cv::Mat>> promise;
+        /// receives completion of process_volume()
+        std::shared_ptr<std::promise<bool>> file_promise;
+    };
+
+    /**
+     *  Integrate block of volume and start blocks after it along x, y and z 
+     *  which have all their previous blocks integrated
+     */
+    class TaskVolume : public ThreadPool::Task {
+    public:
+        TaskVolume(
+                ThreadPool* task_pool, 
+                std::shared_ptr<VolumeData> volume_data,
+                int block_x,
+                int block_y,
+                int block_z)
+        : Task(task_pool),
+        volume_data(volume_data),
+        block_x(block_x),
+        block_y(block_y),
+        block_z(block_z)
+        {}
+        
+        ~TaskVolume() override = default;
+    
+        void execute() override;
+    
+        std::shared_ptr<VolumeData> volume_data;
+        int block_x;
+        int block_y;
+        int block_z;
+    };
+
+    /// Container file shared by batches
+    struct Container {
+        int file = -1;
+        /// end of already reserved part of file
+        std::atomic<uint64_t> offset{0};
+    };
+
+    /**
+     *  Decode, integrate and write several small images one by one without 
+     *  any inner scheduling
+     */
+    class TaskBatch : public ThreadPool::Task {
+    public:
+        TaskBatch(
+                ThreadPool* task_pool, 
+                OutputFormat output_format,
+                bool split_channels,
+                AsyncWriter* writer,
+                Container* container) 
+        : Task(task_pool),
+        output_format(output_format),
+        split_channels(split_channels),
+        writer(writer),
+        container(container)
+        {}
+        
+        ~TaskBatch() override = default;
+    
+        void execute() override;
+        /**
+         *  write integral image of one image to its own files, output is 
+         *  stored in result_cache under cache_key unless it is empty
+         */
+        void write_files(
+                const std::string& path, 
+                const std::vector<double>& res, 
+                int width, 
+                int height, 
+                int channel_count,
+                const std::string& cache_key
+        );
+    
+        std::vector<std::string> paths;
+        OutputFormat output_format;
+        bool split_channels;
+        AsyncWriter* writer;
+        /// nullptr if results are written to separate files
+        Container* container;
+        /// cache of outputs, nullptr if they aren't cached
+        ResultCache* result_cache = nullptr;
+        /// images are decoded without conversion to 8-bit BGR
+        bool unchanged_input = false;
+        std::shared_ptr<MemoryBudget::Reservation> reservation;
+        /// estimated memory of all images
+        size_t bytes = 0;
+    };
+
+    /// default limit of output bytes in flight
+    static const size_t default_write_budget = size_t(256) << 20;
+    /**
+     *  measured cost of adding delta to one value relative to integration 
+     *  of one value, see update()
+     */
+    static constexpr double update_delta_cost = 0.85;
+
+    /**
+     *  Read image by strips, integrate and write each strip before reading 
+     *  next one
+     */
+    class TaskStream : public ThreadPool::Task {
+    public:
+        TaskStream(
+                ThreadPool* task_pool, 
+                std::string path, 
+                int strip_height,
+                OutputFormat output_format,
+                bool direct_output,
+                bool unchanged_input,
+                AsyncWriter* writer,
+                std::atomic<uint64_t>* failed_streams) 
+        : Task(task_pool),
+        path(path),
+        strip_height(strip_height),
+        output_format(output_format),
+        direct_output(direct_output),
+        unchanged_input(unchanged_input),
+        writer(writer),
+        failed_streams(failed_streams)
+        {}
+        
+        ~TaskStream() override = default;
+    
+        void execute() override;
+    
+        std::string path;
+        int strip_height;
+        OutputFormat output_format;
+        bool direct_output;
+        bool unchanged_input;
+        AsyncWriter* writer;
+        /// counter of images whose output is incomplete
+        std::atomic<uint64_t>* failed_streams;
+        std::shared_ptr<MemoryBudget::Reservation> reservation;
+    };
+
+    /// estimate memory of image processing from image header
+    size_t estimate_memory(const std::string& image_path) const;
+    size_t estimate_memory(const ImageHeader& header) const;
+    /// count of channels of decoded image of header
+    int get_decoded_channels(const ImageHeader& header) const {
+        return unchanged_input ? header.channels : 3;
+    }
+    /**
+     *  upper bound of bytes of value of decoded image, header doesn't 
+     *  tell depth of unchanged input
+     */
+    size_t get_decoded_value_size() const {
+        return unchanged_input ? sizeof(double) : sizeof(uint8_t);
+    }
+    /// pool where images are decoded
+    ThreadPool& get_decode_pool() { 
+        return decode_threads > 0 ? decode_pool : task_pool; 
+    }
+    /// wait until both pools and writer are idle, each of them can feed pools
+    void wait_tasks();
+    /// pass output of image to sink instead of files if it has callback
+    static void set_sink(ImageData& image_data, OutputSink sink);
+    /**
+     *  Set blocks of image processed by blocks according to engine. 
+     *  Automatic engine needs size of image, without it (width is 0) block 
+     *  shape of integrator is kept.
+     */
+    void set_engine_blocks(
+            ImageData& image_data, 
+            int width, 
+            int height, 
+            int channels, 
+            size_t value_size
+    );
+    /// start reading of image when its memory fits into budget
+    void submit_read(TaskRead* task, size_t bytes);
+    /// job of image in memory of caller whose result is given to promise
+    std::shared_ptr<ImageData> create_in_memory_data(
+            const cv::Mat& image, 
+            const cv::Mat& destination,
+            std::shared_ptr<std::promise<cv::Mat>> promise
+    );
+    /// submit batch of small images even if it isn't full
+    void flush_batch();
+    /// result cache for output options, nullptr if they aren't cached
+    ResultCache* get_result_cache(OutputFormat format, bool split) {
+        const bool is_cacheable = format == OutputFormat::mapped || 
+            (format == OutputFormat::text && !split);
+        return result_cache.is_open() && is_cacheable ? &result_cache : nullptr;
+    }
+    /// start batch when its memory fits into budget
+    void submit_batch(TaskBatch* task);
+    /// initialize volume and start integration of its first block
+    void submit_volume(std::shared_ptr<VolumeData> volume_data);
+
+    /// must outlive all ImageData, so they are declared first
+    BufferPool buffer_pool;
+    MemoryBudget memory_budget;
+    std::unique_ptr<Semaphore> decode_slots;
     ThreadPool task_pool;
-    int block_size = 64;
+    ThreadPool decode_pool;
+    /// see PipelineStats, it is counted by callbacks of writer
+    std::atomic<uint64_t> failed_streams{0};
+    AsyncWriter writer;
+    int decode_threads = 0;
+    std::chrono::steady_clock::time_point start_time;
+    Container container;
+    /// batch which is filled by process()
+    std::unique_ptr<TaskBatch> batch;
+    size_t batch_max_pixels = 0;
+    int batch_size = 64;
+    EngineTuner tuner;
+    ResultCache result_cache;
+    Engine engine = Engine::wavefront;
+    int block_width = 64;
+    int block_height = 64;
+    int block_depth = 16;
+    OutputFormat output_format = OutputFormat::text;
+    bool direct_output = false;
+    bool split_channels = false;
+    bool unchanged_input = false;
+    int strip_height = 0;
+    PageMode page_mode = PageMode::normal;
+    bool early_release = false;
     bool is_inited = false;
 };
 
+/// Integral image whose blocks are integrated on first use
+/**
+ *  Block needs blocks above and left of it, like in wavefront engine, so 
+ *  query integrates all blocks up to the block of its bottom right corner 
+ *  which aren't integrated yet. Integrated blocks form a staircase: each 
+ *  block row is integrated from its start up to some block, and it never 
+ *  goes further than the row above. Blocks are integrated by the querying 
+ *  thread, queries of integrated blocks don't lock.
+ */
+class ImageIntegrator::LazyIntegral {
+public:
+    LazyIntegral(const LazyIntegral&) = delete;
+    LazyIntegral& operator= (const LazyIntegral&) = delete;
+
+    int get_width() const { return query.get_width(); }
+    int get_height() const { return query.get_height(); }
+    int get_channels() const { return query.get_channels(); }
+    /// count of integrated blocks of one channel
+    size_t get_integrated_block_count() const;
+
+    /// integrate blocks needed by sums of rectangle clipped to image
+    void materialize(const cv::Rect& rect);
+    /// Sum of channel values in rectangle, channel must be valid
+    double sum(const cv::Rect& rect, int channel = 0);
+    /// Mean of channel values in rectangle, 0 for empty rectangle
+    double mean(const cv::Rect& rect, int channel = 0);
+    /// Sums of channel values in many rectangles, see IntegralQuery
+    void sum_many(
+            const cv::Rect* rects,
+            size_t count,
+            double* sums,
+            int channel = 0
+    );
+
+private:
+    friend class ImageIntegrator;
+
+    explicit LazyIntegral(std::shared_ptr<ImageData> image_data);
+    /// integrate blocks above and left of block including it
+    void materialize_block(int block_x, int block_y);
+
+    std::shared_ptr<ImageData> image_data;
+    /// queries result matrix of image_data
+    IntegralQuery query;
+    /// serializes integration of blocks
+    std::mutex mtx;
+    /// count of integrated blocks of each block row
+    std::unique_ptr<std::atomic<int>[]> integrated_counts;
+};
+
 #endif
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <image_integrator/integral_buffer.hh>
+#include <multithread_utils/log.hh>
+
+bool IntegralFileHeader::is_valid() const {
+    const IntegralFileHeader reference;
+    return std::memcmp(magic, reference.magic, sizeof(magic)) == 0 &&
+        elem_size == sizeof(double) &&
+        row_stride >= uint64_t(width) * channels;
+}
+
+bool VolumeFileHeader::is_valid() const {
+    const VolumeFileHeader reference;
+    return std::memcmp(magic, reference.magic, sizeof(magic)) == 0 &&
+        elem_size == sizeof(double) &&
+        row_stride >= uint64_t(width) * channels &&
+        (height == 0 || row_stride <= slice_stride / height);
+}
+
+bool IntegralBuffer::try_alloc(
+        size_t count, 
+        BufferPool* pool, 
+        PageMode mode
+) {
+    release();
+    if (pool != nullptr) {
+        values = static_cast<double*>(
+                pool->acquire(count * sizeof(double), mode, capacity));
+        this->pool = pool;
+        page_mode = mode;
+    } else {
+        values = new (std::nothrow) double[count];
+    }
+    if (values == nullptr) {
+        logger("ERROR: can't allocate integral buffer");
+        return false;
+    }
+    this->count = count;
+    return true;
+}
+
+bool IntegralBuffer::try_map_file(
+        const std::string& path, 
+        const IntegralFileHeader& header
+) {
+    return try_map(path, &header, sizeof(header), 
+            header.row_stride * header.height);
+}
+
+bool IntegralBuffer::try_map_file(
+        const std::string& path, 
+        const VolumeFileHeader& header
+) {
+    return try_map(path, &header, sizeof(header), 
+            header.slice_stride * header.depth);
+}
+
+bool IntegralBuffer::try_map(
+        const std::string& path, 
+        const void* header, 
+        size_t header_size, 
+        size_t value_count
+) {
+    release();
+    const size_t file_size = header_size + value_count * sizeof(double);
+
+    //file may be hard link of another file, its content must stay intact
+    unlink(path.c_str());
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        logger("ERROR: can't create " + path);
+        return false;
+    }
+    if (ftruncate(fd, file_size) != 0) {
+        logger("ERROR: can't resize " + path);
+        close(fd);
+        return false;
+    }
+    void* ptr = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+            fd, 0);
+    //mapping keeps file referenced, descriptor isn't needed anymore
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        logger("ERROR: can't map " + path);
+        return false;
+    }
+
+    std::memcpy(ptr, header, header_size);
+    mapping = ptr;
+    mapping_size = file_size;
+    values = reinterpret_cast<double*>(
+            static_cast<char*>(ptr) + header_size);
+    count = value_count;
+    return true;
+}
+
+bool IntegralBuffer::sync(bool wait) {
+    if (mapping == nullptr) {
+        return true;
+    }
+    return msync(mapping, mapping_size, wait ? MS_SYNC : MS_ASYNC) == 0;
+}
+
+void IntegralBuffer::wrap(double* values, size_t count) {
+    release();
+    this->values = values;
+    this->count = count;
+    is_wrapped = true;
+}
+
+void IntegralBuffer::release() {
+    if (is_wrapped) {
+        is_wrapped = false;
+    } else if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+    } else if (pool != nullptr) {
+        pool->release(values, page_mode, capacity);
+    } else {
+        delete[] values;
+    }
+    values = nullptr;
+    pool = nullptr;
+    capacity = 0;
+    count = 0;
+    mapping = nullptr;
+    mapping_size = 0;
+}
+
+void IntegralBuffer::discard(size_t first, size_t count) {
+    if (first < this->count) {
+        count = std::min(count, this->count - first);
+        discard_pages(values + first, count * sizeof(double));
+    }
+}
+
+void IntegralBuffer::discard_pages(void* data, size_t size) {
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    const uintptr_t start = reinterpret_cast<uintptr_t>(data);
+    const uintptr_t begin = (start + page_size - 1) / page_size * page_size;
+    const uintptr_t end = (start + size) / page_size * page_size;
+    if (begin < end) {
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+    }
+}
@@ -0,0 +1,144 @@
+#ifndef INTEGRAL_BUFFER_HH
+#define INTEGRAL_BUFFER_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <image_integrator/buffer_pool.hh>
+
+/// Header of binary integral image file
+/**
+ *  File consists of this header followed by height rows of row_stride 
+ *  doubles, channels of one pixel are stored together
+ */
+struct IntegralFileHeader {
+    char magic[8] = {'I', 'N', 'T', 'G', 'R', 'L', '0', '1'};
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t channels = 0;
+    /// size of one stored value in bytes
+    uint32_t elem_size = sizeof(double);
+    /// distance between rows in values
+    uint64_t row_stride = 0;
+
+    bool is_valid() const;
+};
+
+static_assert(sizeof(IntegralFileHeader) == 32, 
+        "IntegralFileHeader must keep values 8-byte aligned");
+
+/// Header of binary summed-volume table file
+/**
+ *  File consists of this header followed by depth slices of slice_stride 
+ *  doubles, each slice consists of height rows of row_stride doubles, 
+ *  channels of one voxel are stored together
+ */
+struct VolumeFileHeader {
+    char magic[8] = {'I', 'N', 'T', 'V', 'O', 'L', '0', '1'};
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t depth = 0;
+    uint32_t channels = 0;
+    /// size of one stored value in bytes
+    uint32_t elem_size = sizeof(double);
+    uint32_t reserved = 0;
+    /// distance between rows in values
+    uint64_t row_stride = 0;
+    /// distance between slices in values
+    uint64_t slice_stride = 0;
+
+    bool is_valid() const;
+};
+
+static_assert(sizeof(VolumeFileHeader) == 48, 
+        "VolumeFileHeader must keep values 8-byte aligned");
+
+/// Storage for integral image values
+/**
+ *  Values are stored either in process memory or directly in a shared mapping 
+ *  of binary output file. In second case page cache holds the only copy of 
+ *  result and file is ready as soon as all values are written.
+ */
+class IntegralBuffer {
+public:
+    IntegralBuffer() = default;
+    IntegralBuffer(const IntegralBuffer&) = delete;
+    IntegralBuffer& operator= (const IntegralBuffer&) = delete;
+    ~IntegralBuffer() { release(); }
+
+    /**
+     *  Allocate uninitialized memory for count values
+     *  \param[in] count Count of values
+     *  \param[in] pool Pool for memory, memory is returned to it on release. 
+     *  If it is nullptr memory is allocated from heap.
+     *  \param[in] mode Kind of pages for memory from pool
+     */
+    bool try_alloc(
+            size_t count, 
+            BufferPool* pool = nullptr, 
+            PageMode mode = PageMode::normal
+    );
+    /**
+     *  Create file of required size and map it. Header is written to the 
+     *  beginning of file, values follow it. Existing file is unlinked first, 
+     *  so its other hard links keep their content.
+     *  \param[in] path Path to output file
+     *  \param[in] header Header with filled sizes
+     */
+    bool try_map_file(const std::string& path, const IntegralFileHeader& header);
+    /// Create and map summed-volume table file the same way
+    bool try_map_file(const std::string& path, const VolumeFileHeader& header);
+    /**
+     *  Use memory owned by caller, it isn't freed on release
+     *  \param[in] values Memory for count values
+     */
+    void wrap(double* values, size_t count);
+    /**
+     *  Write back mapped file, does nothing for memory buffer
+     *  \param[in] wait Wait until values are on disk. Otherwise write back 
+     *  is only scheduled and I/O errors aren't reported.
+     */
+    bool sync(bool wait = false);
+    /// Free memory or unmap file
+    void release();
+    /**
+     *  Give back to kernel whole pages of values in range, they mustn't be 
+     *  read after it. Pages of mapped file stay in page cache.
+     */
+    void discard(size_t first, size_t count);
+    /// Give back to kernel whole pages of memory range
+    static void discard_pages(void* data, size_t size);
+
+    double* data() { return values; }
+    const double* data() const { return values; }
+    size_t size() const { return count; }
+    bool is_mapped() const { return mapping != nullptr; }
+
+    double& operator[] (size_t i) { return values[i]; }
+    double operator[] (size_t i) const { return values[i]; }
+
+private:
+    /// map file of header followed by value_count values
+    bool try_map(
+            const std::string& path, 
+            const void* header, 
+            size_t header_size, 
+            size_t value_count
+    );
+
+    double* values = nullptr;
+    size_t count = 0;
+    /// start of file mapping, nullptr for memory buffer
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    /// owner of memory buffer, nullptr for heap memory
+    BufferPool* pool = nullptr;
+    /// size of block from pool
+    size_t capacity = 0;
+    PageMode page_mode = PageMode::normal;
+    /// memory belongs to caller, see wrap
+    bool is_wrapped = false;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#include <sys/stat.h>
+
+#include <image_integrator/integral_cache.hh>
+#include <multithread_utils/log.hh>
+
+std::shared_ptr<const IntegralQuery> IntegralCache::get(
+        const std::string& path
+) {
+    std::promise<QueryPtr> promise;
+    std::shared_future<QueryPtr> query;
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+            stats.hits++;
+            lru.splice(lru.begin(), lru, it->second.lru_pos);
+            query = it->second.query;
+        } else {
+            stats.misses++;
+            lru.push_front(path);
+            Entry& entry = entries[path];
+            entry.query = promise.get_future().share();
+            entry.lru_pos = lru.begin();
+        }
+    }
+    if (query.valid()) {
+        return query.get();
+    }
+
+    //other threads wait for this load instead of loading the same image
+    QueryPtr loaded = load(path);
+    promise.set_value(loaded);
+    std::unique_lock<std::mutex> lock{mtx};
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+        if (loaded) {
+            it->second.bytes = loaded->get_size();
+            stats.bytes += it->second.bytes;
+            evict();
+        } else {
+            //failed loads aren't cached, image may appear later
+            lru.erase(it->second.lru_pos);
+            entries.erase(it);
+        }
+    }
+    return loaded;
+}
+
+bool IntegralCache::try_pin(const std::string& path) {
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        pinned_paths.insert(path);
+    }
+    if (!get(path)) {
+        unpin(path);
+        return false;
+    }
+    return true;
+}
+
+void IntegralCache::unpin(const std::string& path) {
+    std::unique_lock<std::mutex> lock{mtx};
+    if (pinned_paths.erase(path) > 0) {
+        evict();
+    }
+}
+
+IntegralCache::Stats IntegralCache::get_stats() const {
+    std::unique_lock<std::mutex> lock{mtx};
+    Stats result = stats;
+    result.entries = entries.size();
+    result.pinned = pinned_paths.size();
+    return result;
+}
+
+IntegralCache::QueryPtr IntegralCache::load(const std::string& path) {
+    std::shared_ptr<IntegralQuery> query = std::make_shared<IntegralQuery>();
+    //binary integral image is used only if it is newer than image
+    const std::string binary_path = path + ".integral.bin";
+    struct stat image_stat;
+    struct stat binary_stat;
+    const bool has_image = stat(path.c_str(), &image_stat) == 0;
+    if (stat(binary_path.c_str(), &binary_stat) == 0 && (!has_image || 
+                binary_stat.st_mtime >= image_stat.st_mtime)) {
+        if (query->try_open(binary_path)) {
+            return query;
+        }
+    }
+
+    cv::Mat image = cv::imread(path, integrator.get_unchanged_input() ? 
+            cv::IMREAD_UNCHANGED : cv::IMREAD_COLOR);
+    if (image.empty()) {
+        logger("ERROR: image(" + path + ") wasn't found");
+        return nullptr;
+    }
+    cv::Mat integral = integrator.integrate(image).get();
+    if (integral.empty() || !query->try_attach(integral)) {
+        return nullptr;
+    }
+    return query;
+}
+
+void IntegralCache::evict() {
+    auto it = lru.end();
+    while (stats.bytes > capacity && it != lru.begin()) {
+        --it;
+        auto entry = entries.find(*it);
+        //loading entries have no size yet
+        if (entry->second.bytes == 0 || pinned_paths.count(*it) > 0) {
+            continue;
+        }
+        stats.bytes -= entry->second.bytes;
+        stats.evictions++;
+        entries.erase(entry);
+        it = lru.erase(it);
+    }
+}
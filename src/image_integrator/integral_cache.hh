@@ -0,0 +1,86 @@
+#ifndef INTEGRAL_CACHE_HH
+#define INTEGRAL_CACHE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <image_integrator/image_integrator.hh>
+#include <image_integrator/integral_query.hh>
+
+/// Integral images of image paths shared by many queries
+/**
+ *  Integral image of path is mapped from *path*.integral.bin if it exists 
+ *  and isn't older than image, otherwise it is computed by integrator. 
+ *  Least recently used images are evicted when total size exceeds capacity, 
+ *  pinned images are never evicted, so pinned images alone may exceed it. 
+ *  Evicted image stays alive while it is used by queries.
+ */
+class IntegralCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t pinned = 0;
+        /// size of values of cached integral images
+        size_t bytes = 0;
+    };
+
+    /**
+     *  \param[in] integrator Integrator for images without binary integral
+     *  image file, it must be initialized
+     *  \param[in] capacity Limit of size of cached values in bytes
+     */
+    IntegralCache(ImageIntegrator& integrator, size_t capacity)
+    : integrator(integrator),
+    capacity(capacity)
+    {}
+    IntegralCache(const IntegralCache&) = delete;
+    IntegralCache& operator= (const IntegralCache&) = delete;
+
+    /**
+     *  Get integral image of image path, it is loaded once even if many
+     *  threads ask for it at once
+     *  \return Integral image, nullptr if it can't be loaded
+     */
+    std::shared_ptr<const IntegralQuery> get(const std::string& path);
+    /// Load integral image if needed and protect it from eviction
+    bool try_pin(const std::string& path);
+    /// Allow eviction of pinned integral image
+    void unpin(const std::string& path);
+    Stats get_stats() const;
+
+private:
+    typedef std::shared_ptr<const IntegralQuery> QueryPtr;
+
+    struct Entry {
+        std::shared_future<QueryPtr> query;
+        /// position in lru, front is most recently used
+        std::list<std::string>::iterator lru_pos;
+        /// 0 while integral image is loading
+        size_t bytes = 0;
+    };
+
+    /// map binary integral image file or compute integral image
+    QueryPtr load(const std::string& path);
+    /// evict unpinned entries until size fits capacity
+    void evict();
+
+    ImageIntegrator& integrator;
+    const size_t capacity;
+    mutable std::mutex mtx;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;
+    std::unordered_set<std::string> pinned_paths;
+    Stats stats;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#include <cstring>
+#include <fstream>
+
+#include <image_integrator/integral_container.hh>
+#include <multithread_utils/log.hh>
+
+bool IntegralRecordHeader::is_valid() const {
+    const IntegralRecordHeader reference;
+    return std::memcmp(magic, reference.magic, sizeof(magic)) == 0 && 
+        image.is_valid();
+}
+
+size_t IntegralRecordHeader::record_size() const {
+    return sizeof(IntegralRecordHeader) + padded_path_size() + 
+        size_t(image.height) * image.row_stride * image.elem_size;
+}
+
+void append_integral_record(
+        std::string& buffer,
+        const std::string& path,
+        int width,
+        int height,
+        int channels,
+        const double* values
+) {
+    IntegralRecordHeader header;
+    header.path_size = path.size();
+    header.image.width = width;
+    header.image.height = height;
+    header.image.channels = channels;
+    header.image.row_stride = size_t(width) * channels;
+
+    buffer.reserve(buffer.size() + header.record_size());
+    buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    buffer.append(path);
+    buffer.append(header.padded_path_size() - path.size(), '\0');
+    buffer.append(
+            reinterpret_cast<const char*>(values), 
+            size_t(height) * header.image.row_stride * sizeof(double)
+    );
+}
+
+bool read_integral_container(
+        const std::string& path, 
+        std::vector<IntegralRecord>& records
+) {
+    std::ifstream fin{path, std::ios::binary};
+    if (!fin) {
+        logger("ERROR: container(" + path + ") wasn't found");
+        return false;
+    }
+    IntegralRecordHeader header;
+    while (fin.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        if (!header.is_valid()) {
+            logger("ERROR: container(" + path + ") is damaged");
+            return false;
+        }
+        IntegralRecord record;
+        record.header = header.image;
+        std::string padded(header.padded_path_size(), '\0');
+        fin.read(&padded[0], padded.size());
+        record.path = padded.substr(0, header.path_size);
+        record.values.resize(size_t(header.image.height) * 
+                header.image.row_stride);
+        fin.read(reinterpret_cast<char*>(record.values.data()), 
+                record.values.size() * sizeof(double));
+        if (!fin) {
+            logger("ERROR: container(" + path + ") is truncated");
+            return false;
+        }
+        records.push_back(std::move(record));
+    }
+    return fin.eof() && fin.gcount() == 0;
+}
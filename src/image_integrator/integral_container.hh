@@ -0,0 +1,63 @@
+#ifndef INTEGRAL_CONTAINER_HH
+#define INTEGRAL_CONTAINER_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <image_integrator/integral_buffer.hh>
+
+/// Header of one record of integral container file
+/**
+ *  Container file is a sequence of records, one per image. Record consists 
+ *  of this header, path of image padded with zeros to 8 bytes and values 
+ *  laid out as in binary integral image file (see IntegralFileHeader).
+ */
+struct IntegralRecordHeader {
+    char magic[8] = {'I', 'N', 'T', 'G', 'R', 'C', '0', '1'};
+    /// size of image path without padding
+    uint32_t path_size = 0;
+    uint32_t reserved = 0;
+    IntegralFileHeader image;
+
+    bool is_valid() const;
+    /// size of padded path in bytes
+    size_t padded_path_size() const { return (path_size + 7) / 8 * 8; }
+    /// size of whole record in bytes
+    size_t record_size() const;
+};
+
+static_assert(sizeof(IntegralRecordHeader) == 48, 
+        "IntegralRecordHeader must keep values 8-byte aligned");
+
+/// Integral image read from container
+struct IntegralRecord {
+    std::string path;
+    IntegralFileHeader header;
+    std::vector<double> values;
+};
+
+/**
+ *  Append record of packed integral image to buffer
+ *  \param[in] path Path of original image
+ *  \param[in] values width * height * channels values
+ */
+void append_integral_record(
+        std::string& buffer,
+        const std::string& path,
+        int width,
+        int height,
+        int channels,
+        const double* values
+);
+
+/**
+ *  Read all records of container file, returns false if file can't be read 
+ *  or is damaged
+ */
+bool read_integral_container(
+        const std::string& path, 
+        std::vector<IntegralRecord>& records
+);
+
+#endif
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <image_integrator/engine_tuner.hh>
+#include <image_integrator/integral_query.hh>
+#include <multithread_utils/log.hh>
+
+namespace {
+
+/// count of queries whose corners are computed before their lookups
+const size_t chunk_size = 1024;
+
+/// Sum of rectangle by values of its corners, see get_corners
+inline double sum_corners(const double* values, const int64_t* corners,
+        size_t stride) {
+    double corner_values[4];
+    for (int k = 0; k < 4; k++) {
+        const int64_t offset = corners[k * stride];
+        corner_values[k] = offset >= 0 ? values[offset] : 0;
+    }
+    return corner_values[0] - corner_values[1] - corner_values[2] +
+        corner_values[3];
+}
+
+void sum_chunk_scalar(const double* values, const int64_t* corners,
+        size_t count, size_t stride, double* sums) {
+    for (size_t i = 0; i < count; i++) {
+        sums[i] = sum_corners(values, corners + i, stride);
+    }
+}
+
+#if defined(__x86_64__)
+
+/// Gather values of four corners, lanes with negative offset get 0
+__attribute__((target("avx2")))
+inline __m256d gather_corners(const double* values, const int64_t* offsets) {
+    const __m256i index =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(offsets));
+    const __m256i inside = _mm256_cmpgt_epi64(index, _mm256_set1_epi64x(-1));
+    return _mm256_mask_i64gather_pd(_mm256_setzero_pd(), values, index,
+            _mm256_castsi256_pd(inside), sizeof(double));
+}
+
+__attribute__((target("avx2")))
+void sum_chunk_avx2(const double* values, const int64_t* corners,
+        size_t count, size_t stride, double* sums) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256d bottom_right = gather_corners(values, corners + i);
+        const __m256d bottom_left =
+            gather_corners(values, corners + stride + i);
+        const __m256d top_right =
+            gather_corners(values, corners + 2 * stride + i);
+        const __m256d top_left =
+            gather_corners(values, corners + 3 * stride + i);
+        const __m256d sum = _mm256_add_pd(
+                _mm256_sub_pd(bottom_right, bottom_left),
+                _mm256_sub_pd(top_left, top_right));
+        _mm256_storeu_pd(sums + i, sum);
+    }
+    sum_chunk_scalar(values, corners + i, count - i, stride, sums + i);
+}
+
+const bool has_avx2 = __builtin_cpu_supports("avx2");
+
+#else
+
+const bool has_avx2 = false;
+
+void sum_chunk_avx2(const double* values, const int64_t* corners,
+        size_t count, size_t stride, double* sums) {
+    sum_chunk_scalar(values, corners, count, stride, sums);
+}
+
+#endif
+
+}
+
+bool IntegralQuery::try_attach(const cv::Mat& integral) {
+    if (integral.dims != 2 || integral.depth() != CV_64F ||
+            integral.step[0] % sizeof(double) != 0) {
+        logger("ERROR: integral image must be 2D matrix of doubles");
+        return false;
+    }
+    IntegralFileHeader header;
+    header.width = integral.cols;
+    header.height = integral.rows;
+    header.channels = integral.channels();
+    header.row_stride = integral.step[0] / sizeof(double);
+    if (!try_attach(integral.ptr<double>(), header)) {
+        return false;
+    }
+    matrix = integral;
+    return true;
+}
+
+bool IntegralQuery::try_attach(
+        const double* values,
+        const IntegralFileHeader& header
+) {
+    release();
+    //sizes are kept in int like sizes of cv::Mat
+    if (!header.is_valid() || header.width > INT_MAX || 
+            header.height > INT_MAX || header.channels > INT_MAX) {
+        logger("ERROR: damaged integral image header");
+        return false;
+    }
+    this->values = values;
+    width = header.width;
+    height = header.height;
+    channels = header.channels;
+    row_stride = header.row_stride;
+    //gathers are faster only if lookups don't wait for memory
+    use_gathers = has_avx2 && (height == 0 || 
+            row_stride <= CacheInfo::detect().l3 / sizeof(double) / height);
+    return true;
+}
+
+bool IntegralQuery::try_open(const std::string& path) {
+    release();
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        logger("ERROR: can't open " + path);
+        return false;
+    }
+    struct stat file_stat;
+    void* ptr = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 &&
+            size_t(file_stat.st_size) >= sizeof(IntegralFileHeader)) {
+        ptr = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        logger("ERROR: can't map " + path);
+        return false;
+    }
+
+    IntegralFileHeader header;
+    std::memcpy(&header, ptr, sizeof(header));
+    //sizes come from file, so they are compared by division to not overflow, 
+    //is_valid() checks that rows fit in row_stride
+    const uint64_t max_value_count = 
+        (file_stat.st_size - sizeof(header)) / sizeof(double);
+    if (!header.is_valid() || (header.height > 0 && 
+                header.row_stride > max_value_count / header.height)) {
+        logger("ERROR: damaged integral image file " + path);
+        munmap(ptr, file_stat.st_size);
+        return false;
+    }
+    if (!try_attach(reinterpret_cast<const double*>(
+                    static_cast<const char*>(ptr) + sizeof(header)), header)) {
+        munmap(ptr, file_stat.st_size);
+        return false;
+    }
+    //queries usually cover whole image, so it is read ahead at once
+    madvise(ptr, file_stat.st_size, MADV_WILLNEED);
+    mapping = ptr;
+    mapping_size = file_stat.st_size;
+    return true;
+}
+
+void IntegralQuery::release() {
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+    }
+    mapping = nullptr;
+    mapping_size = 0;
+    matrix.release();
+    values = nullptr;
+    width = 0;
+    height = 0;
+    channels = 0;
+    row_stride = 0;
+    use_gathers = false;
+}
+
+double IntegralQuery::sum(const cv::Rect& rect, int channel) const {
+    int64_t corners[4];
+    get_corners(rect, channel, corners, 1);
+    return sum_corners(values, corners, 1);
+}
+
+double IntegralQuery::mean(const cv::Rect& rect, int channel) const {
+    const cv::Rect clipped = rect & cv::Rect(0, 0, width, height);
+    if (clipped.empty()) {
+        return 0;
+    }
+    return sum(clipped, channel) / (double(clipped.width) * clipped.height);
+}
+
+void IntegralQuery::sum_many(
+        const cv::Rect* rects,
+        size_t count,
+        double* sums,
+        int channel
+) const {
+    if (channel < 0 || channel >= channels) {
+        logger("ERROR: channel " + std::to_string(channel) +
+                " isn't in integral image");
+        std::fill(sums, sums + count, 0.0);
+        return;
+    }
+    std::vector<int64_t> corners(4 * chunk_size);
+    for (size_t start = 0; start < count; start += chunk_size) {
+        const size_t n = std::min(chunk_size, count - start);
+        for (size_t i = 0; i < n; i++) {
+            get_corners(rects[start + i], channel, &corners[i], chunk_size);
+        }
+        if (use_gathers) {
+            sum_chunk_avx2(values, corners.data(), n, chunk_size, 
+                    sums + start);
+        } else {
+            sum_chunk_scalar(values, corners.data(), n, chunk_size, 
+                    sums + start);
+        }
+    }
+}
+
+void IntegralQuery::get_corners(
+        const cv::Rect& rect,
+        int channel,
+        int64_t* corners,
+        size_t stride
+) const {
+    const cv::Rect clipped = rect & cv::Rect(0, 0, width, height);
+    if (clipped.empty()) {
+        for (int k = 0; k < 4; k++) {
+            corners[k * stride] = -1;
+        }
+        return;
+    }
+    const int64_t left = clipped.x - 1;
+    const int64_t right = clipped.x + clipped.width - 1;
+    const int64_t top = clipped.y - 1;
+    const int64_t bottom = clipped.y + clipped.height - 1;
+    auto get_offset = [&] (int64_t x, int64_t y) {
+        return x < 0 || y < 0 ? -1 :
+            y * int64_t(row_stride) + x * channels + channel;
+    };
+    corners[0] = get_offset(right, bottom);
+    corners[stride] = get_offset(left, bottom);
+    corners[2 * stride] = get_offset(right, top);
+    corners[3 * stride] = get_offset(left, top);
+}
@@ -0,0 +1,99 @@
+#ifndef INTEGRAL_QUERY_HH
+#define INTEGRAL_QUERY_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include <image_integrator/integral_buffer.hh>
+
+/// Sums of pixel values over rectangles of image by its integral image
+/**
+ *  Each sum takes four lookups of integral image. Integral image is either
+ *  in memory (result of ImageIntegrator::integrate() or container record) or
+ *  binary integral image file mapped read-only. Rectangles are clipped to
+ *  image, sum of empty rectangle is 0.
+ */
+class IntegralQuery {
+public:
+    IntegralQuery() = default;
+    IntegralQuery(const IntegralQuery&) = delete;
+    IntegralQuery& operator= (const IntegralQuery&) = delete;
+    ~IntegralQuery() { release(); }
+
+    /**
+     *  Query integral image in memory, matrix isn't copied, it is only
+     *  referenced until release
+     *  \param[in] integral CV_64FC(channels) matrix of integral image
+     */
+    bool try_attach(const cv::Mat& integral);
+    /**
+     *  Query integral image in memory of caller, it mustn't be freed until
+     *  release
+     *  \param[in] values Values laid out as described by header
+     *  \param[in] header Sizes of integral image
+     */
+    bool try_attach(const double* values, const IntegralFileHeader& header);
+    /// Map binary integral image file *original_name*.integral.bin
+    bool try_open(const std::string& path);
+    /// Forget integral image, unmap file
+    void release();
+
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+    int get_channels() const { return channels; }
+    /// size of values of integral image in bytes
+    size_t get_size() const { return row_stride * height * sizeof(double); }
+
+    /// Sum of channel values in rectangle, channel must be valid
+    double sum(const cv::Rect& rect, int channel = 0) const;
+    /// Mean of channel values in rectangle, 0 for empty rectangle
+    double mean(const cv::Rect& rect, int channel = 0) const;
+    /**
+     *  Sums of channel values in many rectangles. Corners of a chunk of
+     *  rectangles are computed before their lookups, so lookups of different
+     *  rectangles overlap. If integral image fits into L3 cache and CPU
+     *  supports AVX2, lookups are done by gathers.
+     *  \param[in] rects Rectangles
+     *  \param[in] count Count of rectangles
+     *  \param[out] sums Sum for each rectangle
+     *  \param[in] channel Channel of sums
+     */
+    void sum_many(
+            const cv::Rect* rects,
+            size_t count,
+            double* sums,
+            int channel = 0
+    ) const;
+
+private:
+    /**
+     *  Offsets of bottom right, bottom left, top right and top left corners
+     *  of rectangle which take part in its sum, -1 for corners outside
+     *  integral image. Corner k is written to corners[k * stride].
+     */
+    void get_corners(
+            const cv::Rect& rect,
+            int channel,
+            int64_t* corners,
+            size_t stride
+    ) const;
+
+    const double* values = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    /// distance between rows in values
+    size_t row_stride = 0;
+    /// keeps attached matrix alive
+    cv::Mat matrix;
+    /// start of file mapping, nullptr if values are in memory
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    /// lookups of batches are done by AVX2 gathers
+    bool use_gathers = false;
+};
+
+#endif
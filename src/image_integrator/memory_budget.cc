@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <vector>
+
+#include <image_integrator/memory_budget.hh>
+
+void MemoryBudget::set_limit(size_t limit) {
+    std::vector<std::pair<Job, std::shared_ptr<Reservation>>> started;
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        this->limit = limit;
+        while (!queue.empty() && fits(queue.front().bytes)) {
+            account_wait(queue.front());
+            started.emplace_back(queue.front(), reserve(queue.front().bytes));
+            queue.pop_front();
+        }
+    }
+    for (auto& job : started) {
+        job.first.start(std::move(job.second));
+    }
+}
+
+void MemoryBudget::submit(size_t bytes, StartFunction start) {
+    std::unique_lock<std::mutex> lock{mtx};
+    //queue is FIFO, job can't overtake waiting ones
+    if (queue.empty() && fits(bytes)) {
+        std::shared_ptr<Reservation> reservation = reserve(bytes);
+        lock.unlock();
+        start(std::move(reservation));
+        return;
+    }
+    queue.push_back(Job{bytes, std::move(start), Clock::now()});
+    stats.queued_jobs++;
+}
+
+MemoryBudget::Stats MemoryBudget::get_stats() {
+    std::unique_lock<std::mutex> lock{mtx};
+    Stats res = stats;
+    res.waiting_jobs = queue.size();
+    return res;
+}
+
+void MemoryBudget::release(size_t bytes) {
+    std::vector<std::pair<Job, std::shared_ptr<Reservation>>> started;
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        used -= bytes;
+        while (!queue.empty() && fits(queue.front().bytes)) {
+            account_wait(queue.front());
+            started.emplace_back(queue.front(), reserve(queue.front().bytes));
+            queue.pop_front();
+        }
+    }
+    for (auto& job : started) {
+        job.first.start(std::move(job.second));
+    }
+}
+
+bool MemoryBudget::fits(size_t bytes) const {
+    return limit == 0 || used == 0 || used + bytes <= limit;
+}
+
+std::shared_ptr<MemoryBudget::Reservation> MemoryBudget::reserve(size_t bytes) {
+    used += bytes;
+    stats.started_jobs++;
+    stats.peak_bytes = std::max(stats.peak_bytes, used);
+    return std::make_shared<Reservation>(this, bytes);
+}
+
+void MemoryBudget::account_wait(const Job& job) {
+    const double wait_ms = std::chrono::duration<double, std::milli>(
+            Clock::now() - job.queued).count();
+    stats.total_wait_ms += wait_ms;
+    stats.max_wait_ms = std::max(stats.max_wait_ms, wait_ms);
+}
@@ -0,0 +1,89 @@
+#ifndef MEMORY_BUDGET_HH
+#define MEMORY_BUDGET_HH
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+/// Admission control of jobs by estimated memory
+/**
+ *  Job is started only when its estimated memory fits into the limit 
+ *  together with memory of running jobs, otherwise it waits in FIFO queue. 
+ *  Job which is bigger than the limit is started when nothing else runs.
+ */
+class MemoryBudget {
+public:
+    /// Memory of running job, it is returned to budget on destruction
+    class Reservation {
+    public:
+        Reservation(MemoryBudget* budget, size_t bytes)
+        : budget(budget),
+        bytes(bytes)
+        {}
+        Reservation(const Reservation&) = delete;
+        Reservation& operator= (const Reservation&) = delete;
+        ~Reservation() { budget->release(bytes); }
+
+    private:
+        MemoryBudget* budget;
+        size_t bytes;
+    };
+
+    /// Function which starts job, job keeps reservation while it runs
+    typedef std::function<void(std::shared_ptr<Reservation>)> StartFunction;
+
+    struct Stats {
+        /// count of started jobs
+        size_t started_jobs = 0;
+        /// count of jobs which had to wait in queue
+        size_t queued_jobs = 0;
+        /// count of jobs waiting now
+        size_t waiting_jobs = 0;
+        double total_wait_ms = 0;
+        double max_wait_ms = 0;
+        /// max estimated memory of running jobs
+        size_t peak_bytes = 0;
+    };
+
+    MemoryBudget() = default;
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator= (const MemoryBudget&) = delete;
+
+    /// set limit in bytes, 0 means no limit (default)
+    void set_limit(size_t limit);
+    size_t get_limit() const { return limit; }
+    /**
+     *  Start job now or put it in queue
+     *  \param[in] bytes Estimated memory of job
+     *  \param[in] start Function which starts job
+     */
+    void submit(size_t bytes, StartFunction start);
+    Stats get_stats();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Job {
+        size_t bytes;
+        StartFunction start;
+        Clock::time_point queued;
+    };
+
+    void release(size_t bytes);
+    /// check if job fits, must be called with locked mutex
+    bool fits(size_t bytes) const;
+    /// take memory for job, must be called with locked mutex
+    std::shared_ptr<Reservation> reserve(size_t bytes);
+    /// account time of job in queue, must be called with locked mutex
+    void account_wait(const Job& job);
+
+    std::mutex mtx;
+    std::deque<Job> queue;
+    size_t limit = 0;
+    size_t used = 0;
+    Stats stats;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef PIXEL_TRAITS_HH
+#define PIXEL_TRAITS_HH
+
+#include <cstdint>
+
+#include <opencv2/core.hpp>
+
+/// Row sum type of pixel values of type T
+/**
+ *  Integer values are summed in 64-bit integers, so row sums stay exact
+ *  whatever the width, and they become double only when added to integral
+ *  values. Floating point values are summed in double, the type of
+ *  integral values.
+ */
+template <typename T> struct PixelTraits;
+
+template <> struct PixelTraits<uint8_t> {
+    typedef int64_t Sum;
+};
+
+template <> struct PixelTraits<uint16_t> {
+    typedef int64_t Sum;
+};
+
+template <> struct PixelTraits<float> {
+    typedef double Sum;
+};
+
+template <> struct PixelTraits<double> {
+    typedef double Sum;
+};
+
+/// check if images of OpenCV depth can be integrated: 8U, 16U, 32F or 64F
+inline bool is_supported_depth(int depth) {
+    return depth == CV_8U || depth == CV_16U ||
+        depth == CV_32F || depth == CV_64F;
+}
+
+#endif
@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <image_integrator/result_cache.hh>
+#include <multithread_utils/log.hh>
+
+namespace {
+
+const uint64_t prime1 = 11400714785074694791ULL;
+const uint64_t prime2 = 14029467366897019727ULL;
+const uint64_t prime3 = 1609587929392839161ULL;
+const uint64_t prime4 = 9650029242287828579ULL;
+const uint64_t prime5 = 2870177450012600261ULL;
+
+inline uint64_t rotl(uint64_t x, int r) { return x << r | x >> (64 - r); }
+
+inline uint64_t read64(const uint8_t* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint64_t read32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline uint64_t mix_lane(uint64_t acc, uint64_t input) {
+    return rotl(acc + input * prime2, 31) * prime1;
+}
+
+inline uint64_t merge_lane(uint64_t hash, uint64_t lane) {
+    return (hash ^ mix_lane(0, lane)) * prime1 + prime4;
+}
+
+/// XXH64 hash, it runs at memory speed with four independent lanes
+uint64_t hash64(const uint8_t* data, size_t size, uint64_t seed) {
+    const uint8_t* p = data;
+    const uint8_t* const end = data + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t lanes[4] = {
+            seed + prime1 + prime2, seed + prime2, seed, seed - prime1
+        };
+        for (; p + 32 <= end; p += 32) {
+            for (int i = 0; i < 4; i++) {
+                lanes[i] = mix_lane(lanes[i], read64(p + 8 * i));
+            }
+        }
+        hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) +
+            rotl(lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = merge_lane(hash, lanes[i]);
+        }
+    } else {
+        hash = seed + prime5;
+    }
+    hash += size;
+    for (; p + 8 <= end; p += 8) {
+        hash = rotl(hash ^ mix_lane(0, read64(p)), 27) * prime1 + prime4;
+    }
+    if (p + 4 <= end) {
+        hash = rotl(hash ^ read32(p) * prime1, 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash = rotl(hash ^ *p * prime5, 11) * prime1;
+    }
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/// Copy content of src into empty file out, as reflink if possible
+bool try_copy(const std::string& src, int out) {
+    const int in = open(src.c_str(), O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    struct stat in_stat;
+    bool copied = fstat(in, &in_stat) == 0;
+#ifdef FICLONE
+    if (copied && ioctl(out, FICLONE, in) == 0) {
+        close(in);
+        return true;
+    }
+#endif
+    off_t offset = 0;
+    while (copied && offset < in_stat.st_size) {
+        const ssize_t sent = sendfile(out, in, &offset, in_stat.st_size - offset);
+        copied = sent > 0 || (sent < 0 && errno == EINTR);
+    }
+    close(in);
+    return copied;
+}
+
+/**
+ *  Make dst an independent copy of src. Copy is written to new file with 
+ *  unique name and renamed to dst, so existing dst or copy of concurrent 
+ *  job is never truncated.
+ *  \param[in] tmp_template Template of mkstemps() with suffix_size 
+ *  characters after XXXXXX, it must be on file system of dst
+ */
+bool try_place(
+        const std::string& src, 
+        const std::string& dst, 
+        std::string tmp_template,
+        int suffix_size
+) {
+    const int out = mkstemps(&tmp_template[0], suffix_size);
+    if (out < 0) {
+        return false;
+    }
+    bool placed = try_copy(src, out) && fchmod(out, 0644) == 0;
+    placed = close(out) == 0 && placed;
+    placed = placed && rename(tmp_template.c_str(), dst.c_str()) == 0;
+    if (!placed) {
+        unlink(tmp_template.c_str());
+    }
+    return placed;
+}
+
+}
+
+bool ResultCache::try_open(const std::string& dir, size_t capacity) {
+    mkdir(dir.c_str(), 0755);
+    DIR* handle = opendir(dir.c_str());
+    if (handle == nullptr) {
+        logger("ERROR: can't open result cache " + dir);
+        return false;
+    }
+    //cached files ordered by time of last use
+    std::vector<std::pair<time_t, std::string>> found;
+    std::vector<size_t> sizes;
+    while (dirent* entry = readdir(handle)) {
+        const std::string name = entry->d_name;
+        const std::string path = dir + "/" + name;
+        struct stat file_stat;
+        if (name[0] == '.' || stat(path.c_str(), &file_stat) != 0 ||
+                !S_ISREG(file_stat.st_mode)) {
+            continue;
+        }
+        //leftover of interrupted store
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+            unlink(path.c_str());
+            continue;
+        }
+        found.emplace_back(file_stat.st_mtime, name);
+        sizes.push_back(file_stat.st_size);
+    }
+    closedir(handle);
+
+    std::unique_lock<std::mutex> lock{mtx};
+    this->dir = dir;
+    this->capacity = capacity;
+    entries.clear();
+    lru.clear();
+    stats = Stats();
+    std::vector<size_t> order(found.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+        return found[a].first < found[b].first;
+    });
+    for (size_t i : order) {
+        lru.push_front(found[i].second);
+        Entry& entry = entries[found[i].second];
+        entry.bytes = sizes[i];
+        entry.lru_pos = lru.begin();
+        stats.bytes += sizes[i];
+    }
+    evict();
+    return true;
+}
+
+std::string ResultCache::make_key(
+        const uint8_t* data,
+        size_t size,
+        const std::string& options
+) {
+    //two hashes of different seeds make 128-bit digest, so collision of 
+    //different images isn't a practical concern
+    char key[64];
+    snprintf(key, sizeof(key), "%016llx%016llx-%llx",
+            static_cast<unsigned long long>(hash64(data, size, 0)),
+            static_cast<unsigned long long>(hash64(data, size, prime3)),
+            static_cast<unsigned long long>(size));
+    return key + ("." + options);
+}
+
+bool ResultCache::try_restore(
+        const std::string& key,
+        const std::string& output_path
+) {
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            stats.misses++;
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+    }
+    //result may be evicted meanwhile, then it is a miss
+    const std::string cached_path = dir + "/" + key;
+    const bool restored = try_place(cached_path, output_path, 
+            output_path + ".XXXXXX", 0);
+    if (restored) {
+        utimensat(AT_FDCWD, cached_path.c_str(), nullptr, 0);
+    }
+    std::unique_lock<std::mutex> lock{mtx};
+    if (restored) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+    }
+    return restored;
+}
+
+void ResultCache::store(const std::string& key, const std::string& output_path) {
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        if (entries.count(key) > 0) {
+            return;
+        }
+    }
+    //result appears in cache only when it is complete
+    const std::string cached_path = dir + "/" + key;
+    struct stat file_stat;
+    if (!try_place(output_path, cached_path, cached_path + ".XXXXXX.tmp", 4) ||
+            stat(cached_path.c_str(), &file_stat) != 0) {
+        logger("WARNING: can't store " + output_path + " in result cache");
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock{mtx};
+    if (entries.count(key) > 0) {
+        return;
+    }
+    lru.push_front(key);
+    Entry& entry = entries[key];
+    entry.bytes = file_stat.st_size;
+    entry.lru_pos = lru.begin();
+    stats.bytes += entry.bytes;
+    stats.stores++;
+    evict();
+}
+
+ResultCache::Stats ResultCache::get_stats() const {
+    std::unique_lock<std::mutex> lock{mtx};
+    Stats result = stats;
+    result.entries = entries.size();
+    return result;
+}
+
+void ResultCache::evict() {
+    while (stats.bytes > capacity && !lru.empty()) {
+        auto it = entries.find(lru.back());
+        unlink((dir + "/" + lru.back()).c_str());
+        stats.bytes -= it->second.bytes;
+        stats.evictions++;
+        entries.erase(it);
+        lru.pop_back();
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef RESULT_CACHE_HH
+#define RESULT_CACHE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/// On-disk cache of output files keyed by content of encoded images
+/**
+ *  Each result is one file in cache directory named by key. Output is
+ *  restored as reflink or copy of cached file, so outputs and cache never
+ *  share data and any of them may be edited. Files are written under
+ *  unique temporary names and renamed, so concurrent jobs of identical
+ *  images don't overwrite each other. Least recently used results are
+ *  deleted when total size exceeds capacity. Order of use survives
+ *  restarts as modification time of cached files.
+ */
+class ResultCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stores = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        /// size of cached files
+        size_t bytes = 0;
+    };
+
+    ResultCache() = default;
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator= (const ResultCache&) = delete;
+
+    /**
+     *  Use directory as cache, it is created if absent. Results already in
+     *  it are kept.
+     *  \param[in] dir Cache directory
+     *  \param[in] capacity Limit of size of cached files in bytes
+     */
+    bool try_open(const std::string& dir, size_t capacity);
+    bool is_open() const { return !dir.empty(); }
+    /**
+     *  Key of result of encoded image, identical images under different
+     *  paths have the same key. It holds 128-bit digest and size of image.
+     *  \param[in] data Content of image file
+     *  \param[in] size Size of image file
+     *  \param[in] options Output options which change content of result
+     */
+    static std::string make_key(
+            const uint8_t* data,
+            size_t size,
+            const std::string& options
+    );
+    /**
+     *  Create output file from cached result, existing output is replaced
+     *  \return false if result isn't cached or can't be restored
+     */
+    bool try_restore(const std::string& key, const std::string& output_path);
+    /// Add finished output file as result of key
+    void store(const std::string& key, const std::string& output_path);
+    Stats get_stats() const;
+
+private:
+    struct Entry {
+        size_t bytes = 0;
+        /// position in lru, front is most recently used
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    /// delete least recently used results until size fits capacity
+    void evict();
+
+    std::string dir;
+    size_t capacity = 0;
+    mutable std::mutex mtx;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;
+    Stats stats;
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <thread>
+
+#include <image_integrator/sequence_integrator.hh>
+#include <multithread_utils/log.hh>
+
+bool SequenceIntegrator::try_open(const std::string& source) {
+    if (!capture.open(source) || !capture.isOpened()) {
+        logger("ERROR: can't open frame source " + source);
+        return false;
+    }
+    return true;
+}
+
+bool SequenceIntegrator::run(FrameCallback on_frame, uint64_t max_frames) {
+    if (!capture.isOpened()) {
+        logger("ERROR: frame source isn't opened");
+        return false;
+    }
+    if (ring_size <= 0) {
+        logger("ERROR: ring of frames is empty");
+        return false;
+    }
+    ring.resize(ring_size);
+    submitted = 0;
+    consumed = 0;
+    is_finished = false;
+    latency.reset();
+    stats = Stats();
+    const Clock::time_point start = Clock::now();
+    std::thread consumer{&SequenceIntegrator::consume, this, on_frame};
+
+    for (uint64_t index = 0; max_frames == 0 || index < max_frames; index++) {
+        //frames of camera come at frame rate whether they are taken or not
+        Clock::time_point arrival = start;
+        if (frame_rate > 0) {
+            arrival += std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(index / frame_rate));
+            std::this_thread::sleep_until(arrival);
+        }
+        std::unique_lock<std::mutex> lock{mtx};
+        const auto is_full = [&] () {
+            return submitted - consumed == uint64_t(ring_size);
+        };
+        const bool is_hopeless = frame_rate > 0 && latency_target > 0 &&
+            std::chrono::duration<double, std::milli>(
+                    Clock::now() - arrival).count() > latency_target;
+        if (frame_rate > 0 && (is_full() || is_hopeless)) {
+            //frame is skipped without decoding
+            lock.unlock();
+            if (!capture.grab()) {
+                break;
+            }
+            lock.lock();
+            stats.frames++;
+            stats.dropped++;
+            continue;
+        }
+        ring_cv.wait(lock, [&] () { return !is_full(); });
+        Slot& slot = ring[submitted % ring_size];
+        lock.unlock();
+
+        if (frame_rate <= 0) {
+            arrival = Clock::now();
+        }
+        if (!capture.read(slot.frame) || slot.frame.empty()) {
+            break;
+        }
+        const int type = CV_MAKETYPE(CV_64F, slot.frame.channels());
+        if (slot.integral.type() != type ||
+                slot.integral.rows != slot.frame.rows ||
+                slot.integral.cols != slot.frame.cols) {
+            slot.integral.create(slot.frame.rows, slot.frame.cols, type);
+        }
+        slot.frame_index = index;
+        slot.arrival = arrival;
+        ImageIntegrator::OutputSpec spec;
+        spec.destination = slot.integral;
+        slot.result = integrator.integrate(slot.frame, spec);
+
+        lock.lock();
+        stats.frames++;
+        submitted++;
+        ring_cv.notify_all();
+    }
+
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        is_finished = true;
+        ring_cv.notify_all();
+    }
+    consumer.join();
+    std::unique_lock<std::mutex> lock{mtx};
+    stats.wall_time = std::chrono::duration<double>(Clock::now() - start)
+        .count();
+    return true;
+}
+
+void SequenceIntegrator::consume(FrameCallback on_frame) {
+    while (true) {
+        std::unique_lock<std::mutex> lock{mtx};
+        ring_cv.wait(lock, [&] () {
+            return consumed < submitted || is_finished;
+        });
+        if (consumed == submitted) {
+            return;
+        }
+        Slot& slot = ring[consumed % ring_size];
+        lock.unlock();
+
+        const cv::Mat integral = slot.result.get();
+        const double ms = std::chrono::duration<double, std::milli>(
+                Clock::now() - slot.arrival).count();
+        if (!integral.empty()) {
+            latency.add(ms);
+            if (on_frame) {
+                on_frame(slot.frame_index, slot.frame, integral);
+            }
+        }
+
+        lock.lock();
+        if (!integral.empty()) {
+            stats.integrated++;
+            if (latency_target > 0 && ms > latency_target) {
+                stats.late++;
+            }
+        }
+        consumed++;
+        ring_cv.notify_all();
+    }
+}
+
+SequenceIntegrator::Stats SequenceIntegrator::get_stats() const {
+    std::unique_lock<std::mutex> lock{mtx};
+    Stats result = stats;
+    result.p50_ms = latency.get_percentile(0.5);
+    result.p90_ms = latency.get_percentile(0.9);
+    result.p99_ms = latency.get_percentile(0.99);
+    result.p999_ms = latency.get_percentile(0.999);
+    return result;
+}
@@ -0,0 +1,126 @@
+#ifndef SEQUENCE_INTEGRATOR_HH
+#define SEQUENCE_INTEGRATOR_HH
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include <image_integrator/image_integrator.hh>
+#include <multithread_utils/latency_histogram.hh>
+
+/// Integral images of frames of video file or image sequence
+/**
+ *  Frames are decoded into a ring of frame buffers and integrated into
+ *  integral images of the same ring, so nothing is allocated after first
+ *  frames. Calling thread decodes next frame while integrator integrates
+ *  previous ones, another thread waits for integral images and hands them
+ *  out in order of frames.
+ *
+ *  Latency of frame is time from its arrival to its integral image. If
+ *  frame rate is set, frames arrive at that rate like frames of camera,
+ *  and frame is dropped if all buffers are busy or it can't meet latency
+ *  target anymore. Otherwise frame arrives when its decoding starts and
+ *  no frame is dropped.
+ */
+class SequenceIntegrator {
+public:
+    struct Stats {
+        /// frames taken from source, including dropped ones
+        uint64_t frames = 0;
+        uint64_t integrated = 0;
+        uint64_t dropped = 0;
+        /// integrated frames which missed latency target
+        uint64_t late = 0;
+        /// percentiles of latency of integrated frames
+        double p50_ms = 0;
+        double p90_ms = 0;
+        double p99_ms = 0;
+        double p999_ms = 0;
+        /// time of run in seconds
+        double wall_time = 0;
+    };
+
+    /**
+     *  Receiver of integral image of frame, it is called in order of
+     *  frames. Frame and integral image are valid only during call.
+     */
+    typedef std::function<void(
+            uint64_t frame_index,
+            const cv::Mat& frame,
+            const cv::Mat& integral
+    )> FrameCallback;
+
+    /// \param[in] integrator Integrator of frames, it must be initialized
+    explicit SequenceIntegrator(ImageIntegrator& integrator)
+    : integrator(integrator)
+    {}
+    SequenceIntegrator(const SequenceIntegrator&) = delete;
+    SequenceIntegrator& operator= (const SequenceIntegrator&) = delete;
+
+    /**
+     *  Open video file or image sequence like img_%04d.png
+     *  \param[in] source Source of cv::VideoCapture
+     */
+    bool try_open(const std::string& source);
+    /// set count of frame buffers, default is 3
+    void set_ring_size(int ring_size) { this->ring_size = ring_size; }
+    int get_ring_size() { return ring_size; }
+    /// set rate of arrival of frames, 0 means no pacing (default)
+    void set_frame_rate(double frame_rate) { this->frame_rate = frame_rate; }
+    double get_frame_rate() { return frame_rate; }
+    /// set latency target in milliseconds, 0 means no target (default)
+    void set_latency_target(double latency_target) {
+        this->latency_target = latency_target;
+    }
+    double get_latency_target() { return latency_target; }
+    /**
+     *  Integrate frames until source ends
+     *  \param[in] on_frame Receiver of integral images, may be empty
+     *  \param[in] max_frames Limit of frames taken from source, 0 is none
+     *  \return false if source isn't opened
+     */
+    bool run(FrameCallback on_frame, uint64_t max_frames = 0);
+    /// get statistics of last run
+    Stats get_stats() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    /// Frame buffer and its integral image
+    struct Slot {
+        cv::Mat frame;
+        cv::Mat integral;
+        std::future<cv::Mat> result;
+        uint64_t frame_index = 0;
+        Clock::time_point arrival;
+    };
+
+    /// hand out integral images in order until producer finishes
+    void consume(FrameCallback on_frame);
+
+    ImageIntegrator& integrator;
+    cv::VideoCapture capture;
+    int ring_size = 3;
+    double frame_rate = 0;
+    double latency_target = 0;
+    std::vector<Slot> ring;
+    mutable std::mutex mtx;
+    std::condition_variable ring_cv;
+    /// count of frames given to integrator and handed out
+    uint64_t submitted = 0;
+    uint64_t consumed = 0;
+    /// source ended, consumer stops when all frames are handed out
+    bool is_finished = false;
+    LatencyHistogram latency;
+    Stats stats;
+};
+
+#endif
@@ -0,0 +1,354 @@
+#include <cctype>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <image_integrator/strip_reader.hh>
+#include <multithread_utils/log.hh>
+
+namespace {
+
+/// Read exactly size bytes at offset
+bool read_all(int file, uint8_t* dst, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t readed = pread(file, dst, size, offset);
+        if (readed <= 0) {
+            return false;
+        }
+        dst += readed;
+        size -= readed;
+        offset += readed;
+    }
+    return true;
+}
+
+/**
+ *  Convert row of 1, 3 or 4 samples per pixel (RGB order) to BGR, or to 
+ *  the same samples in BGR order if channels are equal to samples
+ */
+void to_bgr(
+        const uint8_t* src, 
+        uint8_t* dst, 
+        int width, 
+        int samples, 
+        int channels
+) {
+    for (int x = 0; x < width; x++) {
+        const uint8_t* pixel = src + x * samples;
+        if (samples == 1) {
+            std::memset(dst, pixel[0], channels);
+        } else {
+            dst[0] = pixel[2];
+            dst[1] = pixel[1];
+            dst[2] = pixel[0];
+            if (channels == 4) {
+                dst[3] = pixel[3];
+            }
+        }
+        dst += channels;
+    }
+}
+
+/// Base of readers which read rows from file without decoding
+class FileStripReader : public StripReader {
+public:
+    ~FileStripReader() override {
+        if (file >= 0) {
+            close(file);
+        }
+    }
+
+    int read_rows(uint8_t* dst, int row_count) override {
+        const size_t row_bytes = size_t(width) * samples;
+        row_buf.resize(row_bytes);
+        int readed = 0;
+        for (; readed < row_count && next_row < height; readed++, next_row++) {
+            if (!read_all(file, row_buf.data(), row_bytes, 
+                        row_offset(next_row))) {
+                logger("ERROR: can't read row " + std::to_string(next_row));
+                break;
+            }
+            to_bgr(row_buf.data(), dst, width, samples, channels);
+            dst += size_t(width) * channels;
+        }
+        return readed;
+    }
+
+protected:
+    /// offset of row in file
+    virtual uint64_t row_offset(int y) const = 0;
+
+    int file = -1;
+    /// samples per pixel in file
+    int samples = 1;
+    std::vector<uint8_t> row_buf;
+    /// why file of reader's format can't be read by strips, empty if it 
+    /// isn't of that format
+    std::string unsupported;
+
+    friend std::unique_ptr<StripReader> StripReader::create(
+            const std::string& path, 
+            bool unchanged
+    );
+};
+
+/// Binary PGM (P5) and PPM (P6) with 8-bit samples
+class PnmStripReader : public FileStripReader {
+protected:
+    bool try_open(const std::string& path) override {
+        file = open(path.c_str(), O_RDONLY);
+        if (file < 0) {
+            return false;
+        }
+        uint8_t header[512];
+        ssize_t size = pread(file, header, sizeof(header), 0);
+        if (size < 2 || header[0] != 'P' || 
+                (header[1] != '5' && header[1] != '6')) {
+            return false;
+        }
+        samples = header[1] == '5' ? 1 : 3;
+
+        //width, height and maxval divided by whitespaces and comments
+        int values[3];
+        ssize_t pos = 2;
+        for (int i = 0; i < 3; i++) {
+            while (pos < size && (isspace(header[pos]) || header[pos] == '#')) {
+                if (header[pos] == '#') {
+                    while (pos < size && header[pos] != '\n') {
+                        pos++;
+                    }
+                } 
+                pos++;
+            }
+            if (pos >= size || !isdigit(header[pos])) {
+                return false;
+            }
+            values[i] = 0;
+            while (pos < size && isdigit(header[pos])) {
+                values[i] = values[i] * 10 + (header[pos] - '0');
+                pos++;
+            }
+        }
+        //single whitespace before data
+        pos++;
+        width = values[0];
+        height = values[1];
+        channels = unchanged ? samples : 3;
+        data_offset = pos;
+        if (values[2] >= 256) {
+            unsupported = "PNM samples have more than 8 bits";
+            return false;
+        }
+        return width > 0 && height > 0 && values[2] > 0;
+    }
+
+    uint64_t row_offset(int y) const override {
+        return data_offset + uint64_t(y) * width * samples;
+    }
+
+private:
+    uint64_t data_offset = 0;
+};
+
+/// Uncompressed stripped TIFF with 8-bit chunky samples
+class TiffStripReader : public FileStripReader {
+protected:
+    bool try_open(const std::string& path) override {
+        file = open(path.c_str(), O_RDONLY);
+        if (file < 0) {
+            return false;
+        }
+        const off_t end = lseek(file, 0, SEEK_END);
+        file_size = end > 0 ? end : 0;
+        uint8_t header[8];
+        if (!read_all(file, header, sizeof(header), 0)) {
+            return false;
+        }
+        if (header[0] == 'I' && header[1] == 'I') {
+            little_endian = true;
+        } else if (header[0] != 'M' || header[1] != 'M') {
+            return false;
+        }
+        if (get16(header + 2) != 42) {
+            return false;
+        }
+
+        const uint32_t ifd_offset = get32(header + 4);
+        uint8_t count_buf[2];
+        if (!read_all(file, count_buf, 2, ifd_offset)) {
+            return false;
+        }
+        const int entry_count = get16(count_buf);
+        std::vector<uint8_t> entries(entry_count * 12);
+        if (!read_all(file, entries.data(), entries.size(), ifd_offset + 2)) {
+            return false;
+        }
+
+        int compression = 1;
+        int photometric = -1;
+        int planar = 1;
+        int bits = 8;
+        uint32_t rows_per_strip = 0;
+        bool tiled = false;
+        for (int i = 0; i < entry_count; i++) {
+            const uint8_t* entry = entries.data() + i * 12;
+            const int tag = get16(entry);
+            switch (tag) {
+            case 256: width = value(entry, 0); break;
+            case 257: height = value(entry, 0); break;
+            case 258: bits = value(entry, 0); break;
+            case 259: compression = value(entry, 0); break;
+            case 262: photometric = value(entry, 0); break;
+            case 273:
+                if (!try_read_values(entry, strip_offsets)) {
+                    unsupported = "TIFF strip offsets are out of file";
+                }
+                break;
+            case 277: samples = value(entry, 0); break;
+            case 278: rows_per_strip = value(entry, 0); break;
+            case 284: planar = value(entry, 0); break;
+            case 322: tiled = true; break;
+            }
+        }
+        if (rows_per_strip == 0 || rows_per_strip > uint32_t(height)) {
+            rows_per_strip = height;
+        }
+        this->rows_per_strip = rows_per_strip;
+        channels = unchanged ? samples : 3;
+
+        const bool color = photometric == 2 && (samples == 3 || samples == 4);
+        const bool gray = photometric == 1 && samples == 1;
+        if (tiled) {
+            unsupported = "TIFF is tiled";
+        } else if (compression != 1) {
+            unsupported = "TIFF is compressed";
+        } else if (planar != 1 || bits != 8 || !(color || gray)) {
+            unsupported = "TIFF samples aren't 8-bit gray or RGB pixels";
+        }
+        return unsupported.empty() && width > 0 && height > 0 && 
+            strip_offsets.size() >= (height + rows_per_strip - 1) / 
+            rows_per_strip;
+    }
+
+    uint64_t row_offset(int y) const override {
+        return strip_offsets[y / rows_per_strip] + 
+            uint64_t(y % rows_per_strip) * width * samples;
+    }
+
+private:
+    uint32_t get16(const uint8_t* p) const {
+        return little_endian ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+    }
+
+    uint32_t get32(const uint8_t* p) const {
+        return little_endian ? 
+            get16(p) | get16(p + 2) << 16 : get16(p) << 16 | get16(p + 2);
+    }
+
+    /// value of SHORT or LONG entry with index i
+    uint32_t value(const uint8_t* entry, uint32_t i) {
+        const int type = get16(entry + 2);
+        const uint32_t count = get32(entry + 4);
+        const size_t size = type == 3 ? 2 : 4;
+        uint8_t buf[4];
+        if (count * size <= 4) {
+            std::memcpy(buf, entry + 8 + i * size, size);
+        } else if (!read_all(file, buf, size, get32(entry + 8) + i * size)) {
+            return 0;
+        }
+        return size == 2 ? get16(buf) : get32(buf);
+    }
+
+    /**
+     *  Read all values of SHORT or LONG entry, false if they don't fit into 
+     *  file, so damaged count can't make huge allocation
+     */
+    bool try_read_values(const uint8_t* entry, std::vector<uint32_t>& res) {
+        const uint64_t count = get32(entry + 4);
+        const uint64_t size = get16(entry + 2) == 3 ? 2 : 4;
+        if (count * size > 4 && 
+                uint64_t(get32(entry + 8)) + count * size > file_size) {
+            return false;
+        }
+        res.resize(count);
+        for (uint32_t i = 0; i < res.size(); i++) {
+            res[i] = value(entry, i);
+        }
+        return true;
+    }
+
+    bool little_endian = false;
+    uint64_t file_size = 0;
+    uint32_t rows_per_strip = 0;
+    std::vector<uint32_t> strip_offsets;
+};
+
+/// Any format supported by OpenCV, image is decoded as a whole
+class DecodedStripReader : public StripReader {
+public:
+    int read_rows(uint8_t* dst, int row_count) override {
+        const size_t row_bytes = size_t(width) * channels;
+        int readed = 0;
+        for (; readed < row_count && next_row < height; readed++, next_row++) {
+            std::memcpy(dst, image.ptr(next_row), row_bytes);
+            dst += row_bytes;
+        }
+        return readed;
+    }
+
+protected:
+    bool try_open(const std::string& path) override {
+        image = cv::imread(path, 
+                unchanged ? cv::IMREAD_UNCHANGED : cv::IMREAD_COLOR);
+        if (image.data == nullptr || image.size.dims() != 2) {
+            return false;
+        }
+        if (image.depth() != CV_8U) {
+            logger("ERROR: image(" + path + ") isn't 8-bit, it can't be "
+                    "read by strips without conversion");
+            return false;
+        }
+        width = image.size[1];
+        height = image.size[0];
+        channels = image.channels();
+        return true;
+    }
+
+private:
+    cv::Mat image;
+};
+
+}
+
+std::unique_ptr<StripReader> StripReader::create(
+        const std::string& path, 
+        bool unchanged
+) {
+    std::string unsupported = "it isn't binary PNM or TIFF";
+    std::unique_ptr<FileStripReader> file_readers[] = {
+        std::unique_ptr<FileStripReader>{new PnmStripReader},
+        std::unique_ptr<FileStripReader>{new TiffStripReader}
+    };
+    for (std::unique_ptr<FileStripReader>& file_reader : file_readers) {
+        file_reader->unchanged = unchanged;
+        if (file_reader->try_open(path)) {
+            return std::move(file_reader);
+        }
+        if (!file_reader->unsupported.empty()) {
+            unsupported = file_reader->unsupported;
+        }
+    }
+    //whole image may not fit in memory, so user is told about it
+    logger("WARNING: " + path + " can't be read by strips (" + unsupported + 
+            "), decoding it whole");
+    std::unique_ptr<StripReader> reader{new DecodedStripReader};
+    reader->unchanged = unchanged;
+    if (reader->try_open(path)) {
+        return reader;
+    }
+    return nullptr;
+}
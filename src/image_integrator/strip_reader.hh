@@ -0,0 +1,59 @@
+#ifndef STRIP_READER_HH
+#define STRIP_READER_HH
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/// Reads image from file by horizontal strips
+/**
+ *  Rows are returned in the same layout as cv::imread with cv::IMREAD_COLOR 
+ *  gives: 8-bit BGR, channels of one pixel stored together. Unchanged reader 
+ *  keeps channels of file like cv::IMREAD_UNCHANGED, but only 8-bit images 
+ *  are accepted. Binary PNM and uncompressed stripped TIFF are read from 
+ *  disk strip by strip, other formats are decoded as a whole by OpenCV.
+ */
+class StripReader {
+public:
+    StripReader() = default;
+    StripReader(const StripReader&) = delete;
+    StripReader& operator= (const StripReader&) = delete;
+    virtual ~StripReader() = default;
+
+    /**
+     *  Create reader suitable for file, nullptr if file can't be read
+     *  \param[in] path Path to image
+     *  \param[in] unchanged Keep channels of file, reject images which 
+     *  aren't 8-bit instead of converting them
+     */
+    static std::unique_ptr<StripReader> create(
+            const std::string& path, 
+            bool unchanged = false
+    );
+
+    /**
+     *  Read next rows
+     *  \param[out] dst Buffer for row_count * width * channels bytes
+     *  \param[in] row_count Count of rows to read
+     *  \return count of read rows, it is less than requested only on error or 
+     *  at the end of image
+     */
+    virtual int read_rows(uint8_t* dst, int row_count) = 0;
+
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+    int get_channels() const { return channels; }
+
+protected:
+    virtual bool try_open(const std::string& path) = 0;
+
+    int width = 0;
+    int height = 0;
+    int channels = 3;
+    /// channels of file are kept, set before try_open
+    bool unchanged = false;
+    /// count of already read rows
+    int next_row = 0;
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <image_integrator/volume_query.hh>
+#include <multithread_utils/log.hh>
+
+bool VolumeQuery::try_attach(const cv::Mat& table) {
+    if (table.dims != 3 || table.depth() != CV_64F ||
+            table.step[0] % sizeof(double) != 0 ||
+            table.step[1] % sizeof(double) != 0) {
+        logger("ERROR: summed-volume table must be 3D matrix of doubles");
+        return false;
+    }
+    VolumeFileHeader header;
+    header.width = table.size[2];
+    header.height = table.size[1];
+    header.depth = table.size[0];
+    header.channels = table.channels();
+    header.row_stride = table.step[1] / sizeof(double);
+    header.slice_stride = table.step[0] / sizeof(double);
+    if (!try_attach(reinterpret_cast<const double*>(table.data), header)) {
+        return false;
+    }
+    matrix = table;
+    return true;
+}
+
+bool VolumeQuery::try_attach(
+        const double* values,
+        const VolumeFileHeader& header
+) {
+    release();
+    //sizes are kept in int like sizes of cv::Mat
+    if (!header.is_valid() || header.width > INT_MAX || 
+            header.height > INT_MAX || header.depth > INT_MAX || 
+            header.channels > INT_MAX) {
+        logger("ERROR: damaged summed-volume table header");
+        return false;
+    }
+    this->values = values;
+    width = header.width;
+    height = header.height;
+    depth = header.depth;
+    channels = header.channels;
+    row_stride = header.row_stride;
+    slice_stride = header.slice_stride;
+    return true;
+}
+
+bool VolumeQuery::try_open(const std::string& path) {
+    release();
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        logger("ERROR: can't open " + path);
+        return false;
+    }
+    struct stat file_stat;
+    void* ptr = MAP_FAILED;
+    if (fstat(fd, &file_stat) == 0 &&
+            size_t(file_stat.st_size) >= sizeof(VolumeFileHeader)) {
+        ptr = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        logger("ERROR: can't map " + path);
+        return false;
+    }
+
+    VolumeFileHeader header;
+    std::memcpy(&header, ptr, sizeof(header));
+    //sizes come from file, so they are compared by division to not overflow
+    const uint64_t max_value_count = 
+        (file_stat.st_size - sizeof(header)) / sizeof(double);
+    if (!header.is_valid() || (header.depth > 0 && 
+                header.slice_stride > max_value_count / header.depth)) {
+        logger("ERROR: damaged summed-volume table file " + path);
+        munmap(ptr, file_stat.st_size);
+        return false;
+    }
+    if (!try_attach(reinterpret_cast<const double*>(
+                    static_cast<const char*>(ptr) + sizeof(header)), header)) {
+        munmap(ptr, file_stat.st_size);
+        return false;
+    }
+    //queries of volume are scattered, so pages are read on demand
+    madvise(ptr, file_stat.st_size, MADV_RANDOM);
+    mapping = ptr;
+    mapping_size = file_stat.st_size;
+    return true;
+}
+
+void VolumeQuery::release() {
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+    }
+    mapping = nullptr;
+    mapping_size = 0;
+    matrix.release();
+    values = nullptr;
+    width = 0;
+    height = 0;
+    depth = 0;
+    channels = 0;
+    row_stride = 0;
+    slice_stride = 0;
+}
+
+bool VolumeQuery::clip(Cuboid& cuboid) const {
+    const int x_end = std::min(cuboid.x + cuboid.width, width);
+    const int y_end = std::min(cuboid.y + cuboid.height, height);
+    const int z_end = std::min(cuboid.z + cuboid.depth, depth);
+    cuboid.x = std::max(cuboid.x, 0);
+    cuboid.y = std::max(cuboid.y, 0);
+    cuboid.z = std::max(cuboid.z, 0);
+    cuboid.width = x_end - cuboid.x;
+    cuboid.height = y_end - cuboid.y;
+    cuboid.depth = z_end - cuboid.z;
+    return cuboid.width > 0 && cuboid.height > 0 && cuboid.depth > 0;
+}
+
+double VolumeQuery::sum(const Cuboid& cuboid, int channel) const {
+    Cuboid clipped = cuboid;
+    if (!clip(clipped)) {
+        return 0;
+    }
+    //corners before cuboid are -1 when cuboid touches border of volume
+    const int xs[2] = {clipped.x - 1, clipped.x + clipped.width - 1};
+    const int ys[2] = {clipped.y - 1, clipped.y + clipped.height - 1};
+    const int zs[2] = {clipped.z - 1, clipped.z + clipped.depth - 1};
+    double result = 0;
+    for (int k = 0; k < 8; k++) {
+        const int x = xs[k & 1];
+        const int y = ys[(k >> 1) & 1];
+        const int z = zs[k >> 2];
+        if (x < 0 || y < 0 || z < 0) {
+            continue;
+        }
+        const double value = values[z * slice_stride + y * row_stride +
+            size_t(x) * channels + channel];
+        //corners with even count of near sides are added, others are 
+        //subtracted
+        const int near_count = (1 - (k & 1)) + (1 - ((k >> 1) & 1)) +
+            (1 - (k >> 2));
+        result += near_count % 2 == 0 ? value : -value;
+    }
+    return result;
+}
+
+double VolumeQuery::mean(const Cuboid& cuboid, int channel) const {
+    Cuboid clipped = cuboid;
+    if (!clip(clipped)) {
+        return 0;
+    }
+    return sum(clipped, channel) /
+        (double(clipped.width) * clipped.height * clipped.depth);
+}
@@ -0,0 +1,86 @@
+#ifndef VOLUME_QUERY_HH
+#define VOLUME_QUERY_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include <image_integrator/integral_buffer.hh>
+
+/// Box of voxels, like cv::Rect with third dimension
+struct Cuboid {
+    Cuboid() = default;
+    Cuboid(int x, int y, int z, int width, int height, int depth)
+    : x(x), y(y), z(z), width(width), height(height), depth(depth)
+    {}
+
+    int x = 0;
+    int y = 0;
+    int z = 0;
+    int width = 0;
+    int height = 0;
+    int depth = 0;
+};
+
+/// Sums of voxel values over cuboids of volume by its summed-volume table
+/**
+ *  Each sum takes eight lookups of table. Table is either in memory (result
+ *  of ImageIntegrator::integrate_volume()) or binary table file mapped
+ *  read-only. Cuboids are clipped to volume, sum of empty cuboid is 0.
+ */
+class VolumeQuery {
+public:
+    VolumeQuery() = default;
+    VolumeQuery(const VolumeQuery&) = delete;
+    VolumeQuery& operator= (const VolumeQuery&) = delete;
+    ~VolumeQuery() { release(); }
+
+    /**
+     *  Query table in memory, matrix isn't copied, it is only referenced
+     *  until release
+     *  \param[in] table 3D CV_64FC(channels) matrix of depth x height x width
+     */
+    bool try_attach(const cv::Mat& table);
+    /**
+     *  Query table in memory of caller, it mustn't be freed until release
+     *  \param[in] values Values laid out as described by header
+     *  \param[in] header Sizes of table
+     */
+    bool try_attach(const double* values, const VolumeFileHeader& header);
+    /// Map binary summed-volume table file
+    bool try_open(const std::string& path);
+    /// Forget table, unmap file
+    void release();
+
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+    int get_depth() const { return depth; }
+    int get_channels() const { return channels; }
+
+    /// Sum of channel values in cuboid, channel must be valid
+    double sum(const Cuboid& cuboid, int channel = 0) const;
+    /// Mean of channel values in cuboid, 0 for empty cuboid
+    double mean(const Cuboid& cuboid, int channel = 0) const;
+
+private:
+    /// clip cuboid to volume, false if nothing is left
+    bool clip(Cuboid& cuboid) const;
+
+    const double* values = nullptr;
+    int width = 0;
+    int height = 0;
+    int depth = 0;
+    int channels = 0;
+    /// distances between rows and slices in values
+    size_t row_stride = 0;
+    size_t slice_stride = 0;
+    /// keeps attached matrix alive
+    cv::Mat matrix;
+    /// start of file mapping, nullptr if values are in memory
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include <image_integrator/window_integrator.hh>
+#include <multithread_utils/log.hh>
+
+bool WindowIntegrator::try_push(const cv::Mat& frame) {
+    if (window_size <= 0) {
+        logger("ERROR: window of frames is empty");
+        return false;
+    }
+    const int type = CV_MAKETYPE(CV_64F, frame.channels());
+    if (frame_count == 0) {
+        sums = cv::Mat::zeros(frame.rows, frame.cols, type);
+        difference.create(frame.rows, frame.cols, type);
+        frames.resize(window_size);
+    } else if (frame.type() != frames[oldest].type() ||
+            frame.rows != sums.rows || frame.cols != sums.cols) {
+        logger("ERROR: frame doesn't match frames of window");
+        return false;
+    }
+
+    //leaving frame is the oldest one of full window
+    const bool is_full = frame_count == window_size;
+    ImageIntegrator::OutputSpec spec;
+    spec.destination = difference;
+    const cv::Mat leaving = is_full ? frames[oldest] : cv::Mat();
+    if (integrator.accumulate(frame, leaving, sums, spec).get().empty()) {
+        return false;
+    }
+
+    //buffer of leaving frame is reused for entering one
+    const int position = (oldest + frame_count) % window_size;
+    frame.copyTo(frames[position]);
+    if (is_full) {
+        oldest = (oldest + 1) % window_size;
+    } else {
+        frame_count++;
+    }
+    return true;
+}
+
+void WindowIntegrator::clear() {
+    frames.clear();
+    oldest = 0;
+    frame_count = 0;
+    sums.release();
+    difference.release();
+}
@@ -0,0 +1,60 @@
+#ifndef WINDOW_INTEGRATOR_HH
+#define WINDOW_INTEGRATOR_HH
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include <image_integrator/image_integrator.hh>
+
+/// Sum of integral images of last frames of stream
+/**
+ *  Integral image is linear, so when frame enters window and another one
+ *  leaves it, integral image of their difference is added to sums (see
+ *  ImageIntegrator::accumulate). Cost of frame doesn't depend on window
+ *  size, memory holds input of window frames, sums and one integral image.
+ */
+class WindowIntegrator {
+public:
+    /**
+     *  \param[in] integrator Integrator of frames, it must be initialized
+     *  \param[in] window_size Count of last frames which are summed
+     */
+    WindowIntegrator(ImageIntegrator& integrator, int window_size)
+    : integrator(integrator),
+    window_size(window_size)
+    {}
+    WindowIntegrator(const WindowIntegrator&) = delete;
+    WindowIntegrator& operator= (const WindowIntegrator&) = delete;
+
+    /**
+     *  Add frame to window and drop the oldest one if window is full. Frame
+     *  is copied. All frames must have the same size and type.
+     *  \param[in] frame 8U, 16U, 32F or 64F frame with any count of channels
+     */
+    bool try_push(const cv::Mat& frame);
+    /**
+     *  CV_64FC(channels) matrix whose value is sum of values of integral
+     *  images of frames in window, empty before first frame
+     */
+    const cv::Mat& get_sums() const { return sums; }
+    /// count of frames in window
+    int get_frame_count() const { return frame_count; }
+    int get_window_size() const { return window_size; }
+    /// forget all frames
+    void clear();
+
+private:
+    ImageIntegrator& integrator;
+    const int window_size;
+    /// input of frames in window, ring ordered by age
+    std::vector<cv::Mat> frames;
+    /// position of oldest frame in frames
+    int oldest = 0;
+    int frame_count = 0;
+    cv::Mat sums;
+    /// integral image of difference of entering and leaving frames
+    cv::Mat difference;
+};
+
+#endif
@@ -0,0 +1,651 @@
+#include <cerrno>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iterator>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unordered_map>
+#endif
+
+#include <io_utils/async_writer.hh>
+#include <multithread_utils/log.hh>
+
+/// Write whole buffer with blocking calls
+static bool write_all(int file, const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(file, data, size, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            logger(std::string("ERROR: write failed: ") + strerror(errno));
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+bool AsyncWriter::try_init(Backend backend, size_t max_inflight_bytes) {
+    stop();
+    this->max_inflight_bytes = max_inflight_bytes;
+    this->backend = Backend::thread;
+
+    if (backend == Backend::io_uring) {
+        if (try_init_ring()) {
+            this->backend = Backend::io_uring;
+            writer_thread = std::thread(&AsyncWriter::ring_loop, this);
+            return true;
+        }
+        logger("WARNING: io_uring isn't available, using writer thread");
+    }
+    writer_thread = std::thread(&AsyncWriter::thread_loop, this);
+    return true;
+}
+
+int AsyncWriter::open(const std::string& path, bool direct) {
+    //file may be hard link of another file, its content must stay intact
+    unlink(path.c_str());
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (direct) {
+        int file = ::open(path.c_str(), flags | O_DIRECT, 0644);
+        if (file >= 0) {
+            std::unique_ptr<DirectFile> state{new DirectFile};
+            if (posix_memalign(reinterpret_cast<void**>(&state->staging), 
+                        direct_alignment, direct_staging_size) != 0) {
+                logger("ERROR: can't allocate staging buffer");
+                ::close(file);
+                return -1;
+            }
+            std::unique_lock<std::mutex> lock{mtx};
+            direct_files[file] = std::move(state);
+            return file;
+        }
+        if (errno != EINVAL) {
+            logger("ERROR: can't create " + path);
+            return -1;
+        }
+        logger("WARNING: direct I/O isn't supported for " + path);
+    }
+    int file = ::open(path.c_str(), flags, 0644);
+    if (file < 0) {
+        logger("ERROR: can't create " + path);
+    }
+    return file;
+}
+
+AsyncWriter::DirectFile* AsyncWriter::find_direct(int file) {
+    std::unique_lock<std::mutex> lock{mtx};
+    auto it = direct_files.find(file);
+    return it == direct_files.end() ? nullptr : it->second.get();
+}
+
+void AsyncWriter::write_direct(DirectFile& direct, Request& request) {
+    const char* data = request.buffer.data();
+    size_t size = request.buffer.size();
+    if (request.offset != direct.flushed + direct.staged) {
+        //data would land at wrong offset, so file is failed instead
+        logger("ERROR: direct I/O file must be written sequentially");
+        mark_failed(request.file);
+        size = 0;
+    }
+    while (size > 0) {
+        const size_t part = std::min(size, direct_staging_size - direct.staged);
+        std::memcpy(direct.staging + direct.staged, data, part);
+        direct.staged += part;
+        data += part;
+        size -= part;
+        if (direct.staged == direct_staging_size) {
+            if (!write_all(request.file, direct.staging, direct.staged, 
+                        direct.flushed)) {
+                mark_failed(request.file);
+            }
+            direct.flushed += direct.staged;
+            direct.staged = 0;
+        }
+    }
+    const size_t bytes = request.buffer.size();
+    std::string().swap(request.buffer);
+    complete(bytes, 1);
+}
+
+bool AsyncWriter::close_direct(DirectFile& direct, int file) {
+    bool success = true;
+    if (direct.staged > 0) {
+        //O_DIRECT needs whole aligned blocks, padding is cut off below
+        const size_t padded = (direct.staged + direct_alignment - 1) / 
+            direct_alignment * direct_alignment;
+        std::memset(direct.staging + direct.staged, 0, padded - direct.staged);
+        success = write_all(file, direct.staging, padded, direct.flushed);
+        if (ftruncate(file, direct.flushed + direct.staged) != 0) {
+            logger(std::string("ERROR: can't truncate file: ") + 
+                    strerror(errno));
+            success = false;
+        }
+    }
+    //forget file before closing, so reused descriptor can't be confused
+    std::unique_ptr<DirectFile> state;
+    {
+        std::unique_lock<std::mutex> lock{mtx};
+        state = std::move(direct_files[file]);
+        direct_files.erase(file);
+    }
+    return success;
+}
+
+void AsyncWriter::mark_failed(int file) {
+    std::unique_lock<std::mutex> lock{mtx};
+    failed_files.insert(file);
+}
+
+void AsyncWriter::close_file(
+        int file, 
+        std::function<void(bool success)> on_closed
+) {
+    DirectFile* direct = find_direct(file);
+    bool success = direct == nullptr || close_direct(*direct, file);
+    {
+        //failure is forgotten before descriptor can be reused
+        std::unique_lock<std::mutex> lock{mtx};
+        success = failed_files.erase(file) == 0 && success;
+    }
+    success = ::close(file) == 0 && success;
+    if (on_closed) {
+        on_closed(success);
+    }
+}
+
+void AsyncWriter::write(int file, uint64_t offset, std::string buffer) {
+    if (!is_inited()) {
+        if (!write_all(file, buffer.data(), buffer.size(), offset)) {
+            mark_failed(file);
+        }
+        return;
+    }
+    std::unique_lock<std::mutex> lock{mtx};
+    //oversized buffer is allowed when nothing else is in flight
+    auto fits = [&] () {
+        return inflight_bytes == 0 || 
+            inflight_bytes + buffer.size() <= max_inflight_bytes;
+    };
+    if (!fits()) {
+        const auto start = Clock::now();
+        done_cv.wait(lock, fits);
+        stall_time += Clock::now() - start;
+    }
+    inflight_bytes += buffer.size();
+    add_request();
+    requests.push_back(Request{
+        Request::Type::write, 
+        file, 
+        offset, 
+        std::move(buffer),
+        nullptr
+    });
+    request_cv.notify_one();
+}
+
+void AsyncWriter::close(
+        int file, 
+        std::function<void(bool success)> on_closed
+) {
+    if (!is_inited()) {
+        close_file(file, std::move(on_closed));
+        return;
+    }
+    std::unique_lock<std::mutex> lock{mtx};
+    add_request();
+    requests.push_back(Request{Request::Type::close, file, 0, std::string(), 
+            std::move(on_closed)});
+    request_cv.notify_one();
+}
+
+void AsyncWriter::wait() {
+    std::unique_lock<std::mutex> lock{mtx};
+    done_cv.wait(lock, [&] () { return inflight_requests == 0; });
+}
+
+void AsyncWriter::stop() {
+    if (writer_thread.joinable()) {
+        {
+            std::unique_lock<std::mutex> lock{mtx};
+            stopped = true;
+            request_cv.notify_all();
+        }
+        writer_thread.join();
+        stopped = false;
+    }
+    destroy_ring();
+}
+
+void AsyncWriter::complete(size_t bytes, size_t request_count) {
+    std::unique_lock<std::mutex> lock{mtx};
+    inflight_bytes -= bytes;
+    inflight_requests -= request_count;
+    if (inflight_requests == 0) {
+        busy_time += Clock::now() - busy_start;
+    }
+    done_cv.notify_all();
+}
+
+void AsyncWriter::add_request() {
+    if (inflight_requests++ == 0) {
+        busy_start = Clock::now();
+    }
+}
+
+double AsyncWriter::get_busy_time() {
+    std::unique_lock<std::mutex> lock{mtx};
+    Clock::duration time = busy_time;
+    if (inflight_requests > 0) {
+        time += Clock::now() - busy_start;
+    }
+    return std::chrono::duration<double>(time).count();
+}
+
+double AsyncWriter::get_stall_time() {
+    std::unique_lock<std::mutex> lock{mtx};
+    return std::chrono::duration<double>(stall_time).count();
+}
+
+void AsyncWriter::thread_loop() {
+    std::vector<Request> batch;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock{mtx};
+            request_cv.wait(lock, [&] () { 
+                return !requests.empty() || stopped.load(); 
+            });
+            if (requests.empty()) {
+                return;
+            }
+            batch.assign(
+                    std::make_move_iterator(requests.begin()), 
+                    std::make_move_iterator(requests.end())
+            );
+            requests.clear();
+        }
+
+        size_t i = 0;
+        while (i < batch.size()) {
+            DirectFile* direct = find_direct(batch[i].file);
+            if (batch[i].type == Request::Type::close) {
+                //callback and its captures are freed before wait() returns
+                close_file(batch[i].file, std::move(batch[i].on_closed));
+                complete(0, 1);
+                i++;
+                continue;
+            }
+            if (direct != nullptr) {
+                write_direct(*direct, batch[i]);
+                i++;
+                continue;
+            }
+            //merge writes of adjacent buffers of the same file
+            size_t j = i + 1;
+            uint64_t end_offset = batch[i].offset + batch[i].buffer.size();
+            while (j < batch.size() && j - i < IOV_MAX &&
+                    batch[j].type == Request::Type::write &&
+                    batch[j].file == batch[i].file &&
+                    batch[j].offset == end_offset) {
+                end_offset += batch[j].buffer.size();
+                j++;
+            }
+            write_batch(batch, i, j);
+            i = j;
+        }
+        batch.clear();
+    }
+}
+
+void AsyncWriter::write_batch(
+        std::vector<Request>& batch, 
+        size_t begin, 
+        size_t end
+) {
+    std::vector<iovec> iov;
+    iov.reserve(end - begin);
+    size_t bytes = 0;
+    for (size_t i = begin; i < end; i++) {
+        iov.push_back(iovec{&batch[i].buffer[0], batch[i].buffer.size()});
+        bytes += batch[i].buffer.size();
+    }
+
+    const int file = batch[begin].file;
+    uint64_t offset = batch[begin].offset;
+    size_t first = 0;
+    //batch of empty buffers has nothing to write, pwritev would return 0
+    size_t remaining = bytes;
+    while (remaining > 0) {
+        ssize_t written = pwritev(file, &iov[first], iov.size() - first, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            logger(std::string("ERROR: write failed: ") + strerror(errno));
+            mark_failed(file);
+            break;
+        }
+        offset += written;
+        remaining -= written;
+        while (first < iov.size() && size_t(written) >= iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iov.size()) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + 
+                written;
+            iov[first].iov_len -= written;
+        }
+    }
+
+    for (size_t i = begin; i < end; i++) {
+        std::string().swap(batch[i].buffer);
+    }
+    complete(bytes, end - begin);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/// Minimal io_uring wrapper on raw system calls
+struct AsyncWriter::Ring {
+    /// Per file bookkeeping, close is delayed until all writes complete
+    struct FileState {
+        int pending = 0;
+        bool close_requested = false;
+        std::function<void(bool success)> on_closed;
+    };
+
+    static const unsigned entry_count = 64;
+
+    ~Ring() {
+        if (sqes != nullptr) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ptr != nullptr && cq_ptr != sq_ptr) {
+            munmap(cq_ptr, cq_size);
+        }
+        if (sq_ptr != nullptr) {
+            munmap(sq_ptr, sq_size);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete) {
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, 
+                min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    }
+
+    int fd = -1;
+    void* sq_ptr = nullptr;
+    size_t sq_size = 0;
+    void* cq_ptr = nullptr;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    /// requests submitted to kernel, index is passed as user_data
+    std::vector<Request> slots;
+    /// written bytes of each submitted request
+    std::vector<size_t> written;
+    std::vector<size_t> free_slots;
+    std::unordered_map<int, FileState> files;
+    /// tail including entries which aren't published to kernel yet
+    unsigned sq_local_tail = 0;
+    /// entries published but not consumed by io_uring_enter
+    unsigned to_submit = 0;
+};
+
+void AsyncWriter::destroy_ring() {
+    delete ring;
+    ring = nullptr;
+}
+
+bool AsyncWriter::try_init_ring() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, Ring::entry_count, &params);
+    if (fd < 0) {
+        return false;
+    }
+
+    ring = new Ring;
+    ring->fd = fd;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + 
+        params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = ring->cq_size = std::max(ring->sq_size, ring->cq_size);
+    }
+
+    ring->sq_ptr = mmap(nullptr, ring->sq_size, PROT_READ | PROT_WRITE, 
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = nullptr;
+        delete ring;
+        ring = nullptr;
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(nullptr, ring->cq_size, PROT_READ | PROT_WRITE, 
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = nullptr;
+            delete ring;
+            ring = nullptr;
+            return false;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, 
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        delete ring;
+        ring = nullptr;
+        return false;
+    }
+    ring->sqes = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(ring->sq_ptr);
+    char* cq = static_cast<char*>(ring->cq_ptr);
+    ring->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->slots.resize(params.sq_entries);
+    ring->written.resize(params.sq_entries, 0);
+    for (size_t i = 0; i < params.sq_entries; i++) {
+        ring->free_slots.push_back(params.sq_entries - 1 - i);
+    }
+    return true;
+}
+
+void AsyncWriter::ring_loop() {
+    Ring& r = *ring;
+    std::vector<Request> taken;
+
+    auto close_ring_file = [&] (
+            int file, 
+            std::function<void(bool success)> on_closed
+    ) {
+        r.files.erase(file);
+        close_file(file, std::move(on_closed));
+        complete(0, 1);
+    };
+
+    auto queue_write = [&] (size_t slot) {
+        const Request& request = r.slots[slot];
+        const size_t done = r.written[slot];
+        const unsigned index = r.sq_local_tail & *r.sq_mask;
+        io_uring_sqe& sqe = r.sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = request.file;
+        sqe.off = request.offset + done;
+        sqe.addr = reinterpret_cast<uint64_t>(request.buffer.data() + done);
+        sqe.len = request.buffer.size() - done;
+        sqe.user_data = slot;
+        r.sq_array[index] = index;
+        r.sq_local_tail++;
+        r.to_submit++;
+    };
+
+    auto finish_slot = [&] (size_t slot) {
+        Request& request = r.slots[slot];
+        const size_t bytes = request.buffer.size();
+        const int file = request.file;
+        std::string().swap(request.buffer);
+        r.free_slots.push_back(slot);
+        complete(bytes, 1);
+
+        Ring::FileState& state = r.files[file];
+        state.pending--;
+        if (state.pending == 0 && state.close_requested) {
+            close_ring_file(file, std::move(state.on_closed));
+        }
+    };
+
+    while (true) {
+        const size_t in_kernel = r.slots.size() - r.free_slots.size();
+        {
+            std::unique_lock<std::mutex> lock{mtx};
+            if (in_kernel == 0) {
+                request_cv.wait(lock, [&] () { 
+                    return !requests.empty() || stopped.load(); 
+                });
+                if (requests.empty()) {
+                    return;
+                }
+            }
+            size_t free_slots = r.free_slots.size();
+            while (!requests.empty() && 
+                    (requests.front().type == Request::Type::close || 
+                     free_slots > 0)) {
+                if (requests.front().type == Request::Type::write) {
+                    free_slots--;
+                }
+                taken.push_back(std::move(requests.front()));
+                requests.pop_front();
+            }
+        }
+
+        for (Request& request : taken) {
+            Ring::FileState& state = r.files[request.file];
+            if (request.type == Request::Type::close) {
+                if (state.pending == 0) {
+                    close_ring_file(request.file, 
+                            std::move(request.on_closed));
+                } else {
+                    state.close_requested = true;
+                    state.on_closed = std::move(request.on_closed);
+                }
+                continue;
+            }
+            //direct I/O goes through staging buffer synchronously
+            DirectFile* direct = find_direct(request.file);
+            if (direct != nullptr) {
+                write_direct(*direct, request);
+                continue;
+            }
+            state.pending++;
+            const size_t slot = r.free_slots.back();
+            r.free_slots.pop_back();
+            r.slots[slot] = std::move(request);
+            r.written[slot] = 0;
+            queue_write(slot);
+        }
+
+        //wait for completion only when there is nothing new to submit
+        const bool has_inflight = r.free_slots.size() < r.slots.size();
+        const unsigned min_complete = taken.empty() && has_inflight ? 1 : 0;
+        taken.clear();
+        __atomic_store_n(r.sq_tail, r.sq_local_tail, __ATOMIC_RELEASE);
+        if (r.to_submit > 0 || min_complete > 0) {
+            int submitted = r.enter(r.to_submit, min_complete);
+            if (submitted < 0 && errno != EINTR) {
+                logger(std::string("ERROR: io_uring_enter failed: ") + 
+                        strerror(errno));
+            } 
+            if (submitted > 0) {
+                r.to_submit -= submitted;
+            }
+        }
+
+        unsigned head = *r.cq_head;
+        while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe& cqe = r.cqes[head & *r.cq_mask];
+            const size_t slot = cqe.user_data;
+            const int res = cqe.res;
+            head++;
+
+            Request& request = r.slots[slot];
+            if (res == -EINTR || res == -EAGAIN) {
+                queue_write(slot);
+                continue;
+            }
+            if (res < 0) {
+                //kernel without IORING_OP_WRITE, finish request synchronously
+                if (res != -EINVAL) {
+                    logger(std::string("ERROR: write failed: ") + 
+                            strerror(-res));
+                }
+                const size_t done = r.written[slot];
+                if (!write_all(request.file, request.buffer.data() + done, 
+                            request.buffer.size() - done, 
+                            request.offset + done)) {
+                    mark_failed(request.file);
+                }
+                finish_slot(slot);
+                continue;
+            }
+            r.written[slot] += res;
+            if (res > 0 && r.written[slot] < request.buffer.size()) {
+                queue_write(slot);
+            } else {
+                finish_slot(slot);
+            }
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#else
+
+struct AsyncWriter::Ring {};
+
+void AsyncWriter::destroy_ring() {}
+
+bool AsyncWriter::try_init_ring() {
+    return false;
+}
+
+void AsyncWriter::ring_loop() {}
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef ASYNC_WRITER_HH
+#define ASYNC_WRITER_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/// Writes buffers to files without blocking the caller
+/**
+ *  All requests are executed by one dedicated writer thread. Writes are sent 
+ *  to the kernel either through io_uring (Linux only) or as pwritev calls 
+ *  that merge adjacent buffers. Amount of queued and not yet completed bytes 
+ *  is limited, write() blocks while the limit is exceeded.
+ */
+class AsyncWriter {
+public:
+    enum class Backend {
+        /// writer thread with blocking pwritev
+        thread,
+        /// writer thread submitting requests to io_uring
+        io_uring
+    };
+
+    AsyncWriter() = default;
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator= (const AsyncWriter&) = delete;
+    ~AsyncWriter() { stop(); }
+
+    /**
+     *  Start writer thread. If io_uring isn't available thread backend is 
+     *  used instead.
+     *  \param[in] backend Preferred backend
+     *  \param[in] max_inflight_bytes Limit of queued and unfinished bytes
+     */
+    bool try_init(Backend backend, size_t max_inflight_bytes);
+    /**
+     *  Open new file, returns -1 on error. Existing file is unlinked first, 
+     *  so its other hard links keep their content.
+     *  \param[in] path Path to file
+     *  \param[in] direct Bypass page cache with O_DIRECT. Such file must be 
+     *  written sequentially from offset 0. Data goes through 4 KiB aligned 
+     *  staging buffer, unaligned tail is padded and cut off on close. If file 
+     *  system doesn't support direct I/O file is opened as usual one.
+     */
+    int open(const std::string& path, bool direct = false);
+    /**
+     *  Queue buffer for writing at the given offset. Buffer is freed as soon 
+     *  as it is written. Failed write marks file failed, see close().
+     */
+    void write(int file, uint64_t offset, std::string buffer);
+    /**
+     *  Close file after all previously queued writes to it
+     *  \param[in] on_closed Called by writer thread when file is closed, 
+     *  success is false if any write or close of file failed
+     */
+    void close(
+            int file, 
+            std::function<void(bool success)> on_closed = nullptr
+    );
+    /**
+     *  Mark file failed, so its close() reports failure. Used by producer 
+     *  which can't finish content of file.
+     */
+    void mark_failed(int file);
+    /// Wait for all queued requests to finish
+    void wait();
+    /// Finish all requests and stop writer thread
+    void stop();
+
+    /// Time when at least one request was queued or executing, seconds
+    double get_busy_time();
+    /// Time callers of write() waited for the byte limit, seconds
+    double get_stall_time();
+
+    Backend get_backend() const { return backend; }
+    bool is_inited() const { return writer_thread.joinable(); }
+
+private:
+    struct Request {
+        enum class Type { write, close };
+        Type type;
+        int file;
+        uint64_t offset;
+        std::string buffer;
+        std::function<void(bool success)> on_closed;
+    };
+
+    /// Staging state of file opened with O_DIRECT
+    struct DirectFile {
+        DirectFile() = default;
+        DirectFile(const DirectFile&) = delete;
+        DirectFile& operator= (const DirectFile&) = delete;
+        ~DirectFile() { free(staging); }
+
+        char* staging = nullptr;
+        /// bytes in staging buffer
+        size_t staged = 0;
+        /// bytes already written to file, always aligned
+        uint64_t flushed = 0;
+    };
+
+    static const size_t direct_alignment = 4096;
+    static const size_t direct_staging_size = size_t(1) << 20;
+
+    DirectFile* find_direct(int file);
+    void write_direct(DirectFile& direct, Request& request);
+    /// flush staging of file before closing, false if it fails
+    bool close_direct(DirectFile& direct, int file);
+    /// close file and call on_closed with its success, forget its failure
+    void close_file(int file, std::function<void(bool success)> on_closed);
+    void thread_loop();
+    void write_batch(std::vector<Request>& batch, size_t begin, size_t end);
+    void complete(size_t bytes, size_t request_count);
+    /// count new request in flight, must be called under mtx
+    void add_request();
+
+    /// io_uring state, defined only when kernel headers are available
+    struct Ring;
+    bool try_init_ring();
+    void ring_loop();
+    void destroy_ring();
+    Ring* ring = nullptr;
+
+    Backend backend = Backend::thread;
+    size_t max_inflight_bytes = 0;
+    size_t inflight_bytes = 0;
+    /// count of requests which are queued or executing
+    size_t inflight_requests = 0;
+    using Clock = std::chrono::steady_clock;
+    /// start of current period with requests in flight
+    Clock::time_point busy_start;
+    Clock::duration busy_time{0};
+    Clock::duration stall_time{0};
+    std::deque<Request> requests;
+    /// files opened with O_DIRECT, staging is used only by writer thread
+    std::unordered_map<int, std::unique_ptr<DirectFile>> direct_files;
+    /// open files whose writes failed
+    std::unordered_set<int> failed_files;
+    std::mutex mtx;
+    std::condition_variable request_cv;
+    std::condition_variable done_cv;
+    std::atomic<bool> stopped{false};
+    std::thread writer_thread;
+};
+
+#endif
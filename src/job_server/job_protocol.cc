@@ -0,0 +1,262 @@
+#include <cstring>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <job_server/job_protocol.hh>
+
+namespace {
+
+/// Message bigger than this is treated as garbage
+const uint32_t max_message_size = uint32_t(1) << 31;
+
+void put_uint(std::string& out, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        out.push_back(char(value >> (8 * i)));
+    }
+}
+
+void put_double(std::string& out, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    put_uint(out, bits, 8);
+}
+
+void put_string(std::string& out, const std::string& value) {
+    put_uint(out, value.size(), 4);
+    out += value;
+}
+
+/// Sequential reader of payload which remembers if it ran out of data
+class Reader {
+public:
+    explicit Reader(const std::string& payload) 
+    : payload(payload) 
+    {}
+
+    uint64_t get_uint(int size) {
+        if (pos + size > payload.size()) {
+            failed = true;
+            return 0;
+        }
+        uint64_t value = 0;
+        for (int i = size - 1; i >= 0; i--) {
+            value = value << 8 | uint8_t(payload[pos + i]);
+        }
+        pos += size;
+        return value;
+    }
+
+    double get_double() {
+        const uint64_t bits = get_uint(8);
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    /// count of following values of given size, 0 if they don't fit
+    size_t get_count(int value_size) {
+        const size_t count = get_uint(4);
+        if (failed || count > (payload.size() - pos) / value_size) {
+            failed = true;
+            return 0;
+        }
+        return count;
+    }
+
+    std::string get_string() {
+        const size_t size = get_size();
+        pos += size;
+        return payload.substr(pos - size, size);
+    }
+
+    std::vector<uint8_t> get_bytes() {
+        const size_t size = get_size();
+        pos += size;
+        return std::vector<uint8_t>(
+                payload.begin() + (pos - size), 
+                payload.begin() + pos
+        );
+    }
+
+    /// all data is read and nothing is missing
+    bool is_complete() const { return !failed && pos == payload.size(); }
+
+private:
+    /// size of next string, 0 if it doesn't fit into payload
+    size_t get_size() {
+        const size_t size = get_uint(4);
+        if (failed || pos + size > payload.size()) {
+            failed = true;
+            return 0;
+        }
+        return size;
+    }
+
+    const std::string& payload;
+    size_t pos = 0;
+    bool failed = false;
+};
+
+bool read_all(int fd, char* data, size_t size) {
+    while (size > 0) {
+        const ssize_t readed = read(fd, data, size);
+        if (readed < 0 && errno == EINTR) {
+            continue;
+        }
+        if (readed <= 0) {
+            return false;
+        }
+        data += readed;
+        size -= readed;
+    }
+    return true;
+}
+
+}
+
+std::string encode_request(const JobRequest& request) {
+    std::string out;
+    put_uint(out, request.id, 8);
+    put_uint(out, uint8_t(request.source), 1);
+    put_uint(out, uint8_t(request.output), 1);
+    put_string(out, request.path);
+    put_uint(out, request.blob.size(), 4);
+    out.append(request.blob.begin(), request.blob.end());
+    return out;
+}
+
+bool try_decode_request(const std::string& payload, JobRequest& request) {
+    Reader reader{payload};
+    request.id = reader.get_uint(8);
+    const uint64_t source = reader.get_uint(1);
+    const uint64_t output = reader.get_uint(1);
+    request.path = reader.get_string();
+    request.blob = reader.get_bytes();
+    if (source != uint8_t(JobRequest::Source::path) && 
+            source != uint8_t(JobRequest::Source::blob)) {
+        return false;
+    }
+    if (output != uint8_t(JobRequest::Output::files) && 
+            output != uint8_t(JobRequest::Output::reply)) {
+        return false;
+    }
+    request.source = JobRequest::Source(source);
+    request.output = JobRequest::Output(output);
+    return reader.is_complete();
+}
+
+std::string encode_reply(const JobReply& reply) {
+    std::string out;
+    put_uint(out, reply.id, 8);
+    put_uint(out, reply.success ? 1 : 0, 1);
+    put_double(out, reply.total_ms);
+    put_string(out, reply.result);
+    return out;
+}
+
+bool try_decode_reply(const std::string& payload, JobReply& reply) {
+    Reader reader{payload};
+    reply.id = reader.get_uint(8);
+    reply.success = reader.get_uint(1) != 0;
+    reply.total_ms = reader.get_double();
+    reply.result = reader.get_string();
+    return reader.is_complete();
+}
+
+std::string encode_query(const QueryRequest& request) {
+    std::string out;
+    put_uint(out, request.id, 8);
+    put_uint(out, uint8_t(request.kind), 1);
+    put_string(out, request.path);
+    put_uint(out, request.channel, 4);
+    put_uint(out, request.rects.size(), 4);
+    for (int32_t value : request.rects) {
+        put_uint(out, uint32_t(value), 4);
+    }
+    return out;
+}
+
+bool try_decode_query(const std::string& payload, QueryRequest& request) {
+    Reader reader{payload};
+    request.id = reader.get_uint(8);
+    const uint64_t kind = reader.get_uint(1);
+    request.path = reader.get_string();
+    request.channel = reader.get_uint(4);
+    const size_t rect_values = reader.get_count(4);
+    request.rects.resize(rect_values);
+    for (int32_t& value : request.rects) {
+        value = int32_t(uint32_t(reader.get_uint(4)));
+    }
+    if (kind < uint8_t(QueryRequest::Kind::sums) || 
+            kind > uint8_t(QueryRequest::Kind::stats) || 
+            rect_values % 4 != 0) {
+        return false;
+    }
+    request.kind = QueryRequest::Kind(kind);
+    return reader.is_complete();
+}
+
+std::string encode_query_reply(const QueryReply& reply) {
+    std::string out;
+    out.reserve(8 + 1 + 4 + reply.sums.size() * 8 + 4 + reply.text.size());
+    put_uint(out, reply.id, 8);
+    put_uint(out, reply.success ? 1 : 0, 1);
+    put_uint(out, reply.sums.size(), 4);
+    for (double sum : reply.sums) {
+        put_double(out, sum);
+    }
+    put_string(out, reply.text);
+    return out;
+}
+
+bool try_decode_query_reply(const std::string& payload, QueryReply& reply) {
+    Reader reader{payload};
+    reply.id = reader.get_uint(8);
+    reply.success = reader.get_uint(1) != 0;
+    reply.sums.resize(reader.get_count(8));
+    for (double& sum : reply.sums) {
+        sum = reader.get_double();
+    }
+    reply.text = reader.get_string();
+    return reader.is_complete();
+}
+
+bool read_message(int fd, std::string& payload) {
+    char size_bytes[4];
+    if (!read_all(fd, size_bytes, sizeof(size_bytes))) {
+        return false;
+    }
+    uint32_t size = 0;
+    for (int i = 3; i >= 0; i--) {
+        size = size << 8 | uint8_t(size_bytes[i]);
+    }
+    if (size > max_message_size) {
+        return false;
+    }
+    payload.resize(size);
+    return read_all(fd, &payload[0], size);
+}
+
+bool write_message(int fd, const std::string& payload) {
+    std::string message;
+    message.reserve(4 + payload.size());
+    put_uint(message, payload.size(), 4);
+    message += payload;
+    const char* data = message.data();
+    size_t size = message.size();
+    while (size > 0) {
+        //peer may be gone, it mustn't kill server with SIGPIPE
+        const ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
@@ -0,0 +1,99 @@
+#ifndef JOB_PROTOCOL_HH
+#define JOB_PROTOCOL_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ *  Messages of job and query sockets. Each message is 4-byte little-endian 
+ *  size of payload followed by payload. Integers in payload are 
+ *  little-endian, doubles are stored as integers with the same bits, 
+ *  strings and arrays are prefixed by 4-byte size.
+ */
+
+/// Job sent by client
+struct JobRequest {
+    /// Where image comes from
+    enum class Source : uint8_t {
+        /// path to image file readable by server
+        path = 1,
+        /// encoded image in blob
+        blob = 2
+    };
+    /// Where integral image goes to
+    enum class Output : uint8_t {
+        /// files next to image, or named by path for blob
+        files = 0,
+        /// text integral image in reply
+        reply = 1
+    };
+
+    /// chosen by client, it is returned in reply
+    uint64_t id = 0;
+    Source source = Source::path;
+    Output output = Output::files;
+    /// path to image, or base of output files for blob
+    std::string path;
+    /// encoded image for Source::blob
+    std::vector<uint8_t> blob;
+};
+
+/// Result of job sent by server
+struct JobReply {
+    uint64_t id = 0;
+    bool success = false;
+    /// time from receiving request to finishing job
+    double total_ms = 0;
+    /// text integral image for Output::reply
+    std::string result;
+};
+
+/// Request to query server
+struct QueryRequest {
+    enum class Kind : uint8_t {
+        /// sums of rectangles of integral image of path
+        sums = 1,
+        /// keep integral image of path in cache
+        pin = 2,
+        /// allow eviction of integral image of path
+        unpin = 3,
+        /// statistics of server as text
+        stats = 4
+    };
+
+    /// chosen by client, it is returned in reply
+    uint64_t id = 0;
+    Kind kind = Kind::sums;
+    /// path to image whose integral image is queried
+    std::string path;
+    uint32_t channel = 0;
+    /// rectangles as x, y, width, height quadruples
+    std::vector<int32_t> rects;
+};
+
+/// Reply of query server
+struct QueryReply {
+    uint64_t id = 0;
+    bool success = false;
+    /// sum of each rectangle for Kind::sums
+    std::vector<double> sums;
+    /// "name value" lines for Kind::stats
+    std::string text;
+};
+
+std::string encode_request(const JobRequest& request);
+bool try_decode_request(const std::string& payload, JobRequest& request);
+std::string encode_reply(const JobReply& reply);
+bool try_decode_reply(const std::string& payload, JobReply& reply);
+std::string encode_query(const QueryRequest& request);
+bool try_decode_query(const std::string& payload, QueryRequest& request);
+std::string encode_query_reply(const QueryReply& reply);
+bool try_decode_query_reply(const std::string& payload, QueryReply& reply);
+
+/// Read one message, returns false on end of stream or error
+bool read_message(int fd, std::string& payload);
+/// Write one message, returns false if peer is gone
+bool write_message(int fd, const std::string& payload);
+
+#endif
@@ -0,0 +1,59 @@
+#include <chrono>
+
+#include <job_server/job_server.hh>
+#include <multithread_utils/log.hh>
+
+typedef std::chrono::steady_clock Clock;
+
+void JobServer::stop() {
+    SocketServer::stop();
+    //callbacks of jobs keep connections alive
+    integrator.wait();
+}
+
+bool JobServer::on_message(
+        const std::shared_ptr<Connection>& connection, 
+        std::string payload
+) {
+    JobRequest request;
+    if (!try_decode_request(payload, request)) {
+        logger("ERROR: damaged job request");
+        return false;
+    }
+    submit(connection, std::move(request));
+    return true;
+}
+
+void JobServer::submit(
+        const std::shared_ptr<Connection>& connection, 
+        JobRequest request
+) {
+    const Clock::time_point start = Clock::now();
+    const uint64_t id = request.id;
+    std::shared_ptr<std::string> result;
+
+    ImageIntegrator::OutputSink sink;
+    sink.path = request.path;
+    if (request.output == JobRequest::Output::reply) {
+        result = std::make_shared<std::string>();
+        sink.write = [result] (std::string chunk) { result->append(chunk); };
+    }
+    sink.close = [this, connection, start, id, result] (bool success) {
+        JobReply reply;
+        reply.id = id;
+        reply.success = success;
+        reply.total_ms = std::chrono::duration<double, std::milli>(
+                Clock::now() - start).count();
+        if (success && result) {
+            reply.result = std::move(*result);
+        }
+        connection->send(encode_reply(reply));
+        job_count++;
+    };
+
+    if (request.source == JobRequest::Source::blob) {
+        integrator.process_encoded(std::move(request.blob), std::move(sink));
+    } else {
+        integrator.process(request.path, std::move(sink));
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef JOB_SERVER_HH
+#define JOB_SERVER_HH
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <image_integrator/image_integrator.hh>
+#include <job_server/job_protocol.hh>
+#include <job_server/socket_server.hh>
+
+/// Accepts jobs over Unix domain socket and runs them on one integrator
+/**
+ *  Jobs of one connection are processed in parallel and replies are sent 
+ *  in order of completion. See job_protocol.hh for format of messages.
+ */
+class JobServer : public SocketServer {
+public:
+    explicit JobServer(ImageIntegrator& integrator)
+    : integrator(integrator)
+    {}
+    ~JobServer() { stop(); }
+
+    /// Stop accepting, close connections and wait for their jobs
+    void stop();
+    /// count of finished jobs
+    size_t get_job_count() const { return job_count; }
+
+protected:
+    bool on_message(
+            const std::shared_ptr<Connection>& connection, 
+            std::string payload
+    ) override;
+
+private:
+    /// pass job to integrator, reply is sent when it is done
+    void submit(
+            const std::shared_ptr<Connection>& connection, 
+            JobRequest request
+    );
+
+    ImageIntegrator& integrator;
+    std::atomic<size_t> job_count{0};
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include <chrono>
+#include <sstream>
+#include <vector>
+
+#include <job_server/query_server.hh>
+#include <multithread_utils/log.hh>
+
+typedef std::chrono::steady_clock Clock;
+
+std::string QueryServer::get_stats() const {
+    const IntegralCache::Stats stats = cache.get_stats();
+    std::ostringstream out;
+    out << "hits " << stats.hits << '\n'
+        << "misses " << stats.misses << '\n'
+        << "evictions " << stats.evictions << '\n'
+        << "cached_images " << stats.entries << '\n'
+        << "pinned_images " << stats.pinned << '\n'
+        << "cached_mib " << (stats.bytes >> 20) << '\n'
+        << "requests " << latencies.get_count() << '\n'
+        << "failed_requests " << failed_count << '\n'
+        << "p50_ms " << latencies.get_percentile(0.5) << '\n'
+        << "p90_ms " << latencies.get_percentile(0.9) << '\n'
+        << "p99_ms " << latencies.get_percentile(0.99) << '\n'
+        << "p999_ms " << latencies.get_percentile(0.999) << '\n';
+    return out.str();
+}
+
+bool QueryServer::on_message(
+        const std::shared_ptr<Connection>& connection, 
+        std::string payload
+) {
+    const Clock::time_point start = Clock::now();
+    QueryRequest request;
+    if (!try_decode_query(payload, request)) {
+        logger("ERROR: damaged query request");
+        return false;
+    }
+    QueryReply reply;
+    reply.id = request.id;
+    reply.success = answer(request, reply);
+    connection->send(encode_query_reply(reply));
+    if (request.kind == QueryRequest::Kind::sums) {
+        latencies.add(std::chrono::duration<double, std::milli>(
+                    Clock::now() - start).count());
+        if (!reply.success) {
+            failed_count++;
+        }
+    }
+    return true;
+}
+
+bool QueryServer::answer(const QueryRequest& request, QueryReply& reply) {
+    switch (request.kind) {
+    case QueryRequest::Kind::sums: {
+        std::shared_ptr<const IntegralQuery> query = cache.get(request.path);
+        if (!query || int64_t(request.channel) >= query->get_channels()) {
+            return false;
+        }
+        const size_t count = request.rects.size() / 4;
+        std::vector<cv::Rect> rects(count);
+        for (size_t i = 0; i < count; i++) {
+            const int32_t* rect = &request.rects[4 * i];
+            rects[i] = cv::Rect(rect[0], rect[1], rect[2], rect[3]);
+        }
+        reply.sums.resize(count);
+        query->sum_many(rects.data(), count, reply.sums.data(), 
+                request.channel);
+        return true;
+    }
+    case QueryRequest::Kind::pin:
+        return cache.try_pin(request.path);
+    case QueryRequest::Kind::unpin:
+        cache.unpin(request.path);
+        return true;
+    case QueryRequest::Kind::stats:
+        reply.text = get_stats();
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,49 @@
+#ifndef QUERY_SERVER_HH
+#define QUERY_SERVER_HH
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <image_integrator/integral_cache.hh>
+#include <job_server/job_protocol.hh>
+#include <job_server/socket_server.hh>
+#include <multithread_utils/latency_histogram.hh>
+
+/// Answers rectangle sum queries over Unix domain socket
+/**
+ *  Integral images are shared by all clients through cache. Requests of one 
+ *  connection are answered in order by its thread, so request whose image 
+ *  is loading delays only requests of its connection. See job_protocol.hh 
+ *  for format of messages.
+ */
+class QueryServer : public SocketServer {
+public:
+    explicit QueryServer(IntegralCache& cache)
+    : cache(cache)
+    {}
+    ~QueryServer() { stop(); }
+
+    /**
+     *  Statistics as "name value" lines: cache counters, count of answered 
+     *  requests and percentiles of their latency in milliseconds
+     */
+    std::string get_stats() const;
+
+protected:
+    bool on_message(
+            const std::shared_ptr<Connection>& connection, 
+            std::string payload
+    ) override;
+
+private:
+    /// answer request, returns false if it failed
+    bool answer(const QueryRequest& request, QueryReply& reply);
+
+    IntegralCache& cache;
+    /// latency of sums requests from receiving to sending reply
+    LatencyHistogram latencies;
+    std::atomic<uint64_t> failed_count{0};
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include <cstring>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <job_server/job_protocol.hh>
+#include <job_server/socket_server.hh>
+#include <multithread_utils/log.hh>
+
+SocketServer::Connection::~Connection() {
+    close(fd);
+}
+
+void SocketServer::Connection::send(const std::string& payload) {
+    std::unique_lock<std::mutex> lock{write_mtx};
+    write_message(fd, payload);
+}
+
+bool SocketServer::try_start(const std::string& socket_path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        logger("ERROR: socket path is too long: " + socket_path);
+        return false;
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        logger("ERROR: can't create socket");
+        return false;
+    }
+    unlink(socket_path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&address), 
+                sizeof(address)) != 0 || listen(listen_fd, 64) != 0) {
+        logger("ERROR: can't listen on " + socket_path);
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    this->socket_path = socket_path;
+    stopped = false;
+    accept_thread = std::thread(&SocketServer::accept_loop, this);
+    return true;
+}
+
+void SocketServer::stop() {
+    if (listen_fd < 0) {
+        return;
+    }
+    stopped = true;
+    //wakes up accept
+    shutdown(listen_fd, SHUT_RDWR);
+    accept_thread.join();
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path.c_str());
+
+    {
+        std::unique_lock<std::mutex> lock{readers_mtx};
+        for (auto& reader : readers) {
+            //wakes up read, replies can't be sent anymore
+            if (reader->connection) {
+                shutdown(reader->connection->fd, SHUT_RDWR);
+            }
+        }
+    }
+    for (auto& reader : readers) {
+        reader->thread.join();
+    }
+    readers.clear();
+}
+
+void SocketServer::accept_loop() {
+    while (!stopped) {
+        const int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        reap_readers();
+        std::unique_ptr<Reader> reader{new Reader};
+        reader->connection = std::make_shared<Connection>(fd);
+        Reader* reader_ptr = reader.get();
+        std::unique_lock<std::mutex> lock{readers_mtx};
+        readers.push_back(std::move(reader));
+        reader_ptr->thread = std::thread(&SocketServer::read_loop, this, reader_ptr);
+    }
+}
+
+void SocketServer::reap_readers() {
+    std::unique_lock<std::mutex> lock{readers_mtx};
+    for (auto it = readers.begin(); it != readers.end();) {
+        if ((*it)->finished) {
+            (*it)->thread.join();
+            it = readers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void SocketServer::read_loop(Reader* reader) {
+    std::string payload;
+    while (read_message(reader->connection->fd, payload)) {
+        if (!on_message(reader->connection, std::move(payload))) {
+            break;
+        }
+    }
+    //connection is closed when nothing refers to it anymore
+    std::unique_lock<std::mutex> lock{readers_mtx};
+    reader->connection.reset();
+    reader->finished = true;
+}
@@ -0,0 +1,80 @@
+#ifndef SOCKET_SERVER_HH
+#define SOCKET_SERVER_HH
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/// Base of servers which receive messages over Unix domain socket
+/**
+ *  Every connection has its own reading thread which passes each message 
+ *  to on_message(). See job_protocol.hh for format of messages. Derived 
+ *  class must call stop() in its destructor.
+ */
+class SocketServer {
+public:
+    SocketServer() = default;
+    SocketServer(const SocketServer&) = delete;
+    SocketServer& operator= (const SocketServer&) = delete;
+    virtual ~SocketServer() { stop(); }
+
+    /**
+     *  Listen on socket and start accepting connections. Existing socket 
+     *  file is replaced.
+     *  \param[in] socket_path Path of socket file
+     */
+    bool try_start(const std::string& socket_path);
+    /// Stop accepting, close connections and join their threads
+    void stop();
+
+protected:
+    /// Socket of client, it lives while it is referenced by its messages
+    struct Connection {
+        Connection(int fd) 
+        : fd(fd) 
+        {}
+        Connection(const Connection&) = delete;
+        Connection& operator= (const Connection&) = delete;
+        ~Connection();
+
+        /// send message, messages of different threads don't interleave
+        void send(const std::string& payload);
+
+        int fd;
+        std::mutex write_mtx;
+    };
+
+    /**
+     *  Handle message in thread of connection
+     *  \return false if message is damaged and connection must be closed
+     */
+    virtual bool on_message(
+            const std::shared_ptr<Connection>& connection, 
+            std::string payload
+    ) = 0;
+
+private:
+    /// Thread reading messages of one connection
+    struct Reader {
+        std::shared_ptr<Connection> connection;
+        std::thread thread;
+        std::atomic<bool> finished{false};
+    };
+
+    void accept_loop();
+    void read_loop(Reader* reader);
+    /// join threads of closed connections
+    void reap_readers();
+
+    std::string socket_path;
+    int listen_fd = -1;
+    std::thread accept_thread;
+    std::list<std::unique_ptr<Reader>> readers;
+    std::mutex readers_mtx;
+    std::atomic<bool> stopped{false};
+};
+
+#endif
@@ -1,8 +1,211 @@
 #include <cxxopts.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
 
 #include <image_integrator/image_integrator.hh>
+#include <image_integrator/sequence_integrator.hh>
+#include <job_server/job_server.hh>
+#include <job_server/query_server.hh>
+#include <multithread_utils/log.hh>
+
+/// Parse size like 512M or 8G, plain number is count of bytes
+static size_t parse_size(const std::string& str) {
+    size_t pos = 0;
+    const double value = std::stod(str, &pos);
+    size_t unit = 1;
+    if (pos < str.size()) {
+        switch (std::toupper(str[pos])) {
+        case 'K': unit = size_t(1) << 10; break;
+        case 'M': unit = size_t(1) << 20; break;
+        case 'G': unit = size_t(1) << 30; break;
+        case 'T': unit = size_t(1) << 40; break;
+        }
+    }
+    return size_t(value * unit);
+}
+
+/// Check if file name has extension of image format supported by OpenCV
+static bool is_image_name(const std::string& name) {
+    static const char* const extensions[] = {
+        "bmp", "dib", "jpg", "jpeg", "jpe", "jp2", "png", "webp", "pbm", 
+        "pgm", "ppm", "pnm", "pxm", "sr", "ras", "tif", "tiff", "exr", "hdr"
+    };
+    const size_t dot = name.rfind('.');
+    if (dot == std::string::npos) {
+        return false;
+    }
+    std::string extension = name.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), 
+            [] (char c) { return std::tolower(c); });
+    for (const char* known : extensions) {
+        if (extension == known) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Append sorted paths of images from directory, subdirectories are skipped
+static bool list_directory(
+        const std::string& path, 
+        std::vector<std::string>& images
+) {
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        std::cout << "can't open directory: " << path << std::endl;
+        return false;
+    }
+    std::vector<std::string> found;
+    while (dirent* entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name.empty() || name[0] == '.' || !is_image_name(name)) {
+            continue;
+        }
+        const std::string file_path = path + "/" + name;
+        struct stat st;
+        if (stat(file_path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            found.push_back(file_path);
+        }
+    }
+    closedir(dir);
+    std::sort(found.begin(), found.end());
+    images.insert(images.end(), found.begin(), found.end());
+    return true;
+}
+
+/// Frame bigger than this is treated as garbage
+static const uint64_t max_frame_size = uint64_t(1) << 31;
+
+/// Read length-prefixed blob, length is 8-byte little-endian
+static bool read_frame(std::FILE* in, std::vector<uint8_t>& data) {
+    uint8_t length_bytes[8];
+    if (std::fread(length_bytes, 1, sizeof(length_bytes), in) != 
+            sizeof(length_bytes)) {
+        return false;
+    }
+    uint64_t length = 0;
+    for (int i = 7; i >= 0; i--) {
+        length = length << 8 | length_bytes[i];
+    }
+    if (length > max_frame_size) {
+        logger("ERROR: frame of " + std::to_string(length) + 
+                " bytes on stdin is too big, input is damaged");
+        return false;
+    }
+    data.resize(length);
+    if (std::fread(data.data(), 1, length, in) != length) {
+        logger("ERROR: frame on stdin is truncated");
+        return false;
+    }
+    return true;
+}
+
+/// Write results of jobs as length-prefixed frames in order of jobs
+class OrderedOutput {
+public:
+    explicit OrderedOutput(std::FILE* out) 
+    : out(out) 
+    {}
+
+    /// Result of failed job is empty frame
+    void complete(size_t job, std::string result) {
+        std::unique_lock<std::mutex> lock{mtx};
+        ready[job] = std::move(result);
+        for (auto it = ready.begin(); it != ready.end() && it->first == next; 
+                it = ready.erase(it), next++) {
+            uint8_t length_bytes[8];
+            uint64_t length = it->second.size();
+            for (int i = 0; i < 8; i++) {
+                length_bytes[i] = uint8_t(length >> (8 * i));
+            }
+            std::fwrite(length_bytes, 1, sizeof(length_bytes), out);
+            std::fwrite(it->second.data(), 1, it->second.size(), out);
+        }
+        std::fflush(out);
+    }
+
+private:
+    std::FILE* out;
+    std::mutex mtx;
+    std::map<size_t, std::string> ready;
+    size_t next = 0;
+};
+
+/// Stack slices of image sequence into 3D matrix of depth x height x width
+static bool try_read_volume(const std::string& path, cv::Mat& volume) {
+    cv::VideoCapture capture;
+    if (!capture.open(path) || !capture.isOpened()) {
+        logger("ERROR: can't open slices " + path);
+        return false;
+    }
+    std::vector<cv::Mat> slices;
+    cv::Mat slice;
+    while (capture.read(slice) && !slice.empty()) {
+        if (!slices.empty() && (slice.rows != slices[0].rows || 
+                    slice.cols != slices[0].cols || 
+                    slice.type() != slices[0].type())) {
+            logger("ERROR: slices of volume differ in size or type");
+            return false;
+        }
+        slices.push_back(slice.clone());
+    }
+    if (slices.empty()) {
+        logger("ERROR: volume has no slices");
+        return false;
+    }
+    const int sizes[] = {int(slices.size()), slices[0].rows, slices[0].cols};
+    volume.create(3, sizes, slices[0].type());
+    const size_t row_size = slices[0].cols * slices[0].elemSize();
+    for (size_t z = 0; z < slices.size(); z++) {
+        for (int y = 0; y < slices[z].rows; y++) {
+            std::memcpy(volume.data + z * volume.step[0] + y * volume.step[1], 
+                    slices[z].ptr(y), row_size);
+        }
+    }
+    return true;
+}
+
+/**
+ *  Integrate length-prefixed encoded images from stdin. Results are written 
+ *  to stdout the same way or to files prefix*N*.integral if prefix is set.
+ */
+static void process_stdin(ImageIntegrator& ii, const std::string& prefix) {
+    OrderedOutput output{stdout};
+    std::vector<uint8_t> data;
+    for (size_t job = 0; read_frame(stdin, data); job++) {
+        ImageIntegrator::OutputSink sink;
+        sink.path = prefix.empty() ? "stdin" + std::to_string(job) : 
+            prefix + std::to_string(job);
+        if (prefix.empty()) {
+            std::shared_ptr<std::string> result = 
+                std::make_shared<std::string>();
+            sink.write = [result] (std::string chunk) { 
+                result->append(chunk); 
+            };
+            sink.close = [&output, result, job] (bool success) {
+                output.complete(job, success ? std::move(*result) : "");
+            };
+        }
+        ii.process_encoded(std::move(data), std::move(sink));
+        data = std::vector<uint8_t>();
+    }
+    //callbacks refer to output
+    ii.wait();
+}
 
 int main(int argc, char** argv) 
 {
@@ -11,6 +214,79 @@ int main(int argc, char** argv)
     options.add_options()
         ("t,threads", "thread count", cxxopts::value<int>()->default_value("0"))
         ("i,image", "input image", cxxopts::value<std::vector<std::string>>())
+        ("m,mmap", "write binary integral image through memory mapped file")
+        ("io-uring", "write output files through io_uring if available")
+        ("direct-io", "write text output files bypassing page cache")
+        ("split-channels", "write each channel to its own file")
+        ("unchanged", "integrate images with their own depth (8U, 16U, 32F, "
+            "64F) and channels instead of converting them to 8-bit BGR")
+        ("pool-memory", "memory kept for reuse between images, MiB", 
+            cxxopts::value<int>()->default_value("0"))
+        ("pages", "pages for integral images: normal, thp or hugetlb", 
+            cxxopts::value<std::string>()->default_value("normal"))
+        ("early-release", "free memory of block rows as soon as possible")
+        ("max-memory", "limit of memory of images in flight, e.g. 8G", 
+            cxxopts::value<std::string>()->default_value("0"))
+        ("stats", "print statistics after processing")
+        ("strip-rows", "process images by strips of given height, 0 is off", 
+            cxxopts::value<int>()->default_value("0"))
+        ("write-budget", "max size of output in flight, MiB", 
+            cxxopts::value<int>()->default_value("256"))
+        ("manifest", "file with one image path per line", 
+            cxxopts::value<std::string>())
+        ("dir", "process all images in directory", 
+            cxxopts::value<std::string>())
+        ("decode-threads", "threads decoding ahead of integration, 0 is off", 
+            cxxopts::value<int>()->default_value("0"))
+        ("max-decoded", "limit of decoded images waiting for integration", 
+            cxxopts::value<int>()->default_value("2"))
+        ("batch-pixels", "batch images up to given count of pixels, 0 is off", 
+            cxxopts::value<int>()->default_value("0"))
+        ("batch-size", "count of images in one batch", 
+            cxxopts::value<int>()->default_value("64"))
+        ("container", "write batched images to one container file", 
+            cxxopts::value<std::string>())
+        ("result-cache", "skip images whose identical file was processed, "
+            "results are kept in given directory", cxxopts::value<std::string>())
+        ("result-cache-mb", "limit of results in result cache, MiB", 
+            cxxopts::value<int>()->default_value("1024"))
+        ("stdin", "read length-prefixed encoded images from stdin and write "
+            "length-prefixed results to stdout")
+        ("output-prefix", "write results of stdin images to files instead", 
+            cxxopts::value<std::string>())
+        ("serve", "accept jobs on Unix socket until SIGINT or SIGTERM", 
+            cxxopts::value<std::string>())
+        ("query-serve", "answer rectangle sum queries on Unix socket until "
+            "SIGINT or SIGTERM", cxxopts::value<std::string>())
+        ("cache-mb", "limit of integral images cached by query server, MiB", 
+            cxxopts::value<int>()->default_value("4096"))
+        ("pin", "image whose integral image query server keeps in cache", 
+            cxxopts::value<std::vector<std::string>>())
+        ("sequence", "integrate frames of video file or image sequence like "
+            "img_%04d.png and print latency of frames", 
+            cxxopts::value<std::string>())
+        ("ring", "count of frame buffers of sequence", 
+            cxxopts::value<int>()->default_value("3"))
+        ("fps", "arrival rate of frames of sequence, frames are dropped if "
+            "they can't be taken, 0 takes them as fast as they are decoded", 
+            cxxopts::value<double>()->default_value("0"))
+        ("latency-ms", "latency target of frames of sequence, 0 is none", 
+            cxxopts::value<double>()->default_value("0"))
+        ("frames", "limit of frames of sequence, 0 is none", 
+            cxxopts::value<int>()->default_value("0"))
+        ("volume", "integrate volume whose slices are image sequence like "
+            "slice_%04d.png into summed-volume table", 
+            cxxopts::value<std::string>())
+        ("volume-output", "binary summed-volume table file of volume", 
+            cxxopts::value<std::string>())
+        ("block-depth", "count of slices in block of volume", 
+            cxxopts::value<int>()->default_value("16"))
+        ("engine", "engine: wavefront, serial or auto", 
+            cxxopts::value<std::string>()->default_value("wavefront"))
+        ("block", "block size of wavefront engine, N or WxH", 
+            cxxopts::value<std::string>()->default_value("64"))
+        ("calibration", "calibration file of auto engine, created if absent", 
+            cxxopts::value<std::string>())
     ;
 
     auto parse_result = options.parse(argc, argv);
@@ -23,15 +299,269 @@ int main(int argc, char** argv)
     
     int thread_count = parse_result["threads"].as<int>();
 
+    //signals are received by sigwait, so all threads must block them
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (parse_result.count("serve") || parse_result.count("query-serve")) {
+        pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    }
+
+    //stdout is used for results
+    const bool is_stdin = parse_result.count("stdin") > 0;
+    if (is_stdin && !parse_result.count("output-prefix")) {
+        logger.set_output(std::cerr);
+    }
+
     ImageIntegrator ii;
     if (!ii.try_init(thread_count)) {
         return 0;
     }
 
+    const auto writer_backend = parse_result.count("io-uring") ? 
+        AsyncWriter::Backend::io_uring : AsyncWriter::Backend::thread;
+    const size_t write_budget = 
+        size_t(parse_result["write-budget"].as<int>()) << 20;
+    if (!ii.try_init_writer(writer_backend, write_budget)) {
+        return 0;
+    }
+
+    if (!ii.try_init_decoder(parse_result["decode-threads"].as<int>(), 
+                parse_result["max-decoded"].as<int>())) {
+        return 0;
+    }
+
+    if (parse_result.count("direct-io")) {
+        ii.set_direct_output(true);
+    }
+
+    if (parse_result.count("split-channels")) {
+        ii.set_split_channels(true);
+    }
+
+    if (parse_result.count("unchanged")) {
+        ii.set_unchanged_input(true);
+    }
+
+    ii.set_strip_height(parse_result["strip-rows"].as<int>());
+    ii.set_pool_limit(size_t(parse_result["pool-memory"].as<int>()) << 20);
+
+    ii.set_max_memory(parse_size(parse_result["max-memory"].as<std::string>()));
+
+    if (parse_result.count("early-release")) {
+        ii.set_early_release(true);
+    }
+
+    const std::string pages = parse_result["pages"].as<std::string>();
+    if (pages == "thp") {
+        ii.set_page_mode(PageMode::transparent_huge);
+    } else if (pages == "hugetlb") {
+        ii.set_page_mode(PageMode::explicit_huge);
+    } else if (pages != "normal") {
+        std::cout << "unknown pages: " << pages << std::endl;
+        return 0;
+    }
+
+    if (parse_result.count("mmap")) {
+        ii.set_output_format(ImageIntegrator::OutputFormat::mapped);
+    }
+
+    const std::string block = parse_result["block"].as<std::string>();
+    const size_t separator = block.find('x');
+    const int block_width = std::stoi(block);
+    const int block_height = separator == std::string::npos ? 
+        block_width : std::stoi(block.substr(separator + 1));
+    if (block_width <= 0 || block_height <= 0) {
+        std::cout << "incorrect block: " << block << std::endl;
+        return 0;
+    }
+    ii.set_block_shape(block_width, block_height);
+
+    const std::string engine = parse_result["engine"].as<std::string>();
+    if (engine == "auto") {
+        ii.set_engine(Engine::automatic);
+        std::string calibration;
+        if (parse_result.count("calibration")) {
+            calibration = parse_result["calibration"].as<std::string>();
+        } else if (getenv("HOME") != nullptr) {
+            calibration = std::string(getenv("HOME")) + 
+                "/.cache/integrate_image.calibration";
+        }
+        if (!calibration.empty()) {
+            ii.try_calibrate(calibration);
+        }
+    } else if (engine == "serial") {
+        ii.set_engine(Engine::serial);
+    } else if (engine != "wavefront") {
+        std::cout << "unknown engine: " << engine << std::endl;
+        return 0;
+    }
+
+    ii.set_batching(parse_result["batch-pixels"].as<int>(), 
+            parse_result["batch-size"].as<int>());
+    if (parse_result.count("container") && 
+            !ii.try_open_container(parse_result["container"].as<std::string>())) {
+        return 0;
+    }
+    if (parse_result.count("result-cache") && !ii.try_open_result_cache(
+                parse_result["result-cache"].as<std::string>(), 
+                size_t(parse_result["result-cache-mb"].as<int>()) << 20)) {
+        return 0;
+    }
+
     if (parse_result.count("image")) {
         auto& vec = parse_result["image"].as<std::vector<std::string>>();
         std::for_each(vec.begin(), vec.end(), 
                 [&] (std::string value) { ii.process(value); });
     }
+
+    if (parse_result.count("dir")) {
+        std::vector<std::string> images;
+        if (list_directory(parse_result["dir"].as<std::string>(), images)) {
+            for (const std::string& image : images) {
+                ii.process(image);
+            }
+        }
+    }
+
+    if (parse_result.count("manifest")) {
+        const std::string manifest = parse_result["manifest"].as<std::string>();
+        std::ifstream file(manifest);
+        if (!file) {
+            std::cout << "can't open manifest: " << manifest << std::endl;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty() && line[0] != '#') {
+                ii.process(line);
+            }
+        }
+    }
+
+    if (parse_result.count("serve")) {
+        JobServer server{ii};
+        if (!server.try_start(parse_result["serve"].as<std::string>())) {
+            return 0;
+        }
+        int signal = 0;
+        sigwait(&stop_signals, &signal);
+        server.stop();
+        std::cout << "jobs served: " << server.get_job_count() << std::endl;
+    }
+
+    if (parse_result.count("query-serve")) {
+        IntegralCache cache{ii, 
+            size_t(parse_result["cache-mb"].as<int>()) << 20};
+        if (parse_result.count("pin")) {
+            for (const std::string& path : 
+                    parse_result["pin"].as<std::vector<std::string>>()) {
+                cache.try_pin(path);
+            }
+        }
+        QueryServer server{cache};
+        if (!server.try_start(parse_result["query-serve"].as<std::string>())) {
+            return 0;
+        }
+        int signal = 0;
+        sigwait(&stop_signals, &signal);
+        server.stop();
+        std::cout << server.get_stats();
+    }
+
+    if (parse_result.count("sequence")) {
+        SequenceIntegrator sequence{ii};
+        sequence.set_ring_size(parse_result["ring"].as<int>());
+        sequence.set_frame_rate(parse_result["fps"].as<double>());
+        sequence.set_latency_target(parse_result["latency-ms"].as<double>());
+        if (!sequence.try_open(parse_result["sequence"].as<std::string>()) || 
+                !sequence.run(nullptr, parse_result["frames"].as<int>())) {
+            return 0;
+        }
+        const SequenceIntegrator::Stats stats = sequence.get_stats();
+        std::cout << "frames: " << stats.frames << std::endl
+            << "integrated frames: " << stats.integrated << std::endl
+            << "dropped frames: " << stats.dropped << std::endl
+            << "late frames: " << stats.late << std::endl
+            << "frames per second: " << (stats.wall_time > 0 ? 
+                    stats.integrated / stats.wall_time : 0) << std::endl
+            << "latency p50, ms: " << stats.p50_ms << std::endl
+            << "latency p90, ms: " << stats.p90_ms << std::endl
+            << "latency p99, ms: " << stats.p99_ms << std::endl
+            << "latency p99.9, ms: " << stats.p999_ms << std::endl;
+    }
+
+    if (parse_result.count("volume")) {
+        const std::string volume_path = 
+            parse_result["volume"].as<std::string>();
+        const std::string output_path = parse_result.count("volume-output") ? 
+            parse_result["volume-output"].as<std::string>() : 
+            volume_path + ".volume.bin";
+        cv::Mat volume;
+        if (!try_read_volume(volume_path, volume)) {
+            return 0;
+        }
+        ii.set_block_depth(parse_result["block-depth"].as<int>());
+        if (!ii.process_volume(volume, output_path).get()) {
+            return 0;
+        }
+    }
+
+    if (is_stdin) {
+        process_stdin(ii, parse_result.count("output-prefix") ? 
+                parse_result["output-prefix"].as<std::string>() : "");
+    }
+
+    if (parse_result.count("stats")) {
+        ii.wait();
+        std::ostream& info = is_stdin && !parse_result.count("output-prefix") ? 
+            std::cerr : std::cout;
+        const MemoryBudget::Stats stats = ii.get_admission_stats();
+        info << "started jobs: " << stats.started_jobs << std::endl
+            << "queued jobs: " << stats.queued_jobs << std::endl
+            << "total queue wait, ms: " << stats.total_wait_ms << std::endl
+            << "max queue wait, ms: " << stats.max_wait_ms << std::endl
+            << "peak estimated memory, MiB: " << (stats.peak_bytes >> 20) 
+            << std::endl;
+
+        const ImageIntegrator::PipelineStats pipeline = 
+            ii.get_pipeline_stats();
+        //utilisation is busy time divided by time available to stage
+        auto print_stage = [&] (const char* name, double busy, int threads) {
+            const double available = pipeline.wall_time * std::max(threads, 1);
+            info << name << " busy, s: " << busy << " (" 
+                << (available > 0 ? 100 * busy / available : 0) << "% of " 
+                << threads << " threads)" << std::endl;
+        };
+        info << "wall time, s: " << pipeline.wall_time << std::endl;
+        if (pipeline.decode_threads > 0) {
+            print_stage("decode", pipeline.decode_busy_time, 
+                    pipeline.decode_threads);
+        }
+        print_stage("integrate", pipeline.integrate_busy_time, 
+                pipeline.integrate_threads);
+        print_stage("write", pipeline.write_busy_time, 1);
+        info << "write stall, s: " << pipeline.write_stall_time 
+            << std::endl;
+        info << "failed streamed images: " << pipeline.failed_streams 
+            << std::endl;
+
+        if (parse_result.count("result-cache")) {
+            const ResultCache::Stats cache = ii.get_result_cache_stats();
+            const uint64_t lookups = cache.hits + cache.misses;
+            info << "result cache hits: " << cache.hits << std::endl
+                << "result cache misses: " << cache.misses << std::endl
+                << "result cache hit rate, %: " 
+                << (lookups > 0 ? 100.0 * cache.hits / lookups : 0) 
+                << std::endl
+                << "result cache stores: " << cache.stores << std::endl
+                << "result cache evictions: " << cache.evictions << std::endl
+                << "result cache size, MiB: " << (cache.bytes >> 20) 
+                << std::endl;
+        }
+    }
     return 0;
 }
@@ -0,0 +1,53 @@
+#include <algorithm>
+#include <cmath>
+
+#include <multithread_utils/latency_histogram.hh>
+
+void LatencyHistogram::add(double ms) {
+    const double us = ms * 1e3;
+    int bucket = 0;
+    if (us > 1) {
+        bucket = int(std::ceil(std::log2(us) * buckets_per_octave));
+    }
+    if (bucket >= bucket_count) {
+        bucket = bucket_count - 1;
+    }
+    counts[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::get_percentile(double share) const {
+    uint64_t total = 0;
+    uint64_t snapshot[bucket_count];
+    for (int i = 0; i < bucket_count; i++) {
+        snapshot[i] = counts[i].load(std::memory_order_relaxed);
+        total += snapshot[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    //latency of rank is upper bound of its bucket
+    const uint64_t rank = std::max<uint64_t>(1, std::ceil(share * total));
+    uint64_t seen = 0;
+    int bucket = 0;
+    for (; bucket < bucket_count - 1; bucket++) {
+        seen += snapshot[bucket];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return std::exp2(double(bucket) / buckets_per_octave) * 1e-3;
+}
+
+uint64_t LatencyHistogram::get_count() const {
+    uint64_t total = 0;
+    for (int i = 0; i < bucket_count; i++) {
+        total += counts[i].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void LatencyHistogram::reset() {
+    for (int i = 0; i < bucket_count; i++) {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+}
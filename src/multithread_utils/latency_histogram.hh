@@ -0,0 +1,40 @@
+#ifndef LATENCY_HISTOGRAM_HH
+#define LATENCY_HISTOGRAM_HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/// Histogram of latencies for percentiles, it may be filled concurrently
+/**
+ *  Buckets grow geometrically by 2^(1/4) from 1 microsecond, so percentile 
+ *  is known with relative error below 20%. Latencies above about 18 
+ *  minutes fall into last bucket.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram() { reset(); }
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator= (const LatencyHistogram&) = delete;
+
+    /// Count one latency in milliseconds
+    void add(double ms);
+    /**
+     *  Latency in milliseconds which isn't exceeded by given share of 
+     *  counted latencies, 0 if nothing is counted
+     *  \param[in] share Share of latencies from 0 to 1, e.g. 0.99
+     */
+    double get_percentile(double share) const;
+    /// count of counted latencies
+    uint64_t get_count() const;
+    /// forget all latencies
+    void reset();
+
+private:
+    static const int buckets_per_octave = 4;
+    static const int bucket_count = 30 * buckets_per_octave;
+
+    std::atomic<uint64_t> counts[bucket_count];
+};
+
+#endif
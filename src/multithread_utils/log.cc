@@ -6,7 +6,12 @@ Log logger;
 
 void Log::operator() (std::string msg) {
     std::unique_lock<std::mutex> lock{_mtx};
-    std::cout << msg << std::endl;
+    *_out << msg << std::endl;
+}
+
+void Log::set_output(std::ostream& out) {
+    std::unique_lock<std::mutex> lock{_mtx};
+    _out = &out;
 }
 
 void Log::operator() (std::stringstream msg) {
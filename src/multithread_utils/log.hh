@@ -1,6 +1,7 @@
 #ifndef LOG_HH
 #define LOG_HH
 
+#include <iostream>
 #include <string>
 #include <sstream>
 #include <mutex>
@@ -11,8 +12,11 @@ public:
     void operator() (std::string msg);
     void operator() (std::stringstream msg);
     void operator() (const char* msg);
+    /// Set stream for messages, default is std::cout
+    void set_output(std::ostream& out);
 private:
     std::mutex _mtx;
+    std::ostream* _out = &std::cout;
 };
 
 extern Log logger;
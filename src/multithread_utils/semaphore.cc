@@ -0,0 +1,13 @@
+#include <multithread_utils/semaphore.hh>
+
+void Semaphore::acquire() {
+    std::unique_lock<std::mutex> lock{mtx};
+    cv.wait(lock, [&] () { return count > 0; });
+    count--;
+}
+
+void Semaphore::release() {
+    std::unique_lock<std::mutex> lock{mtx};
+    count++;
+    cv.notify_one();
+}
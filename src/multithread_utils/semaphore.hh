@@ -0,0 +1,27 @@
+#ifndef SEMAPHORE_HH
+#define SEMAPHORE_HH
+
+#include <condition_variable>
+#include <mutex>
+
+///Simple counting semaphore
+class Semaphore {
+public:
+    explicit Semaphore(int count = 0) 
+    : count(count) 
+    {}
+    Semaphore(const Semaphore&) = delete;
+    Semaphore& operator= (const Semaphore&) = delete;
+
+    /// Wait until counter is positive and decrement it
+    void acquire();
+    /// Increment counter
+    void release();
+
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    int count;
+};
+
+#endif
@@ -33,6 +33,7 @@ void ThreadPool::stop() {
     }
 
     pool.clear();
+    stopped = false;
 }
 
 void ThreadPool::task_loop() {
@@ -43,7 +44,10 @@ void ThreadPool::task_loop() {
 		    Task* task = tasks.front();
 		    tasks.pop();
             lock.unlock();
+            auto start = std::chrono::steady_clock::now();
             task->execute();
+            busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
             delete task;
             num_task_executing--;
             lock.lock();
@@ -7,6 +7,7 @@
 #include <condition_variable>
 #include <queue>
 #include <chrono>
+#include <cstdint>
 
 ///brief Simple thread pool implementation
 /**
@@ -56,6 +57,12 @@ public:
 
     /// Wait for all running tasks to finish 
     void wait() const;
+    /// Check if there are no queued or running tasks
+    bool is_idle() const { return num_task_executing == 0; }
+    /// Count of threads in pool
+    int get_thread_count() const { return pool.size(); }
+    /// Total time spent by all threads in execute, seconds
+    double get_busy_time() const { return busy_ns * 1e-9; }
     /// Finish all tasks and clear pool
     void stop();
 
@@ -69,6 +76,7 @@ private:
 	std::atomic<bool> stopped{false};
     std::atomic<int> num_thread_alive{0};
     std::atomic<int> num_task_executing{0};
+    std::atomic<int64_t> busy_ns{0};
 
 };
 
@@ -1,8 +1,29 @@
+#include <chrono>
+#include <climits>
+#include <cstring>
 #include <fstream>
+#include <random>
+#include <thread>
 
 #include <gtest/gtest.h>
 
+#include <image_integrator/image_header.hh>
 #include <image_integrator/image_integrator.hh>
+#include <image_integrator/integral_cache.hh>
+#include <image_integrator/integral_container.hh>
+#include <image_integrator/integral_query.hh>
+#include <image_integrator/sequence_integrator.hh>
+#include <image_integrator/volume_query.hh>
+#include <image_integrator/window_integrator.hh>
+#include <job_server/job_server.hh>
+#include <job_server/query_server.hh>
+#include <multithread_utils/latency_histogram.hh>
+#include <multithread_utils/log.hh>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 TEST(ImageIntegrator, wrong_thread_count) {
     ImageIntegrator ii;
@@ -21,14 +42,18 @@ TEST(ImageIntegrator, uninited_process) {
 
 static const int channel_count = 3;
 
-void check_integral_image(std::string path, int mat_size) {
+void check_integral_image(
+        std::string path, 
+        int mat_size, 
+        int channels = channel_count
+) {
     //integral image of eye matrix 4x4
     //1 1 1 1
     //1 2 2 2
     //1 2 3 3
     //1 2 3 4
     std::ifstream fin{path};
-    for (int c = 0; c < channel_count; c++) {
+    for (int c = 0; c < channels; c++) {
         for (int i = 0; i < mat_size; i++) {
             for (int j = 0; j < mat_size; j++) {
                 double readed;
@@ -54,3 +79,1614 @@ TEST(ImageIntegrator, check_integral_image) {
     }
 }
 
+
+TEST(ImageIntegrator, check_io_uring_writer) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    //small budget makes writes wait for completions
+    EXPECT_TRUE(ii.try_init_writer(AsyncWriter::Backend::io_uring, 64));
+    std::string filename = "testfile.tif";
+    std::string filetype = ".integral";
+    for (int mat_size = 3; mat_size < 16; mat_size+=3 ) {
+        cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+        cv::imwrite(filename, M);
+        ii.set_block_size(4);
+        ii.process(filename);
+        ii.wait();
+        check_integral_image(filename + filetype, mat_size);
+    }
+}
+
+TEST(ImageIntegrator, check_block_multiple_sizes) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    //writes of thread backend are merged into pwritev batches
+    EXPECT_TRUE(ii.try_init_writer(AsyncWriter::Backend::thread, 1 << 20));
+    ii.set_block_size(4);
+    std::string filename = "testfile.tif";
+    std::string filetype = ".integral";
+    //sides are exact multiples of block size
+    for (int mat_size = 4; mat_size <= 64; mat_size *= 2) {
+        cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+        cv::imwrite(filename, M);
+        //last block row is empty, its empty string must not fail writing
+        int close_count = 0;
+        bool closed_success = false;
+        ImageIntegrator::OutputSink sink;
+        sink.close = [&] (bool success) {
+            close_count++;
+            closed_success = success;
+        };
+        ii.process(filename, sink);
+        ii.wait();
+        EXPECT_EQ(1, close_count);
+        EXPECT_TRUE(closed_success);
+        check_integral_image(filename + filetype, mat_size);
+        //nothing is missing at end of file
+        std::ifstream fin{filename + filetype};
+        std::string text((std::istreambuf_iterator<char>(fin)), 
+                std::istreambuf_iterator<char>());
+        ASSERT_GE(text.size(), 2u);
+        EXPECT_EQ("\n\n", text.substr(text.size() - 2));
+        //each channel is rows and empty line
+        EXPECT_EQ((mat_size + 1) * channel_count, 
+                int(std::count(text.begin(), text.end(), '\n')));
+    }
+}
+
+TEST(AsyncWriter, empty_buffers) {
+    const std::string filename = "testfile.tif.written";
+    for (AsyncWriter::Backend backend : {AsyncWriter::Backend::thread, 
+            AsyncWriter::Backend::io_uring}) {
+        AsyncWriter writer;
+        EXPECT_TRUE(writer.try_init(backend, 1 << 20));
+        //only empty buffers are queued before close, nothing is written
+        int file = writer.open(filename);
+        ASSERT_GE(file, 0);
+        writer.write(file, 0, "");
+        writer.write(file, 0, "");
+        bool closed_success = false;
+        writer.close(file, [&] (bool success) { closed_success = success; });
+        writer.wait();
+        EXPECT_TRUE(closed_success);
+        //empty buffers between data don't stop writing
+        file = writer.open(filename);
+        ASSERT_GE(file, 0);
+        writer.write(file, 0, "ab");
+        writer.write(file, 2, "");
+        writer.write(file, 2, "cd");
+        writer.write(file, 4, "");
+        closed_success = false;
+        writer.close(file, [&] (bool success) { closed_success = success; });
+        writer.wait();
+        EXPECT_TRUE(closed_success);
+        std::ifstream fin{filename};
+        std::string text((std::istreambuf_iterator<char>(fin)), 
+                std::istreambuf_iterator<char>());
+        EXPECT_EQ("abcd", text);
+    }
+}
+
+TEST(AsyncWriter, direct_write_out_of_order) {
+    const std::string filename = "testfile.tif.written";
+    AsyncWriter writer;
+    EXPECT_TRUE(writer.try_init(AsyncWriter::Backend::thread, 1 << 20));
+    const int file = writer.open(filename, true);
+    ASSERT_GE(file, 0);
+    //file system may not support direct I/O, then any order is fine
+    const bool is_direct = (fcntl(file, F_GETFL) & O_DIRECT) != 0;
+    writer.write(file, 0, "ab");
+    writer.write(file, 4, "cd");
+    bool closed_success = true;
+    writer.close(file, [&] (bool success) { closed_success = success; });
+    writer.wait();
+    EXPECT_EQ(!is_direct, closed_success);
+    if (is_direct) {
+        //misplaced data isn't written
+        std::ifstream fin{filename};
+        std::string text((std::istreambuf_iterator<char>(fin)), 
+                std::istreambuf_iterator<char>());
+        EXPECT_EQ("ab", text);
+    }
+}
+
+TEST(ImageIntegrator, check_direct_output) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_direct_output(true);
+    std::string filename = "testfile.tif";
+    std::string filetype = ".integral";
+    //sizes give files both shorter and longer than one aligned block
+    for (int mat_size = 3; mat_size < 64; mat_size+=20 ) {
+        cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+        cv::imwrite(filename, M);
+        ii.set_block_size(4);
+        ii.process(filename);
+        ii.wait();
+        check_integral_image(filename + filetype, mat_size);
+    }
+}
+
+TEST(ImageIntegrator, check_split_channels) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_block_size(4);
+    ii.set_split_channels(true);
+    std::string filename = "testfile.tif";
+    const int mat_size = 10;
+    cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+    cv::imwrite(filename, M);
+    ii.process(filename);
+    ii.wait();
+    for (int c = 0; c < channel_count; c++) {
+        std::string channel_file = 
+            filename + ".c" + std::to_string(c) + ".integral";
+        check_integral_image(channel_file, mat_size, 1);
+    }
+}
+
+TEST(ImageIntegrator, check_strip_streaming) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_strip_height(3);
+    //binary PGM is read by strips without decoding whole image
+    std::string filename = "testfile.pgm";
+    const int mat_size = 10;
+    {
+        std::ofstream fout{filename, std::ios::binary};
+        fout << "P5\n" << mat_size << ' ' << mat_size << "\n255\n";
+        for (int i = 0; i < mat_size; i++) {
+            for (int j = 0; j < mat_size; j++) {
+                fout.put(i == j ? 1 : 0);
+            }
+        }
+    }
+    ii.process(filename);
+    ii.wait();
+    for (int c = 0; c < channel_count; c++) {
+        std::string channel_file = 
+            filename + ".c" + std::to_string(c) + ".integral";
+        check_integral_image(channel_file, mat_size, 1);
+    }
+
+    //unchanged gray image keeps one channel, both from PGM and decoded file
+    ii.set_unchanged_input(true);
+    const std::string decoded_filename = "testfile.tif";
+    cv::imwrite(decoded_filename, cv::Mat::eye(mat_size, mat_size, CV_8UC1));
+    for (const std::string& path : {filename, decoded_filename}) {
+        std::remove((path + ".c1.integral").c_str());
+        ii.process(path);
+        ii.wait();
+        check_integral_image(path + ".c0.integral", mat_size, 1);
+        EXPECT_FALSE(std::ifstream{path + ".c1.integral"}.good());
+    }
+    //16-bit values aren't cut to 8 bits, image is rejected instead
+    cv::imwrite(decoded_filename, 
+            cv::Mat::eye(mat_size, mat_size, CV_MAKETYPE(CV_16U, 1)));
+    std::remove((decoded_filename + ".c0.integral").c_str());
+    ii.process(decoded_filename);
+    ii.wait();
+    EXPECT_FALSE(std::ifstream{decoded_filename + ".c0.integral"}.good());
+
+    //output of image truncated after its first strip is removed and counted
+    const uint64_t failed = ii.get_pipeline_stats().failed_streams;
+    {
+        std::ofstream fout{filename, std::ios::binary};
+        fout << "P5\n" << mat_size << ' ' << mat_size << "\n255\n";
+        fout << std::string(mat_size * 4, '\0');
+    }
+    ii.process(filename);
+    ii.wait();
+    EXPECT_FALSE(std::ifstream{filename + ".c0.integral"}.good());
+    EXPECT_EQ(failed + 1, ii.get_pipeline_stats().failed_streams);
+}
+
+/**
+ *  Write uncompressed stripped little-endian TIFF of gray diagonal, strips 
+ *  are stored with gaps between them
+ */
+static void write_diagonal_tiff(
+        const std::string& path, 
+        int mat_size, 
+        int rows_per_strip, 
+        int compression = 1
+) {
+    std::string file;
+    auto put16 = [&] (uint32_t value) {
+        file.push_back(char(value & 0xff));
+        file.push_back(char(value >> 8 & 0xff));
+    };
+    auto put32 = [&] (uint32_t value) {
+        put16(value & 0xffff);
+        put16(value >> 16);
+    };
+    const int strip_count = (mat_size + rows_per_strip - 1) / rows_per_strip;
+    const int entry_count = 10;
+    const uint32_t offsets_pos = 8 + 2 + entry_count * 12 + 4;
+    const uint32_t counts_pos = offsets_pos + 4 * strip_count;
+    const uint32_t data_pos = counts_pos + 4 * strip_count;
+    const uint32_t strip_gap = 7;
+    auto entry = [&] (uint32_t tag, uint32_t type, uint32_t count, 
+            uint32_t value) {
+        put16(tag);
+        put16(type);
+        put32(count);
+        put32(value);
+    };
+    file = "II";
+    put16(42);
+    put32(8);
+    put16(entry_count);
+    //SHORT type is 3, LONG type is 4
+    entry(256, 4, 1, mat_size);
+    entry(257, 4, 1, mat_size);
+    entry(258, 3, 1, 8);
+    entry(259, 3, 1, compression);
+    entry(262, 3, 1, 1);
+    entry(273, 4, strip_count, offsets_pos);
+    entry(277, 3, 1, 1);
+    entry(278, 4, 1, rows_per_strip);
+    entry(279, 4, strip_count, counts_pos);
+    entry(284, 3, 1, 1);
+    put32(0);
+    uint32_t offset = data_pos;
+    for (int k = 0; k < strip_count; k++) {
+        put32(offset);
+        offset += rows_per_strip * mat_size + strip_gap;
+    }
+    for (int k = 0; k < strip_count; k++) {
+        put32(std::min(rows_per_strip, mat_size - k * rows_per_strip) * 
+                mat_size);
+    }
+    for (int k = 0; k < strip_count; k++) {
+        const int y_end = std::min((k + 1) * rows_per_strip, mat_size);
+        for (int y = k * rows_per_strip; y < y_end; y++) {
+            for (int x = 0; x < mat_size; x++) {
+                file.push_back(y == x ? 1 : 0);
+            }
+        }
+        file.append(strip_gap, char(0xff));
+    }
+    std::ofstream{path, std::ios::binary} << file;
+}
+
+TEST(ImageIntegrator, check_strip_streaming_tiff) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    //strips of reading cross strips of file
+    ii.set_strip_height(4);
+    const std::string filename = "testfile_strips.tif";
+    const int mat_size = 10;
+    write_diagonal_tiff(filename, mat_size, 3);
+    std::stringstream log;
+    logger.set_output(log);
+    ii.process(filename);
+    ii.wait();
+    for (int c = 0; c < channel_count; c++) {
+        std::string channel_file = 
+            filename + ".c" + std::to_string(c) + ".integral";
+        check_integral_image(channel_file, mat_size, 1);
+    }
+    EXPECT_EQ(std::string::npos, log.str().find("WARNING"));
+
+    //compressed TIFF falls back to decoding whole image with warning
+    write_diagonal_tiff(filename, mat_size, 3, 5);
+    ii.process(filename);
+    ii.wait();
+    EXPECT_NE(std::string::npos, log.str().find(
+                "WARNING: " + filename + " can't be read by strips "
+                "(TIFF is compressed)"));
+
+    //damaged count of strip offsets isn't allocated
+    write_diagonal_tiff(filename, mat_size, 3);
+    {
+        std::fstream fout{filename, 
+            std::ios::binary | std::ios::in | std::ios::out};
+        //count of 6th entry, which is StripOffsets
+        fout.seekp(8 + 2 + 5 * 12 + 4);
+        fout << std::string(4, char(0xff));
+    }
+    ii.process(filename);
+    ii.wait();
+    logger.set_output(std::cout);
+    EXPECT_NE(std::string::npos, log.str().find(
+                "WARNING: " + filename + " can't be read by strips "
+                "(TIFF strip offsets are out of file)"));
+}
+
+TEST(ImageIntegrator, check_pooled_buffers) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_pool_limit(size_t(1) << 20);
+    std::string filename = "testfile.tif";
+    std::string filetype = ".integral";
+    //reused memory isn't zeroed, values of previous image mustn't leak
+    for (int mat_size = 15; mat_size > 0; mat_size-=3 ) {
+        cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+        cv::imwrite(filename, M);
+        ii.set_block_size(4);
+        ii.process(filename);
+        ii.wait();
+        check_integral_image(filename + filetype, mat_size);
+    }
+}
+
+TEST(ImageIntegrator, check_huge_pages) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_page_mode(PageMode::transparent_huge);
+    std::string filename = "testfile.tif";
+    std::string filetype = ".integral";
+    for (int mat_size = 3; mat_size < 16; mat_size+=3 ) {
+        cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+        cv::imwrite(filename, M);
+        ii.set_block_size(4);
+        ii.process(filename);
+        ii.wait();
+        check_integral_image(filename + filetype, mat_size);
+    }
+}
+
+TEST(ImageIntegrator, check_early_release) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_early_release(true);
+    std::string filename = "testfile.tif";
+    std::string filetype = ".integral";
+    //rows are long enough to span several pages
+    const int mat_size = 700;
+    cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+    cv::imwrite(filename, M);
+    ii.set_block_size(16);
+    ii.process(filename);
+    ii.wait();
+    check_integral_image(filename + filetype, mat_size);
+}
+
+TEST(ImageIntegrator, check_memory_budget) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    //budget fits one image, so others wait in queue
+    const int mat_size = 12;
+    ii.set_max_memory(mat_size * mat_size * 3 * 9);
+    ii.set_block_size(4);
+    const int image_count = 4;
+    for (int i = 0; i < image_count; i++) {
+        std::string filename = "testfile" + std::to_string(i) + ".pgm";
+        std::ofstream fout{filename, std::ios::binary};
+        fout << "P5\n" << mat_size << ' ' << mat_size << "\n255\n";
+        for (int y = 0; y < mat_size; y++) {
+            for (int x = 0; x < mat_size; x++) {
+                fout.put(y == x ? 1 : 0);
+            }
+        }
+    }
+    ii.set_strip_height(5);
+    for (int i = 0; i < image_count; i++) {
+        ii.process("testfile" + std::to_string(i) + ".pgm");
+    }
+    ii.wait();
+    const MemoryBudget::Stats stats = ii.get_admission_stats();
+    EXPECT_EQ(size_t(image_count), stats.started_jobs);
+    EXPECT_EQ(size_t(0), stats.waiting_jobs);
+    for (int i = 0; i < image_count; i++) {
+        std::string filename = "testfile" + std::to_string(i) + ".pgm";
+        check_integral_image(filename + ".c1.integral", mat_size, 1);
+    }
+}
+
+TEST(ImageIntegrator, check_decode_stage) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    EXPECT_FALSE(ii.try_init_decoder(-1, 0));
+    //one image is integrated while next one is decoded
+    EXPECT_TRUE(ii.try_init_decoder(2, 1));
+    const int mat_size = 12;
+    ii.set_max_memory(mat_size * mat_size * 3 * 18);
+    ii.set_block_size(4);
+    const int image_count = 6;
+    cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+    for (int i = 0; i < image_count; i++) {
+        std::string filename = "testfile" + std::to_string(i) + ".tif";
+        cv::imwrite(filename, M);
+        ii.process(filename);
+    }
+    ii.wait();
+
+    const ImageIntegrator::PipelineStats stats = ii.get_pipeline_stats();
+    EXPECT_EQ(2, stats.decode_threads);
+    EXPECT_EQ(2, stats.integrate_threads);
+    EXPECT_LE(stats.decode_busy_time, stats.wall_time * 2);
+    for (int i = 0; i < image_count; i++) {
+        std::string filename = "testfile" + std::to_string(i) + ".tif";
+        check_integral_image(filename + ".integral", mat_size);
+    }
+}
+
+TEST(ImageIntegrator, check_small_image_batching) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    const int mat_size = 8;
+    const int image_count = 5;
+    //last batch isn't full and is flushed by wait
+    ii.set_batching(mat_size * mat_size, 2);
+    //size of batched images is taken from header, so files are real PGMs
+    for (int i = 0; i < image_count; i++) {
+        std::string filename = "testfile" + std::to_string(i) + ".pgm";
+        {
+            std::ofstream fout{filename, std::ios::binary};
+            fout << "P5\n" << mat_size << ' ' << mat_size << "\n255\n";
+            for (int y = 0; y < mat_size; y++) {
+                for (int x = 0; x < mat_size; x++) {
+                    fout.put(y == x ? 1 : 0);
+                }
+            }
+        }
+        ii.process(filename);
+    }
+    ii.wait();
+    for (int i = 0; i < image_count; i++) {
+        std::string filename = "testfile" + std::to_string(i) + ".pgm";
+        check_integral_image(filename + ".integral", mat_size);
+    }
+
+    const std::string container_path = "testfile.integral.pack";
+    ASSERT_TRUE(ii.try_open_container(container_path));
+    for (int i = 0; i < image_count; i++) {
+        ii.process("testfile" + std::to_string(i) + ".pgm");
+    }
+    ii.close_container();
+
+    std::vector<IntegralRecord> records;
+    ASSERT_TRUE(read_integral_container(container_path, records));
+    ASSERT_EQ(size_t(image_count), records.size());
+    for (const IntegralRecord& record : records) {
+        EXPECT_EQ(0u, record.path.find("testfile"));
+        ASSERT_EQ(mat_size, int(record.header.width));
+        ASSERT_EQ(mat_size, int(record.header.height));
+        ASSERT_EQ(channel_count, int(record.header.channels));
+        for (int i = 0; i < mat_size; i++) {
+            for (int j = 0; j < mat_size; j++) {
+                for (int c = 0; c < channel_count; c++) {
+                    EXPECT_DOUBLE_EQ(double(1 + std::min(i, j)), 
+                            record.values[(i * mat_size + j) * channel_count + c]);
+                }
+            }
+        }
+    }
+}
+
+TEST(ImageIntegrator, check_non_square_blocks) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_block_shape(7, 3);
+    std::string filename = "testfile.tif";
+    const int mat_size = 20;
+    cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+    cv::imwrite(filename, M);
+    ii.process(filename);
+    ii.wait();
+    check_integral_image(filename + ".integral", mat_size);
+
+    ii.set_engine(Engine::serial);
+    ii.process(filename);
+    ii.wait();
+    check_integral_image(filename + ".integral", mat_size);
+
+    //serial engine of other entry points is one block per channel, so 
+    //first chunk holds all rows of first channel
+    std::vector<std::string> chunks;
+    ImageIntegrator::OutputSink sink;
+    sink.write = [&] (std::string chunk) { chunks.push_back(chunk); };
+    ii.process(filename, sink);
+    ii.wait();
+    ASSERT_FALSE(chunks.empty());
+    EXPECT_EQ(mat_size, 
+            int(std::count(chunks[0].begin(), chunks[0].end(), '\n')));
+    std::string output;
+    for (const std::string& chunk : chunks) {
+        output += chunk;
+    }
+    std::ofstream{"testfile_serial.integral"} << output;
+    check_integral_image("testfile_serial.integral", mat_size);
+    cv::Mat integral = ii.integrate(M).get();
+    ASSERT_FALSE(integral.empty());
+    EXPECT_DOUBLE_EQ(mat_size, integral.at<double>(mat_size - 1, mat_size - 1));
+}
+
+TEST(EngineTuner, choose_engine) {
+    EngineTuner tuner;
+    CacheInfo cache;
+    cache.l2 = size_t(1) << 20;
+    tuner.set_cache_info(cache);
+    EngineTuner::Calibration calibration;
+    calibration.value_ns = 1;
+    calibration.memory_value_ns = 2;
+    calibration.row_ns = 10;
+    calibration.task_ns = 1000;
+    tuner.set_calibration(calibration);
+
+    //scheduling cost of icon is bigger than its integration
+    EXPECT_EQ(Engine::serial, tuner.choose(32, 32, 3, 8).engine);
+    const EngineTuner::Choice choice = tuner.choose(20000, 20000, 3, 8);
+    EXPECT_EQ(Engine::wavefront, choice.engine);
+    //block fits into half of L2
+    EXPECT_LE(size_t(choice.block_width) * choice.block_height * 3 * 9, 
+            cache.l2 / 2);
+    //deeper values leave room for smaller blocks
+    const EngineTuner::Choice deep_choice = 
+        tuner.choose(20000, 20000, 3, 8, sizeof(double));
+    EXPECT_EQ(Engine::wavefront, deep_choice.engine);
+    EXPECT_LE(size_t(deep_choice.block_width) * deep_choice.block_height * 
+            3 * 16, cache.l2 / 2);
+    EXPECT_GT(size_t(choice.block_width) * choice.block_height * 3 * 16, 
+            cache.l2 / 2);
+
+    const std::string path = "testfile.calibration";
+    ASSERT_TRUE(tuner.try_save(path));
+    EngineTuner loaded;
+    ASSERT_TRUE(loaded.try_load(path));
+    EXPECT_DOUBLE_EQ(calibration.task_ns, loaded.get_calibration().task_ns);
+    EXPECT_DOUBLE_EQ(calibration.row_ns, loaded.get_calibration().row_ns);
+}
+
+TEST(ImageIntegrator, check_automatic_engine) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    const std::string path = "testfile.auto.calibration";
+    std::remove(path.c_str());
+    ASSERT_TRUE(ii.try_calibrate(path));
+    EXPECT_TRUE(ii.get_tuner().is_calibrated());
+    EXPECT_GT(ii.get_tuner().get_calibration().task_ns, 0);
+    ii.set_engine(Engine::automatic);
+    //header of PGM is read to choose engine
+    const int mat_size = 150;
+    std::string filename = "testfile.pgm";
+    {
+        std::ofstream fout{filename, std::ios::binary};
+        fout << "P5\n" << mat_size << ' ' << mat_size << "\n255\n";
+        for (int y = 0; y < mat_size; y++) {
+            for (int x = 0; x < mat_size; x++) {
+                fout.put(y == x ? 1 : 0);
+            }
+        }
+    }
+    ii.process(filename);
+    ii.wait();
+    check_integral_image(filename + ".integral", mat_size);
+}
+
+TEST(ImageIntegrator, check_in_memory_integration) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_block_size(4);
+    const int mat_size = 10;
+    cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+    cv::Mat result = ii.integrate(M).get();
+    ASSERT_EQ(CV_64FC1, result.type());
+    for (int i = 0; i < mat_size; i++) {
+        for (int j = 0; j < mat_size; j++) {
+            EXPECT_DOUBLE_EQ(double(1 + std::min(i, j)), 
+                    result.ptr<double>(i)[j]);
+        }
+    }
+
+    //result is written into buffer of caller with padded rows
+    const int row_stride = mat_size * 3 + 2;
+    std::vector<double> buffer(row_stride * mat_size, -1.0);
+    ImageIntegrator::OutputSpec spec;
+    spec.destination = cv::Mat(mat_size, mat_size, CV_64FC3, buffer.data(), 
+            row_stride * sizeof(double));
+    cv::Mat color(mat_size, mat_size, CV_8UC3);
+    for (int i = 0; i < mat_size; i++) {
+        for (int j = 0; j < mat_size * 3; j++) {
+            color.ptr<uchar>(i)[j] = i == j / 3 ? 1 : 0;
+        }
+    }
+    result = ii.integrate(color, spec).get();
+    ASSERT_EQ(buffer.data(), reinterpret_cast<double*>(result.data));
+    for (int i = 0; i < mat_size; i++) {
+        for (int j = 0; j < mat_size * 3; j++) {
+            EXPECT_DOUBLE_EQ(double(1 + std::min(i, j / 3)), 
+                    buffer[i * row_stride + j]);
+        }
+        EXPECT_DOUBLE_EQ(-1.0, buffer[i * row_stride + mat_size * 3]);
+    }
+
+    //destination of wrong size gives empty result
+    spec.destination = cv::Mat(mat_size + 1, mat_size, CV_64FC3);
+    EXPECT_TRUE(ii.integrate(color, spec).get().empty());
+}
+
+TEST(ImageIntegrator, check_incremental_update) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    ii.set_block_shape(16, 8);
+    const int width = 100;
+    const int height = 70;
+    cv::Mat image(height, width, CV_8UC3);
+    std::mt19937 rng{7};
+    for (size_t i = 0; i < image.total() * 3; i++) {
+        image.data[i] = rng() & 0xff;
+    }
+    cv::Mat integral = ii.integrate(image).get();
+    ASSERT_FALSE(integral.empty());
+
+    //small rectangles are applied as delta, big ones are integrated again
+    const cv::Rect dirty_rects[] = {
+        cv::Rect(37, 21, 5, 3), cv::Rect(0, 0, 1, 1), 
+        cv::Rect(99, 69, 1, 1), cv::Rect(10, 5, 90, 60)
+    };
+    for (const cv::Rect& dirty : dirty_rects) {
+        cv::Mat pixels(dirty.height, dirty.width, CV_8UC3);
+        for (size_t i = 0; i < pixels.total() * 3; i++) {
+            pixels.data[i] = rng() & 0xff;
+        }
+        cv::Mat updated = ii.update(image, integral, dirty, pixels).get();
+        ASSERT_EQ(integral.data, updated.data);
+        EXPECT_EQ(pixels.data[0], image.ptr(dirty.y)[dirty.x * 3]);
+
+        cv::Mat expected = ii.integrate(image).get();
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width * 3; x++) {
+                ASSERT_DOUBLE_EQ(expected.ptr<double>(y)[x], 
+                        integral.ptr<double>(y)[x]);
+            }
+        }
+    }
+
+    //rectangle outside image gives empty result and changes nothing
+    cv::Mat pixels(4, 4, CV_8UC3);
+    EXPECT_TRUE(ii.update(image, integral, cv::Rect(98, 0, 4, 4), pixels)
+            .get().empty());
+    //empty rectangle changes nothing, whatever its pixels are
+    cv::Mat same = ii.update(image, integral, cv::Rect(5, 5, 0, 3), cv::Mat())
+        .get();
+    EXPECT_EQ(integral.data, same.data);
+}
+
+TEST(ImageIntegrator, check_lazy_integration) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_block_shape(16, 8);
+    const int width = 100;
+    const int height = 70;
+    cv::Mat image(height, width, CV_8UC3);
+    std::mt19937 rng{11};
+    for (size_t i = 0; i < image.total() * 3; i++) {
+        image.data[i] = rng() & 0xff;
+    }
+    IntegralQuery expected;
+    ASSERT_TRUE(expected.try_attach(ii.integrate(image).get()));
+
+    std::shared_ptr<ImageIntegrator::LazyIntegral> lazy = 
+        ii.integrate_lazy(image);
+    ASSERT_TRUE(lazy != nullptr);
+    EXPECT_EQ(width, lazy->get_width());
+    EXPECT_EQ(0u, lazy->get_integrated_block_count());
+    //only blocks up to bottom right corner of rectangle are integrated
+    const cv::Rect corner(3, 2, 20, 10);
+    EXPECT_DOUBLE_EQ(expected.sum(corner, 1), lazy->sum(corner, 1));
+    EXPECT_EQ(4u, lazy->get_integrated_block_count());
+    const cv::Rect column(0, 60, 5, 10);
+    EXPECT_DOUBLE_EQ(expected.sum(column, 2), lazy->sum(column, 2));
+    EXPECT_EQ(4u + 7u, lazy->get_integrated_block_count());
+
+    std::vector<cv::Rect> rects;
+    for (int i = 0; i < 200; i++) {
+        const int x = rng() % width;
+        const int y = rng() % height;
+        rects.emplace_back(x, y, 1 + rng() % (width - x), 
+                1 + rng() % (height - y));
+    }
+    for (const cv::Rect& rect : rects) {
+        EXPECT_DOUBLE_EQ(expected.sum(rect, 0), lazy->sum(rect, 0));
+    }
+    std::vector<double> sums(rects.size());
+    lazy->sum_many(rects.data(), rects.size(), sums.data(), 1);
+    for (size_t i = 0; i < rects.size(); i++) {
+        EXPECT_DOUBLE_EQ(expected.sum(rects[i], 1), sums[i]);
+    }
+    lazy->materialize(cv::Rect(0, 0, width, height));
+    EXPECT_EQ(7u * 9u, lazy->get_integrated_block_count());
+
+    EXPECT_TRUE(ii.integrate_lazy(cv::Mat()) == nullptr);
+}
+
+TEST(ImageIntegrator, check_encoded_image) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_block_size(4);
+    const int mat_size = 10;
+    std::stringstream ss;
+    ss << "P5\n" << mat_size << ' ' << mat_size << "\n255\n";
+    for (int y = 0; y < mat_size; y++) {
+        for (int x = 0; x < mat_size; x++) {
+            ss.put(y == x ? 1 : 0);
+        }
+    }
+    const std::string encoded = ss.str();
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(encoded.data());
+
+    ImageHeader header;
+    ASSERT_TRUE(header.try_read(data, encoded.size()));
+    EXPECT_EQ(mat_size, header.width);
+
+    //output goes to files named by sink
+    ImageIntegrator::OutputSink file_sink;
+    file_sink.path = "testfile_encoded";
+    ii.process_encoded(data, encoded.size(), file_sink);
+
+    //output is collected by callback
+    std::string output;
+    int closed = 0;
+    bool succeeded = false;
+    ImageIntegrator::OutputSink callback_sink;
+    callback_sink.write = [&] (std::string chunk) { output += chunk; };
+    callback_sink.close = [&] (bool success) { 
+        closed++; 
+        succeeded = success; 
+    };
+    ii.process_encoded(data, encoded.size(), callback_sink);
+    ii.wait();
+    check_integral_image("testfile_encoded.integral", mat_size);
+    EXPECT_EQ(1, closed);
+    EXPECT_TRUE(succeeded);
+    std::ofstream{"testfile_callback.integral"} << output;
+    check_integral_image("testfile_callback.integral", mat_size);
+
+    //damaged image is reported to sink
+    ii.process_encoded(data, 5, callback_sink);
+    ii.wait();
+    EXPECT_EQ(2, closed);
+    EXPECT_FALSE(succeeded);
+}
+
+TEST(ImageIntegrator, check_streamed_rows) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    const int block_size = 8;
+    ii.set_block_size(block_size);
+    const int mat_size = 60;
+    std::stringstream ss;
+    ss << "P5\n" << mat_size << ' ' << mat_size << "\n255\n";
+    for (int y = 0; y < mat_size; y++) {
+        for (int x = 0; x < mat_size; x++) {
+            ss.put(y == x ? 1 : 0);
+        }
+    }
+    const std::string encoded = ss.str();
+
+    //chunks are recorded with time of arrival and state of image
+    typedef std::chrono::steady_clock Clock;
+    std::vector<std::string> chunks;
+    std::vector<Clock::time_point> chunk_times;
+    std::vector<bool> closed_before_chunk;
+    bool closed = false;
+    bool succeeded = false;
+    Clock::time_point close_time;
+    ImageIntegrator::OutputSink sink;
+    sink.write = [&] (std::string chunk) {
+        chunks.push_back(std::move(chunk));
+        chunk_times.push_back(Clock::now());
+        closed_before_chunk.push_back(closed);
+    };
+    sink.close = [&] (bool success) {
+        close_time = Clock::now();
+        closed = true;
+        succeeded = success;
+    };
+    ii.process_encoded(reinterpret_cast<const uint8_t*>(encoded.data()), 
+            encoded.size(), sink);
+    ii.wait();
+    ASSERT_TRUE(closed);
+    EXPECT_TRUE(succeeded);
+
+    //each block row is passed and given away separately, channels end with 
+    //empty line
+    const int block_rows = (mat_size + block_size - 1) / block_size;
+    ASSERT_EQ(size_t((block_rows + 1) * channel_count), chunks.size());
+    size_t i = 0;
+    for (int c = 0; c < channel_count; c++) {
+        for (int y = 0; y < block_rows; y++, i++) {
+            const int row_count = 
+                std::min(block_size, mat_size - y * block_size);
+            EXPECT_EQ(row_count, 
+                    int(std::count(chunks[i].begin(), chunks[i].end(), '\n')));
+            //last value of image row r is r + 1, so rows are in file order
+            std::stringstream chunk{chunks[i]};
+            double value = 0;
+            double last_value = 0;
+            while (chunk >> value) {
+                last_value = value;
+            }
+            EXPECT_DOUBLE_EQ(double(y * block_size + row_count), last_value);
+        }
+        EXPECT_EQ("\n", chunks[i++]);
+    }
+    //all of chunks arrive in order before image is done
+    for (size_t j = 0; j < chunks.size(); j++) {
+        EXPECT_FALSE(closed_before_chunk[j]);
+        EXPECT_LE(chunk_times[j], close_time);
+        if (j > 0) {
+            EXPECT_LE(chunk_times[j - 1], chunk_times[j]);
+        }
+    }
+    std::string output;
+    for (const std::string& chunk : chunks) {
+        output += chunk;
+    }
+    std::ofstream{"testfile_streamed.integral"} << output;
+    check_integral_image("testfile_streamed.integral", mat_size);
+}
+
+TEST(JobServer, serve_jobs) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    ii.set_block_size(4);
+    const std::string socket_path = "testfile.socket";
+    JobServer server{ii};
+    ASSERT_TRUE(server.try_start(socket_path));
+
+    const int mat_size = 10;
+    std::string filename = "testfile_served.pgm";
+    std::stringstream ss;
+    ss << "P5\n" << mat_size << ' ' << mat_size << "\n255\n";
+    for (int y = 0; y < mat_size; y++) {
+        for (int x = 0; x < mat_size; x++) {
+            ss.put(y == x ? 1 : 0);
+        }
+    }
+    std::ofstream{filename, std::ios::binary} << ss.str();
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socket_path.c_str());
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(0, connect(fd, reinterpret_cast<sockaddr*>(&address), 
+                sizeof(address)));
+
+    JobRequest path_job;
+    path_job.id = 0;
+    path_job.path = filename;
+    JobRequest blob_job;
+    blob_job.id = 1;
+    blob_job.source = JobRequest::Source::blob;
+    blob_job.output = JobRequest::Output::reply;
+    const std::string encoded = ss.str();
+    blob_job.blob.assign(encoded.begin(), encoded.end());
+    JobRequest missing_job;
+    missing_job.id = 2;
+    missing_job.path = "missing_file.pgm";
+    ASSERT_TRUE(write_message(fd, encode_request(path_job)));
+    ASSERT_TRUE(write_message(fd, encode_request(blob_job)));
+    ASSERT_TRUE(write_message(fd, encode_request(missing_job)));
+
+    std::vector<JobReply> replies(3);
+    for (int i = 0; i < 3; i++) {
+        std::string payload;
+        JobReply reply;
+        ASSERT_TRUE(read_message(fd, payload));
+        ASSERT_TRUE(try_decode_reply(payload, reply));
+        ASSERT_LT(reply.id, 3u);
+        EXPECT_GE(reply.total_ms, 0);
+        replies[reply.id] = reply;
+    }
+    close(fd);
+
+    EXPECT_TRUE(replies[0].success);
+    EXPECT_TRUE(replies[1].success);
+    EXPECT_FALSE(replies[2].success);
+    server.stop();
+    EXPECT_EQ(3u, server.get_job_count());
+    check_integral_image(filename + ".integral", mat_size);
+    std::ofstream{"testfile_reply.integral"} << replies[1].result;
+    check_integral_image("testfile_reply.integral", mat_size);
+}
+
+TEST(ImageIntegrator, check_mapped_integral_image) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(0));
+    ii.set_block_size(4);
+    ii.set_output_format(ImageIntegrator::OutputFormat::mapped);
+    std::string filename = "testfile.tif";
+    const int mat_size = 10;
+    cv::Mat M = cv::Mat::eye(mat_size, mat_size, CV_8UC1);
+    cv::imwrite(filename, M);
+    ii.process(filename);
+    ii.wait();
+
+    std::ifstream fin{filename + ".integral.bin", std::ios::binary};
+    IntegralFileHeader header;
+    fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+    ASSERT_TRUE(header.is_valid());
+    ASSERT_EQ(mat_size, int(header.width));
+    ASSERT_EQ(mat_size, int(header.height));
+    ASSERT_EQ(channel_count, int(header.channels));
+    for (int i = 0; i < mat_size; i++) {
+        for (int j = 0; j < mat_size; j++) {
+            for (int c = 0; c < channel_count; c++) {
+                double readed;
+                fin.read(reinterpret_cast<char*>(&readed), sizeof(readed));
+                EXPECT_DOUBLE_EQ(double(1 + std::min(i, j)), readed);
+            }
+        }
+    }
+}
+
+TEST(IntegralQuery, check_rectangle_sums) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    ii.set_block_size(64);
+    //batch is larger than one chunk of corners
+    const int width = 640;
+    const int height = 480;
+    std::mt19937 rng{7};
+    cv::Mat image(height, width, CV_8UC3);
+    for (size_t i = 0; i < image.total() * image.elemSize(); i++) {
+        image.data[i] = rng() & 0xff;
+    }
+    cv::Mat result = ii.integrate(image).get();
+    IntegralQuery query;
+    ASSERT_TRUE(query.try_attach(result));
+    ASSERT_EQ(3, query.get_channels());
+
+    std::vector<cv::Rect> rects;
+    std::vector<double> expected;
+    for (int i = 0; i < 3000; i++) {
+        const cv::Rect rect(int(rng() % (width + 20)) - 10, 
+                int(rng() % (height + 20)) - 10, rng() % 40, rng() % 40);
+        const cv::Rect clipped = rect & cv::Rect(0, 0, width, height);
+        double sum = 0;
+        for (int y = clipped.y; y < clipped.y + clipped.height; y++) {
+            for (int x = clipped.x; x < clipped.x + clipped.width; x++) {
+                sum += image.ptr<uchar>(y)[x * 3 + 1];
+            }
+        }
+        rects.push_back(rect);
+        expected.push_back(sum);
+    }
+    std::vector<double> sums(rects.size());
+    query.sum_many(rects.data(), rects.size(), sums.data(), 1);
+    for (size_t i = 0; i < rects.size(); i++) {
+        EXPECT_DOUBLE_EQ(expected[i], sums[i]);
+        EXPECT_DOUBLE_EQ(expected[i], query.sum(rects[i], 1));
+    }
+    const cv::Rect whole(0, 0, width, height);
+    EXPECT_DOUBLE_EQ(result.ptr<double>(height - 1)[width * 3 - 1] / 
+            (width * height), query.mean(whole, 2));
+    EXPECT_DOUBLE_EQ(0, query.mean(cv::Rect(width, 0, 5, 5)));
+
+    //the same sums from mapped binary file
+    std::string filename = "testfile_query.pgm";
+    std::ofstream fout{filename, std::ios::binary};
+    fout << "P5\n" << width << ' ' << height << "\n255\n";
+    fout.write(reinterpret_cast<const char*>(image.data), width * height);
+    fout.close();
+    ii.set_output_format(ImageIntegrator::OutputFormat::mapped);
+    ii.process(filename);
+    ii.wait();
+    IntegralQuery mapped;
+    ASSERT_TRUE(mapped.try_open(filename + ".integral.bin"));
+    ASSERT_EQ(width, mapped.get_width());
+    ASSERT_EQ(height, mapped.get_height());
+    cv::Mat gray(height, width, CV_8UC1, image.data);
+    IntegralQuery attached;
+    ASSERT_TRUE(attached.try_attach(ii.integrate(gray).get()));
+    mapped.sum_many(rects.data(), rects.size(), sums.data(), 
+            mapped.get_channels() - 1);
+    for (size_t i = 0; i < rects.size(); i++) {
+        EXPECT_DOUBLE_EQ(attached.sum(rects[i]), sums[i]);
+    }
+    EXPECT_FALSE(mapped.try_open("missing_file.integral.bin"));
+}
+
+TEST(IntegralQuery, reject_damaged_headers) {
+    const std::string filename = "testfile_damaged.integral.bin";
+    auto write_file = [&] (const IntegralFileHeader& header, size_t count) {
+        std::ofstream fout{filename, std::ios::binary};
+        fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        const std::vector<double> values(count, 1.0);
+        fout.write(reinterpret_cast<const char*>(values.data()), 
+                values.size() * sizeof(double));
+    };
+    IntegralFileHeader header;
+    header.width = 2;
+    header.height = 2;
+    header.channels = 1;
+    header.row_stride = 2;
+    write_file(header, 4);
+    IntegralQuery query;
+    EXPECT_TRUE(query.try_open(filename));
+    //value count wraps around to 2 values which the file has
+    header.row_stride = (uint64_t(1) << 63) + 1;
+    write_file(header, 4);
+    EXPECT_FALSE(query.try_open(filename));
+    //rows don't fit in stride
+    header.row_stride = 1;
+    write_file(header, 4);
+    EXPECT_FALSE(query.try_open(filename));
+    //file is shorter than values
+    header.row_stride = 2;
+    write_file(header, 3);
+    EXPECT_FALSE(query.try_open(filename));
+    //sizes don't fit in int
+    header.width = uint32_t(INT_MAX) + 1;
+    header.height = 0;
+    header.row_stride = header.width;
+    write_file(header, 0);
+    EXPECT_FALSE(query.try_open(filename));
+}
+
+/// Write gray PGM image with diagonal of ones
+static void write_diagonal_pgm(const std::string& path, int mat_size) {
+    std::ofstream fout{path, std::ios::binary};
+    fout << "P5\n" << mat_size << ' ' << mat_size << "\n255\n";
+    for (int y = 0; y < mat_size; y++) {
+        for (int x = 0; x < mat_size; x++) {
+            fout.put(y == x ? 1 : 0);
+        }
+    }
+}
+
+TEST(LatencyHistogram, percentiles) {
+    LatencyHistogram histogram;
+    EXPECT_EQ(0, histogram.get_percentile(0.5));
+    for (int i = 1; i <= 100; i++) {
+        histogram.add(i);
+    }
+    EXPECT_EQ(100u, histogram.get_count());
+    EXPECT_GE(histogram.get_percentile(0.5), 50);
+    EXPECT_LE(histogram.get_percentile(0.5), 50 * 1.2);
+    EXPECT_GE(histogram.get_percentile(0.99), 99);
+    EXPECT_LE(histogram.get_percentile(0.99), 99 * 1.2);
+    histogram.reset();
+    EXPECT_EQ(0u, histogram.get_count());
+}
+
+TEST(IntegralCache, evict_least_recently_used) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    const int mat_size = 32;
+    const std::string paths[] = {
+        "testfile_cache0.pgm", "testfile_cache1.pgm", "testfile_cache2.pgm"
+    };
+    for (const std::string& path : paths) {
+        std::remove((path + ".integral.bin").c_str());
+        write_diagonal_pgm(path, mat_size);
+    }
+    const size_t image_bytes = 
+        size_t(mat_size) * mat_size * channel_count * sizeof(double);
+    IntegralCache cache{ii, 2 * image_bytes};
+
+    std::shared_ptr<const IntegralQuery> query = cache.get(paths[0]);
+    ASSERT_TRUE(query != nullptr);
+    EXPECT_DOUBLE_EQ(mat_size, query->sum(cv::Rect(0, 0, mat_size, mat_size)));
+    EXPECT_TRUE(cache.get(paths[1]) != nullptr);
+    EXPECT_EQ(query, cache.get(paths[0]));
+    //second image is least recently used
+    EXPECT_TRUE(cache.get(paths[2]) != nullptr);
+    IntegralCache::Stats stats = cache.get_stats();
+    EXPECT_EQ(1u, stats.hits);
+    EXPECT_EQ(3u, stats.misses);
+    EXPECT_EQ(1u, stats.evictions);
+    EXPECT_EQ(2u, stats.entries);
+    EXPECT_EQ(2 * image_bytes, stats.bytes);
+
+    //pinned image stays while others come and go
+    EXPECT_TRUE(cache.try_pin(paths[0]));
+    cache.get(paths[1]);
+    cache.get(paths[2]);
+    cache.get(paths[1]);
+    EXPECT_EQ(query, cache.get(paths[0]));
+    stats = cache.get_stats();
+    EXPECT_EQ(1u, stats.pinned);
+    EXPECT_EQ(2u, stats.entries);
+    cache.unpin(paths[0]);
+    EXPECT_EQ(0u, cache.get_stats().pinned);
+
+    EXPECT_TRUE(cache.get("missing_file.pgm") == nullptr);
+    EXPECT_FALSE(cache.try_pin("missing_file.pgm"));
+    EXPECT_EQ(2u, cache.get_stats().entries);
+
+    //unchanged input of integrator is respected, 16-bit values stay whole
+    ii.set_unchanged_input(true);
+    IntegralCache unchanged_cache{ii, 2 * image_bytes};
+    const std::string deep_path = "testfile_cache16.tif";
+    std::remove((deep_path + ".integral.bin").c_str());
+    cv::Mat deep = cv::Mat::eye(mat_size, mat_size, CV_MAKETYPE(CV_16U, 1));
+    deep.ptr<uint16_t>(0)[0] = 1000;
+    cv::imwrite(deep_path, deep);
+    query = unchanged_cache.get(deep_path);
+    ASSERT_TRUE(query != nullptr);
+    EXPECT_EQ(1, query->get_channels());
+    EXPECT_DOUBLE_EQ(1000 + mat_size - 1, 
+            query->sum(cv::Rect(0, 0, mat_size, mat_size)));
+}
+
+TEST(QueryServer, answer_queries) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    const int mat_size = 20;
+    const std::string filename = "testfile_query_server.pgm";
+    write_diagonal_pgm(filename, mat_size);
+    IntegralCache cache{ii, size_t(1) << 20};
+    const std::string socket_path = "testfile_query.socket";
+    QueryServer server{cache};
+    ASSERT_TRUE(server.try_start(socket_path));
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socket_path.c_str());
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(0, connect(fd, reinterpret_cast<sockaddr*>(&address), 
+                sizeof(address)));
+
+    QueryRequest request;
+    request.path = filename;
+    request.channel = 1;
+    request.rects = {0, 0, mat_size, mat_size, 5, 0, 10, 8, -5, -5, 3, 3};
+    for (int i = 0; i < 3; i++) {
+        request.id = i;
+        ASSERT_TRUE(write_message(fd, encode_query(request)));
+    }
+    request.id = 3;
+    request.path = "missing_file.pgm";
+    ASSERT_TRUE(write_message(fd, encode_query(request)));
+    request.id = 4;
+    request.kind = QueryRequest::Kind::stats;
+    ASSERT_TRUE(write_message(fd, encode_query(request)));
+
+    for (uint64_t i = 0; i < 4; i++) {
+        std::string payload;
+        QueryReply reply;
+        ASSERT_TRUE(read_message(fd, payload));
+        ASSERT_TRUE(try_decode_query_reply(payload, reply));
+        EXPECT_EQ(i, reply.id);
+        if (i == 3) {
+            EXPECT_FALSE(reply.success);
+            continue;
+        }
+        EXPECT_TRUE(reply.success);
+        ASSERT_EQ(3u, reply.sums.size());
+        EXPECT_DOUBLE_EQ(mat_size, reply.sums[0]);
+        EXPECT_DOUBLE_EQ(3, reply.sums[1]);
+        EXPECT_DOUBLE_EQ(0, reply.sums[2]);
+    }
+    std::string payload;
+    QueryReply reply;
+    ASSERT_TRUE(read_message(fd, payload));
+    ASSERT_TRUE(try_decode_query_reply(payload, reply));
+    close(fd);
+    EXPECT_NE(std::string::npos, reply.text.find("hits 2\n"));
+    EXPECT_NE(std::string::npos, reply.text.find("misses 2\n"));
+    EXPECT_NE(std::string::npos, reply.text.find("requests 4\n"));
+    EXPECT_NE(std::string::npos, reply.text.find("failed_requests 1\n"));
+    server.stop();
+}
+
+/// Read whole file, empty string if it doesn't exist
+static std::string read_whole_file(const std::string& path) {
+    std::ifstream fin{path, std::ios::binary};
+    return std::string(std::istreambuf_iterator<char>(fin), 
+            std::istreambuf_iterator<char>());
+}
+
+TEST(ResultCache, restore_identical_images) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    ii.set_block_size(8);
+    const std::string dir = "testfile_result_cache";
+    //zero capacity drops results of previous runs
+    ASSERT_TRUE(ii.try_open_result_cache(dir, 0));
+    ASSERT_TRUE(ii.try_open_result_cache(dir, size_t(1) << 20));
+    const std::string paths[] = {
+        "testfile_result0.pgm", "testfile_result1.pgm", "testfile_result2.pgm"
+    };
+    write_diagonal_pgm(paths[0], 24);
+    write_diagonal_pgm(paths[1], 24);
+    write_diagonal_pgm(paths[2], 16);
+    for (const std::string& path : paths) {
+        std::remove((path + ".integral").c_str());
+        std::remove((path + ".integral.bin").c_str());
+    }
+
+    ii.process(paths[0]);
+    ii.wait();
+    ii.process(paths[1]);
+    ii.process(paths[2]);
+    ii.wait();
+    ResultCache::Stats stats = ii.get_result_cache_stats();
+    EXPECT_EQ(1u, stats.hits);
+    EXPECT_EQ(2u, stats.misses);
+    EXPECT_EQ(2u, stats.stores);
+    const std::string expected = read_whole_file(paths[0] + ".integral");
+    EXPECT_FALSE(expected.empty());
+    EXPECT_EQ(expected, read_whole_file(paths[1] + ".integral"));
+    EXPECT_NE(expected, read_whole_file(paths[2] + ".integral"));
+
+    //binary output has its own results
+    ii.set_output_format(ImageIntegrator::OutputFormat::mapped);
+    ii.process(paths[0]);
+    ii.wait();
+    ii.process(paths[1]);
+    ii.wait();
+    stats = ii.get_result_cache_stats();
+    EXPECT_EQ(2u, stats.hits);
+    EXPECT_EQ(3u, stats.stores);
+    IntegralQuery query;
+    ASSERT_TRUE(query.try_open(paths[1] + ".integral.bin"));
+    EXPECT_DOUBLE_EQ(24, query.sum(cv::Rect(0, 0, 24, 24)));
+    query.release();
+
+    //rewriting output doesn't change cached result copied from it
+    write_diagonal_pgm(paths[0], 16);
+    ii.process(paths[0]);
+    ii.wait();
+    ii.process(paths[1]);
+    ii.wait();
+    ASSERT_TRUE(query.try_open(paths[1] + ".integral.bin"));
+    EXPECT_EQ(24, query.get_width());
+    query.release();
+
+    //results survive reopening
+    ASSERT_TRUE(ii.try_open_result_cache(dir, size_t(1) << 20));
+    EXPECT_EQ(4u, ii.get_result_cache_stats().entries);
+    ii.process(paths[2]);
+    ii.wait();
+    EXPECT_EQ(1u, ii.get_result_cache_stats().hits);
+}
+
+TEST(ResultCache, concurrent_stores_and_private_copies) {
+    ResultCache cache;
+    const std::string dir = "testfile_result_cache_race";
+    ASSERT_TRUE(cache.try_open(dir, 0));
+    ASSERT_TRUE(cache.try_open(dir, size_t(1) << 20));
+    const std::string content(100000, 'a');
+    const std::string key = ResultCache::make_key(
+            reinterpret_cast<const uint8_t*>(content.data()), 
+            content.size(), "txt");
+    //keys of images differing in one byte differ
+    std::string other = content;
+    other[50000] = 'b';
+    EXPECT_NE(key, ResultCache::make_key(
+            reinterpret_cast<const uint8_t*>(other.data()), 
+            other.size(), "txt"));
+
+    //outputs of identical images are stored at the same time
+    const int job_count = 8;
+    std::vector<std::string> outputs;
+    for (int i = 0; i < job_count; i++) {
+        outputs.push_back("testfile_race" + std::to_string(i) + ".integral");
+        std::ofstream{outputs.back(), std::ios::binary} << content;
+    }
+    std::vector<std::thread> jobs;
+    for (int i = 0; i < job_count; i++) {
+        jobs.emplace_back([&, i] () { cache.store(key, outputs[i]); });
+    }
+    for (std::thread& job : jobs) {
+        job.join();
+    }
+    for (const std::string& output : outputs) {
+        EXPECT_EQ(content, read_whole_file(output));
+    }
+    EXPECT_EQ(1u, cache.get_stats().entries);
+
+    //editing restored output in place changes neither cache nor other copies
+    ASSERT_TRUE(cache.try_restore(key, outputs[0]));
+    ASSERT_TRUE(cache.try_restore(key, outputs[1]));
+    {
+        std::fstream edit{outputs[0], 
+            std::ios::binary | std::ios::in | std::ios::out};
+        edit << "edited";
+    }
+    EXPECT_EQ(content, read_whole_file(outputs[1]));
+    ASSERT_TRUE(cache.try_restore(key, outputs[2]));
+    EXPECT_EQ(content, read_whole_file(outputs[2]));
+    for (const std::string& output : outputs) {
+        std::remove(output.c_str());
+    }
+}
+
+TEST(SequenceIntegrator, integrate_frames) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    ii.set_block_size(8);
+    const int frame_count = 7;
+    for (int i = 0; i < frame_count; i++) {
+        write_diagonal_pgm("testfile_frame" + std::to_string(i) + ".pgm", 
+                20 + i);
+    }
+    std::remove(("testfile_frame" + std::to_string(frame_count) + ".pgm")
+            .c_str());
+
+    SequenceIntegrator sequence{ii};
+    sequence.set_ring_size(2);
+    ASSERT_TRUE(sequence.try_open("testfile_frame%d.pgm"));
+    std::vector<uint64_t> indices;
+    //frames come in order, each one with its own integral image
+    ASSERT_TRUE(sequence.run([&] (uint64_t index, const cv::Mat& frame, 
+                    const cv::Mat& integral) {
+        indices.push_back(index);
+        const int size = 20 + int(index);
+        EXPECT_EQ(size, frame.rows);
+        ASSERT_EQ(size, integral.rows);
+        EXPECT_DOUBLE_EQ(double(size), 
+                integral.ptr<double>(size - 1)[(size - 1) * channel_count]);
+    }));
+    ASSERT_EQ(size_t(frame_count), indices.size());
+    for (int i = 0; i < frame_count; i++) {
+        EXPECT_EQ(uint64_t(i), indices[i]);
+    }
+    SequenceIntegrator::Stats stats = sequence.get_stats();
+    EXPECT_EQ(uint64_t(frame_count), stats.frames);
+    EXPECT_EQ(uint64_t(frame_count), stats.integrated);
+    EXPECT_EQ(0u, stats.dropped);
+    EXPECT_GT(stats.p99_ms, 0);
+
+    //no frame meets unreachable target
+    ASSERT_TRUE(sequence.try_open("testfile_frame%d.pgm"));
+    sequence.set_latency_target(1e-6);
+    ASSERT_TRUE(sequence.run(nullptr, 3));
+    stats = sequence.get_stats();
+    EXPECT_EQ(3u, stats.frames);
+    EXPECT_EQ(3u, stats.late);
+
+    //paced frames which can't meet target are dropped
+    ASSERT_TRUE(sequence.try_open("testfile_frame%d.pgm"));
+    sequence.set_frame_rate(1e6);
+    ASSERT_TRUE(sequence.run(nullptr));
+    stats = sequence.get_stats();
+    EXPECT_EQ(uint64_t(frame_count), stats.frames);
+    EXPECT_EQ(stats.frames, stats.integrated + stats.dropped);
+    EXPECT_GT(stats.dropped, 0u);
+}
+
+TEST(WindowIntegrator, sum_last_frames) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    ii.set_block_shape(16, 8);
+    const int width = 50;
+    const int height = 30;
+    const int window_size = 3;
+    std::mt19937 rng{5};
+    std::vector<cv::Mat> frames;
+    std::vector<cv::Mat> integrals;
+    WindowIntegrator window{ii, window_size};
+    for (int i = 0; i < 7; i++) {
+        cv::Mat frame(height, width, CV_8UC3);
+        for (size_t j = 0; j < frame.total() * 3; j++) {
+            frame.data[j] = rng() & 0xff;
+        }
+        frames.push_back(frame);
+        integrals.push_back(ii.integrate(frame).get());
+        ASSERT_TRUE(window.try_push(frame));
+        EXPECT_EQ(std::min(i + 1, window_size), window.get_frame_count());
+
+        //sums are exact, values are integers
+        const cv::Mat& sums = window.get_sums();
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width * 3; x++) {
+                double expected = 0;
+                for (int k = std::max(0, i + 1 - window_size); k <= i; k++) {
+                    expected += integrals[k].ptr<double>(y)[x];
+                }
+                ASSERT_DOUBLE_EQ(expected, sums.ptr<double>(y)[x]);
+            }
+        }
+    }
+    EXPECT_FALSE(window.try_push(cv::Mat(height + 1, width, CV_8UC3)));
+    window.clear();
+    EXPECT_EQ(0, window.get_frame_count());
+    EXPECT_TRUE(window.try_push(frames[0]));
+}
+
+TEST(ImageIntegrator, check_volume_integration) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    ii.set_block_shape(4, 3);
+    ii.set_block_depth(5);
+    const int width = 11;
+    const int height = 13;
+    const int depth = 17;
+    const int channels = 2;
+    const int sizes[] = {depth, height, width};
+    cv::Mat volume(3, sizes, CV_8UC(channels));
+    std::mt19937 rng{3};
+    for (size_t i = 0; i < volume.total() * channels; i++) {
+        volume.data[i] = rng() & 0xff;
+    }
+
+    //brute force summed-volume table
+    std::vector<double> expected(volume.total() * channels);
+    const auto at = [&] (int z, int y, int x, int c) {
+        return ((size_t(z) * height + y) * width + x) * channels + c;
+    };
+    for (int z = 0; z < depth; z++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    double value = volume.data[at(z, y, x, c)];
+                    value += x > 0 ? expected[at(z, y, x - 1, c)] : 0;
+                    value += y > 0 ? expected[at(z, y - 1, x, c)] : 0;
+                    value += z > 0 ? expected[at(z - 1, y, x, c)] : 0;
+                    value -= x > 0 && y > 0 ? 
+                        expected[at(z, y - 1, x - 1, c)] : 0;
+                    value -= x > 0 && z > 0 ? 
+                        expected[at(z - 1, y, x - 1, c)] : 0;
+                    value -= y > 0 && z > 0 ? 
+                        expected[at(z - 1, y - 1, x, c)] : 0;
+                    value += x > 0 && y > 0 && z > 0 ? 
+                        expected[at(z - 1, y - 1, x - 1, c)] : 0;
+                    expected[at(z, y, x, c)] = value;
+                }
+            }
+        }
+    }
+
+    const cv::Mat table = ii.integrate_volume(volume).get();
+    ASSERT_FALSE(table.empty());
+    for (int z = 0; z < depth; z++) {
+        for (int y = 0; y < height; y++) {
+            const double* row = reinterpret_cast<const double*>(
+                    table.data + z * table.step[0] + y * table.step[1]);
+            for (int i = 0; i < width * channels; i++) {
+                ASSERT_DOUBLE_EQ(expected[at(z, y, 0, 0) + i], row[i]);
+            }
+        }
+    }
+
+    const std::string path = "testfile.volume.bin";
+    ASSERT_TRUE(ii.process_volume(volume, path).get());
+    VolumeQuery in_memory;
+    VolumeQuery mapped;
+    ASSERT_TRUE(in_memory.try_attach(table));
+    ASSERT_TRUE(mapped.try_open(path));
+    EXPECT_EQ(width, mapped.get_width());
+    EXPECT_EQ(height, mapped.get_height());
+    EXPECT_EQ(depth, mapped.get_depth());
+    EXPECT_EQ(channels, mapped.get_channels());
+    for (int i = 0; i < 200; i++) {
+        //cuboids may stick out of volume
+        Cuboid cuboid(int(rng() % (width + 2)) - 1, 
+                int(rng() % (height + 2)) - 1, int(rng() % (depth + 2)) - 1, 
+                int(rng() % width) + 1, int(rng() % height) + 1, 
+                int(rng() % depth) + 1);
+        const int c = int(rng() % channels);
+        double sum = 0;
+        for (int z = std::max(cuboid.z, 0); 
+                z < std::min(cuboid.z + cuboid.depth, depth); z++) {
+            for (int y = std::max(cuboid.y, 0); 
+                    y < std::min(cuboid.y + cuboid.height, height); y++) {
+                for (int x = std::max(cuboid.x, 0); 
+                        x < std::min(cuboid.x + cuboid.width, width); x++) {
+                    sum += volume.data[at(z, y, x, c)];
+                }
+            }
+        }
+        ASSERT_DOUBLE_EQ(sum, in_memory.sum(cuboid, c));
+        ASSERT_DOUBLE_EQ(sum, mapped.sum(cuboid, c));
+    }
+    EXPECT_DOUBLE_EQ(0, mapped.sum(Cuboid(width, 0, 0, 1, 1, 1)));
+    std::remove(path.c_str());
+
+    //value count of crafted header wraps around to fit in small file
+    VolumeFileHeader header;
+    header.width = 1;
+    header.height = 1;
+    header.depth = 2;
+    header.channels = 1;
+    header.row_stride = 1;
+    header.slice_stride = (uint64_t(1) << 63) + 1;
+    {
+        std::ofstream fout{path, std::ios::binary};
+        fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        const double values[2] = {1.0, 2.0};
+        fout.write(reinterpret_cast<const char*>(values), sizeof(values));
+    }
+    EXPECT_FALSE(mapped.try_open(path));
+    std::remove(path.c_str());
+
+    EXPECT_TRUE(ii.integrate_volume(cv::Mat(height, width, CV_8UC1))
+            .get().empty());
+    EXPECT_TRUE(ii.integrate_volume(cv::Mat(3, sizes, CV_MAKETYPE(CV_16S, 1)))
+            .get().empty());
+}
+
+/// Fill image of any supported depth with random values
+static void fill_random(cv::Mat& image, std::mt19937& rng) {
+    const int value_count = image.cols * image.channels();
+    for (int y = 0; y < image.rows; y++) {
+        for (int i = 0; i < value_count; i++) {
+            switch (image.depth()) {
+            case CV_8U: image.ptr<uint8_t>(y)[i] = rng() & 0xff; break;
+            case CV_16U: image.ptr<uint16_t>(y)[i] = rng() & 0xffff; break;
+            case CV_32F: image.ptr<float>(y)[i] = rng() / 4096.0f; break;
+            case CV_64F: image.ptr<double>(y)[i] = rng() / 7.0; break;
+            }
+        }
+    }
+}
+
+/// Value of image of any supported depth as double
+static double get_value(const cv::Mat& image, int y, int i) {
+    switch (image.depth()) {
+    case CV_8U: return image.ptr<uint8_t>(y)[i];
+    case CV_16U: return image.ptr<uint16_t>(y)[i];
+    case CV_32F: return image.ptr<float>(y)[i];
+    case CV_64F: return image.ptr<double>(y)[i];
+    }
+    return 0;
+}
+
+TEST(ImageIntegrator, check_unchanged_depths) {
+    ImageIntegrator ii;
+    EXPECT_TRUE(ii.try_init(2));
+    ii.set_block_shape(8, 4);
+    const int width = 37;
+    const int height = 23;
+    std::mt19937 rng{11};
+    const int types[] = {
+        CV_8UC1, CV_8UC4, CV_16UC1, CV_16UC3, CV_32FC1, CV_32FC(4), CV_64FC1
+    };
+    for (int type : types) {
+        cv::Mat image(height, width, type);
+        fill_random(image, rng);
+        const int value_count = width * image.channels();
+        cv::Mat integral = ii.integrate(image).get();
+        ASSERT_FALSE(integral.empty());
+        ASSERT_EQ(CV_MAKETYPE(CV_64F, image.channels()), integral.type());
+        //integer sums are exact
+        const double tolerance = image.depth() == CV_32F || 
+            image.depth() == CV_64F ? 1e-6 : 0;
+        std::vector<double> upper(value_count, 0.0);
+        for (int y = 0; y < height; y++) {
+            std::vector<double> acc(image.channels(), 0.0);
+            for (int i = 0; i < value_count; i++) {
+                acc[i % image.channels()] += get_value(image, y, i);
+                upper[i] += acc[i % image.channels()];
+                ASSERT_NEAR(upper[i], integral.ptr<double>(y)[i], 
+                        tolerance * upper[i]);
+            }
+        }
+
+        //delta of update() has the same depth as image
+        const cv::Rect dirty(5, 3, 4, 2);
+        cv::Mat pixels(dirty.height, dirty.width, type);
+        fill_random(pixels, rng);
+        ASSERT_FALSE(ii.update(image, integral, dirty, pixels).get().empty());
+        const cv::Mat expected = ii.integrate(image).get();
+        for (int y = 0; y < height; y++) {
+            for (int i = 0; i < value_count; i++) {
+                ASSERT_NEAR(expected.ptr<double>(y)[i], 
+                        integral.ptr<double>(y)[i], 
+                        tolerance * std::abs(expected.ptr<double>(y)[i]));
+            }
+        }
+    }
+    EXPECT_TRUE(ii.integrate(cv::Mat(height, width, CV_MAKETYPE(CV_16S, 1)))
+            .get().empty());
+
+    //16-bit grayscale file keeps its depth and single channel
+    const std::string filename = "testfile16.tif";
+    cv::Mat image(height, width, CV_16UC1);
+    for (int y = 0; y < height; y++) {
+        std::fill(image.ptr<uint16_t>(y), image.ptr<uint16_t>(y) + width, 
+                uint16_t(65535));
+    }
+    cv::imwrite(filename, image);
+    ii.set_unchanged_input(true);
+    ii.set_output_format(ImageIntegrator::OutputFormat::mapped);
+    ii.process(filename);
+    ii.wait();
+    IntegralQuery query;
+    ASSERT_TRUE(query.try_open(filename + ".integral.bin"));
+    EXPECT_EQ(1, query.get_channels());
+    EXPECT_DOUBLE_EQ(65535.0 * width * height, 
+            query.sum(cv::Rect(0, 0, width, height)));
+    query.release();
+    std::remove(filename.c_str());
+    std::remove((filename + ".integral.bin").c_str());
+}